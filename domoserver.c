@@ -1,64 +1,259 @@
 // =========================================================
-// domoserver.c - Serveur HTTP Windows + SQLite pour Domo-Connect
-// Compilation : gcc domoserver.c sqlite3.c -o domoserver.exe -lws2_32 -lsqlite3
+// domoserver.c - Serveur HTTP (Windows / Linux) + SQLite pour Domo-Connect
+// Compilation Windows : gcc domoserver.c sqlite3.c -o domoserver.exe -lws2_32 -lsqlite3 -lz
+// Compilation Linux   : gcc domoserver.c -o domoserver -lsqlite3 -lpthread -lz
+// (sans zlib : ajouter -DDOMO_SANS_ZLIB et retirer -lz, les pages partent non compressées)
+// (en-têtes noyau sans io_uring : ajouter -DDOMO_SANS_IO_URING)
+// Usage : domoserver [--workers N] [--boucle epoll|io_uring|select]   (N = 0 : un worker par cœur)
+//                    [--simulateur hote:port_base]   (contrôleurs simulés, voir simulateur.c)
+//                    [--durabilite-ms N]   (fenêtre d'écriture groupée en base, défaut 100)
+//                    [--stockage origine|sur|equilibre|sd|rapide[,cle=valeur...]]   (profil SQLite, défaut sur)
+//                    [--verbeux]   (une ligne par requête et par commande)
+//         domoserver --bench-parser [iterations]
+//         domoserver --bench-routes [iterations]
+//         domoserver --bench-trames [iterations]
+//         domoserver --bench-update [iterations]
+//         domoserver --bench-stockage [bascules] [profils]   (dans le répertoire du support visé)
+//         domoserver --bench-state [connexions] [secondes]   (contre un serveur déjà lancé)
+//         domoserver --bench-dispatch [commandes] [hote:port_base]   (contre simulateur.c)
+// Flux temps réel : /events (Server-Sent Events) et /ws (WebSocket, commandes + état)
+// Suivi : /dispatch (livraisons aux contrôleurs), /db (requêtes préparées, écriture groupée)
+// /update?...&durable=1 ne répond qu'une fois le changement écrit en base
 // =========================================================
+#ifdef _WIN32
+// select() côté Windows : on relève la limite par défaut (64 sockets)
+#define FD_SETSIZE 1024
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <sqlite3.h>
+#ifndef DOMO_SANS_ZLIB
+#include <zlib.h>
+#endif
 
+// =========================================================
+// ABSTRACTION SOCKETS (Winsock / POSIX)
+// =========================================================
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #pragma comment(lib, "ws2_32.lib")
+typedef int socklen_t;
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/uio.h>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#endif
+
+#ifdef _WIN32
+#define strncasecmp _strnicmp
+#define strcasecmp _stricmp
+#else
+#include <strings.h>
+#endif
+
+// =========================================================
+// THREADS (Win32 / pthreads)
+// =========================================================
+#ifdef _WIN32
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+#define mutex_init(m) InitializeCriticalSection(m)
+#define mutex_lock(m) EnterCriticalSection(m)
+#define mutex_unlock(m) LeaveCriticalSection(m)
+typedef CONDITION_VARIABLE cond_t;
+#define cond_init(c) InitializeConditionVariable(c)
+#define cond_attendre(c, m) SleepConditionVariableCS((c), (m), INFINITE)
+#define cond_signaler(c) WakeConditionVariable(c)
+#define cond_attendre_ms(c, m, ms) SleepConditionVariableCS((c), (m), (DWORD)(ms))
+#else
+#include <pthread.h>
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+#define mutex_init(m) pthread_mutex_init((m), NULL)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+typedef pthread_cond_t cond_t;
+#define cond_init(c) pthread_cond_init((c), NULL)
+#define cond_attendre(c, m) pthread_cond_wait((c), (m))
+#define cond_signaler(c) pthread_cond_signal(c)
+static inline void cond_attendre_ms(cond_t *c, mutex_t *m, int ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+    pthread_cond_timedwait(c, m, &ts);
+}
+#endif
+#include <stdatomic.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #define PORT 8080
 #define DB_FILE "etat_appareils.db"
 #define RECV_BUF 8192
+#define MAX_EVENEMENTS 256
+#define MAX_WORKERS 64
+#define KEEPALIVE_TIMEOUT 5        // secondes d'inactivité avant fermeture d'une connexion persistante
+#define MAX_SORTIE_EN_ATTENTE (1 << 20) // au-delà, on arrête de traiter les requêtes pipelinées
+#define TAILLE_ANNEAU_EVTS 1024    // événements gardés pour la reprise (Last-Event-ID)
+#define FLUX_PING 15               // secondes entre deux messages de maintien sur /events et /ws
+#define DURABLE_TIMEOUT 10         // secondes d'attente de l'écriture en base (/update?durable=1) avant un 503
 // Adresses par défaut alignées avec la base de données
 #define DEFAULT_SIM_IP "192.168.56.1"      // IP par défaut du simulateur (fallback)
 #define DEFAULT_SIM_PORT 60396          // Port par défaut du simulateur (fallback)         
 
+static int verbeux = 0; // --verbeux : journal de chaque requête (hors chemin chaud par défaut)
+
 
-// --- Fonction pour envoyer au simulateur (avec statut de connexion) ---
-void envoyer_au_simulateur(const char *ip, int port, const char *type, const char *input, const char *etat) {
+int reseau_init(void) {
+#ifdef _WIN32
     WSADATA wsa;
-    SOCKET sock;
-    struct sockaddr_in simAddr;
-    char ip_sim[16];
-    
-    // Déterminer l'IP et le port à utiliser
-    const char *final_ip = (ip && strlen(ip) > 0) ? ip : DEFAULT_SIM_IP;
-    int final_port = (port > 0) ? port : DEFAULT_SIM_PORT;
+    return WSAStartup(MAKEWORD(2, 2), &wsa) == 0 ? 0 : -1;
+#else
+    signal(SIGPIPE, SIG_IGN); // un client qui ferme pendant un send() ne doit pas tuer le serveur
+    return 0;
+#endif
+}
 
-    WSAStartup(MAKEWORD(2, 2), &wsa);
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+void reseau_fin(void) {
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
 
-    simAddr.sin_family = AF_INET;
-    simAddr.sin_addr.s_addr = inet_addr(final_ip);
-    simAddr.sin_port = htons(final_port);
+int sock_non_bloquant(SOCKET s) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(s, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(s, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
 
-    // Tentative de connexion
-    if (connect(sock, (struct sockaddr *)&simAddr, sizeof(simAddr)) == SOCKET_ERROR) {
-        printf("❌ Simulateur non connecté. Impossible de joindre l'appareil (%s:%d).\n", final_ip, final_port);
-        closesocket(sock);
-        WSACleanup();
-        return;
-    }
+int sock_bloquant(SOCKET s) {
+#ifdef _WIN32
+    u_long mode = 0;
+    return ioctlsocket(s, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(s, F_SETFL, flags & ~O_NONBLOCK);
+#endif
+}
 
-    char message[256];
-    // Message au format : type:input:etat
-    snprintf(message, sizeof(message), "%s:%s:%s", type, input, etat); 
-    send(sock, message, strlen(message), 0);
-    
-    printf("✅ Simulateur connecté. Commande envoyée à %s:%d : %s\n", final_ip, final_port, message);
+// Vrai si la dernière opération aurait bloqué (socket non bloquant vidé / plein)
+int sock_bloquerait(void) {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
 
-    closesocket(sock);
-    WSACleanup();
+// Vrai si l'appel a été interrompu par un signal et doit simplement être relancé
+int sock_interrompu(void) {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEINTR;
+#else
+    return errno == EINTR;
+#endif
+}
+
+#ifdef _WIN32
+typedef struct { void *(*fn)(void *); void *arg; } LancementThread;
+
+static DWORD WINAPI thread_trampoline(LPVOID p) {
+    LancementThread l = *(LancementThread *)p;
+    free(p);
+    l.fn(l.arg);
+    return 0;
+}
+#endif
+
+int thread_lancer(thread_t *t, void *(*fn)(void *), void *arg) {
+#ifdef _WIN32
+    LancementThread *l = malloc(sizeof(*l));
+    if (!l) return -1;
+    l->fn = fn;
+    l->arg = arg;
+    *t = CreateThread(NULL, 0, thread_trampoline, l, 0, NULL);
+    if (*t == NULL) { free(l); return -1; }
+    return 0;
+#else
+    return pthread_create(t, NULL, fn, arg) == 0 ? 0 : -1;
+#endif
+}
+
+void thread_attendre(thread_t t) {
+#ifdef _WIN32
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+#else
+    pthread_join(t, NULL);
+#endif
+}
+
+void dormir_ms(int ms) {
+#ifdef _WIN32
+    Sleep((DWORD)ms);
+#else
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+#endif
+}
+
+int nb_coeurs(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
 }
 
+
 // =========================================================
 // UTILITAIRES
 // =========================================================
+// Horloge monotone en nanosecondes (mesures des benchmarks)
+double horloge_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER f, t;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart * 1e9 / (double)f.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+#endif
+}
+
 void url_decode(char *dst, const char *src) {
     char a, b;
     while (*src) {
@@ -77,240 +272,2078 @@ void url_decode(char *dst, const char *src) {
     *dst = '\0';
 }
 
-void send_file_response(SOCKET sock, const char *filename, const char *extra_message) {
-    FILE *f = fopen(filename, "rb");
-    if (!f) {
-        const char *nf = "HTTP/1.1 404 Not Found\r\nContent-Type: text/html\r\n\r\n<h1>404 - Page non trouvée</h1>";
-        send(sock, nf, (int)strlen(nf), 0);
+// =========================================================
+// CONTRÔLEURS (pool de connexions persistantes)
+// =========================================================
+// Une connexion TCP longue durée par contrôleur (ip, port), réutilisée pour
+// toutes ses commandes : une commande = un send(). Chaque message
+// "type:input:etat" est terminé par '\n' pour pouvoir les enchaîner sur le
+// même flux. Un thread de surveillance détecte entre deux commandes les
+// connexions fermées par le contrôleur et les rouvre.
+//
+// Disjoncteur par contrôleur : après DISJ_SEUIL échecs consécutifs
+// (connexion ou envoi), il s'ouvre et les commandes échouent immédiatement,
+// sans toucher au réseau. Une fois la pause écoulée (doublée à chaque échec,
+// de DISJ_PAUSE_MIN_MS à DISJ_PAUSE_MAX_MS), une seule tentative de sonde
+// (demi-ouvert) décide de sa fermeture ou d'une nouvelle pause. Le délai de
+// connexion suit le RTT observé (srtt + 4 rttvar, comme TCP) au lieu d'un
+// délai fixe : un contrôleur muet coûte ~100 ms, pas 2 s.
+//
+// Les commandes ne partent jamais depuis un worker HTTP : elles sont déposées
+// dans la file du contrôleur et un thread expéditeur par contrôleur les
+// envoie. Un contrôleur en panne ne ralentit donc que sa propre file ; le
+// résultat de chaque livraison est consultable via /dispatch.
+//
+// Regroupement : l'expéditeur laisse passer une courte fenêtre après la
+// première commande (scène, "tout éteindre"...) puis envoie toute la file en
+// un seul message. Un contrôleur qui annonce "lot" à la connexion reçoit une
+// trame "lot:<n>\n" suivie des n lignes ; les autres reçoivent les lignes
+// texte habituelles, simplement concaténées dans le même send().
+//
+// Trame binaire (contrôleurs annonçant "bin1") : 9 octets au lieu d'une
+// ligne de ~18 caractères, sans snprintf.
+//   [0] 0x80 | version   (bit de poids fort : jamais confondu avec du texte)
+//   [1] type             (TYPE_LUMIERE, TYPE_STORE, TYPE_CLIM)
+//   [2] input            (la chaîne "00010111" sur un octet)
+//   [3] drapeaux         (bit 0 : ON)
+//   [4..7] séquence      (par contrôleur, big-endian)
+//   [8] CRC-8 des octets 0 à 7 (polynôme 0x07)
+// Une commande non représentable (type inconnu, input invalide) part en
+// texte sur le même flux.
+//
+// Accusés de réception (contrôleurs annonçant "ack") : chaque commande reçoit
+// à son premier envoi un numéro de séquence par contrôleur, conservé lors des
+// réémissions ("type:input:etat@<seq>" en texte, champ séquence en binaire).
+// Le contrôleur répond "ack:<seq>" ou "ack:<premier>-<dernier>" et ignore une
+// séquence déjà appliquée (en l'acquittant de nouveau) : une réémission est
+// donc sans effet de bord. Les séquences repartent de 1 à chaque démarrage du
+// serveur : en réponse à l'annonce du contrôleur, "session:<n>" donne un
+// numéro de session tiré au démarrage, et le contrôleur oublie les séquences
+// vues quand il change. Sans accusé dans le délai (RTT adaptatif), les
+// commandes restantes du lot sont réémises avec un délai doublé à chaque
+// tentative, MAX_TENTATIVES fois au plus. Sans "ack", une commande dont le
+// send() a réussi est seulement "envoyee" : rien ne confirme sa livraison.
+//
+// Dernière écriture gagnante : une commande pour une entrée (contrôleur,
+// input) qui a déjà une commande en file, pas encore partie, remplace l'état
+// de celle-ci au lieu de s'ajouter. Seul le dernier état demandé est envoyé ;
+// la livraison de la commande remplacée passe au statut "remplacee".
+#define CONNECT_TIMEOUT_MIN_MS 100     // bornes du délai de connexion adaptatif
+#define CONNECT_TIMEOUT_MAX_MS 2000    // (aussi la valeur initiale, sans mesure de RTT)
+#define POOL_ENVOI_TIMEOUT_MS 2000
+#define DISJ_SEUIL 3
+#define DISJ_PAUSE_MIN_MS 250
+#define DISJ_PAUSE_MAX_MS 30000
+#define POOL_SURVEILLANCE_MS 5000
+#define MAX_FILE_CONTROLEUR 1024      // commandes en attente par contrôleur
+#define TAILLE_ANNEAU_LIVRAISONS 4096 // résultats de livraison consultables
+#define CAPS_TIMEOUT_MS 200           // attente maximale de l'annonce "caps:" après connexion
+#define CAPS_REESSAI_S 300            // ancien contrôleur : délai avant de guetter de nouveau l'annonce
+#define LOT_FENETRE_MS 3              // fenêtre de regroupement après la première commande
+#define LOT_MAX 64                    // commandes par message au plus
+
+#define CAP_LOT 1                     // le contrôleur comprend les trames "lot:<n>"
+#define CAP_BIN1 2                    // le contrôleur comprend les trames binaires version 1
+#define CAP_ACK 4                     // le contrôleur acquitte chaque séquence
+
+#define MAX_TENTATIVES 5
+#define REEMISSION_BASE_MS 100        // 100, 200, 400, 800 ms entre les tentatives
+
+#define TRAME_VERSION 1
+#define TRAME_TAILLE 9
+#define TYPE_LUMIERE 1
+#define TYPE_STORE 2
+#define TYPE_CLIM 3
+
+typedef struct Commande {
+    unsigned long long id;
+    char type[32], input[9], etat[8];
+    double depot;           // horloge_ns à la mise en file
+    double livraison;       // horloge_ns de l'accusé de réception (ou de l'envoi)
+    unsigned seq;           // 0 tant que la commande n'est pas partie
+    long long outbox;       // ligne de la table outbox (0 : commande non persistée)
+    int tentatives;
+    int acquittee;
+    struct Commande *suiv;
+} Commande;
+
+typedef struct Controleur {
+    char ip[16];
+    int port;
+    SOCKET sock;
+    mutex_t mutex;          // une commande à la fois sur le flux
+    atomic_int disjoncteur;          // DISJ_FERME, DISJ_OUVERT ou DISJ_DEMI_OUVERT
+    int echecs_consecutifs;
+    int pause_ms;                    // durée de la dernière ouverture
+    atomic_llong reprise_ns;         // fin de la pause en cours (horloge_ns)
+    double srtt_ms, rttvar_ms;       // RTT lissé (durée des connexions)
+    Commande *file_tete, *file_queue;
+    int file_len;
+    mutex_t mutex_file;
+    cond_t cond_file;
+    thread_t expediteur;
+    atomic_int connecte;
+    atomic_int capacites;   // CAP_*, annoncées par le contrôleur à la connexion (0 : ancien contrôleur)
+    double caps_reessai_ns; // ancien contrôleur : pas d'attente d'annonce avant cette date
+    unsigned seq;           // dernière séquence attribuée (thread expéditeur)
+    char acks[256];         // accusés de réception reçus, ligne incomplète comprise
+    size_t acks_len;
+    atomic_ulong envoyes, connexions, echecs, perdues, lots, octets, rejets, ouvertures;
+    atomic_ulong acquittees, reemissions, latence_us_total, latence_us_max;
+    atomic_ulong fusionnees;         // commandes remplacées en file (dernière écriture gagnante)
+    struct Controleur *suiv;
+} Controleur;
+
+#define DISJ_FERME 0
+#define DISJ_OUVERT 1
+#define DISJ_DEMI_OUVERT 2
+
+#define LIVRAISON_EN_ATTENTE 0
+#define LIVRAISON_OK 1
+#define LIVRAISON_ECHEC 2
+#define LIVRAISON_REMPLACEE 3   // fusionnée dans une commande plus récente de la même entrée
+#define LIVRAISON_ENVOYEE 4     // envoyée à un contrôleur qui n'acquitte pas : livraison non confirmée
+
+#define COMMANDE_INCHANGEE (~0ULL) // commander_appareil : l'appareil était déjà dans cet état
+
+typedef struct {
+    unsigned long long id;
+    int statut;
+    char ip[16];
+    int port;
+    char entree_ip[16];     // entrée de l'appareil (avant redirection vers le simulateur)
+    char entree_input[9];
+    long long outbox;       // ligne outbox de la commande (0 : aucune)
+    double latence_ms;      // de la mise en file à l'accusé de réception (ou à l'envoi)
+    int tentatives;
+    int acquittee;
+} Livraison;
+
+static Controleur *controleurs = NULL;
+static mutex_t mutex_controleurs;
+static Livraison anneau_livraisons[TAILLE_ANNEAU_LIVRAISONS];
+static unsigned long long derniere_commande = 0;
+static mutex_t mutex_livraisons;
+static atomic_ulong commandes_inchangees = 0; // ni écriture en base ni envoi
+
+static void *controleur_expedier(void *arg);
+void outbox_noter_livree(long long id, int acquittee);
+
+// Retrouve (ou crée) l'entrée du pool pour ip:port
+Controleur *controleur_obtenir(const char *ip, int port) {
+    mutex_lock(&mutex_controleurs);
+    Controleur *k = controleurs;
+    while (k && (k->port != port || strcmp(k->ip, ip) != 0)) k = k->suiv;
+    if (!k && (k = calloc(1, sizeof(*k))) != NULL) {
+        snprintf(k->ip, sizeof(k->ip), "%s", ip);
+        k->port = port;
+        k->sock = INVALID_SOCKET;
+        mutex_init(&k->mutex);
+        mutex_init(&k->mutex_file);
+        cond_init(&k->cond_file);
+        if (thread_lancer(&k->expediteur, controleur_expedier, k) != 0) {
+            free(k);
+            k = NULL;
+        } else {
+            k->suiv = controleurs;
+            controleurs = k;
+        }
+    }
+    mutex_unlock(&mutex_controleurs);
+    return k;
+}
+
+static void controleur_fermer(Controleur *k) {
+    if (k->sock != INVALID_SOCKET) closesocket(k->sock);
+    k->sock = INVALID_SOCKET;
+    k->connecte = 0;
+}
+
+// Échantillon de RTT (ms), lissé comme le RTO de TCP (RFC 6298)
+static void controleur_rtt(Controleur *k, double r) {
+    if (k->srtt_ms == 0) {
+        k->srtt_ms = r;
+        k->rttvar_ms = r / 2;
+    } else {
+        double ecart = k->srtt_ms > r ? k->srtt_ms - r : r - k->srtt_ms;
+        k->rttvar_ms = 0.75 * k->rttvar_ms + 0.25 * ecart;
+        k->srtt_ms = 0.875 * k->srtt_ms + 0.125 * r;
+    }
+}
+
+int controleur_delai_ms(const Controleur *k) {
+    if (k->srtt_ms == 0) return CONNECT_TIMEOUT_MAX_MS;
+    double d = k->srtt_ms + 4 * k->rttvar_ms;
+    if (d < CONNECT_TIMEOUT_MIN_MS) return CONNECT_TIMEOUT_MIN_MS;
+    if (d > CONNECT_TIMEOUT_MAX_MS) return CONNECT_TIMEOUT_MAX_MS;
+    return (int)d;
+}
+
+// Faux tant que le disjoncteur est ouvert et la pause pas écoulée
+int controleur_disponible(const Controleur *k) {
+    return k->disjoncteur == DISJ_FERME || (long long)horloge_ns() >= k->reprise_ns;
+}
+
+static void controleur_succes(Controleur *k) {
+    k->echecs_consecutifs = 0;
+    if (k->disjoncteur != DISJ_FERME)
+        printf("⚡ Disjoncteur refermé pour %s:%d.\n", k->ip, k->port);
+    k->disjoncteur = DISJ_FERME;
+    k->pause_ms = 0;
+}
+
+static void controleur_echec(Controleur *k) {
+    k->echecs_consecutifs++;
+    if (k->disjoncteur == DISJ_FERME && k->echecs_consecutifs < DISJ_SEUIL) return;
+    // Sonde ratée ou seuil atteint : (ré)ouverture, pause doublée
+    k->pause_ms = k->pause_ms ? k->pause_ms * 2 : DISJ_PAUSE_MIN_MS;
+    if (k->pause_ms > DISJ_PAUSE_MAX_MS) k->pause_ms = DISJ_PAUSE_MAX_MS;
+    k->reprise_ns = (long long)(horloge_ns() + k->pause_ms * 1e6);
+    if (k->disjoncteur == DISJ_FERME) {
+        k->ouvertures++;
+        printf("⚡ Disjoncteur ouvert pour %s:%d après %d échecs (pause %d ms).\n", k->ip, k->port, k->echecs_consecutifs, k->pause_ms);
+    }
+    k->disjoncteur = DISJ_OUVERT;
+}
+
+// Session de ce processus, donnée en réponse à "caps:" (jamais 0)
+static unsigned session_serveur;
+
+// Négociation des capacités : rien n'est envoyé sans y être invité. Un
+// contrôleur récent s'annonce dès l'acceptation par une ligne "caps:<liste>"
+// (ex. "caps:lot,bin1,ack") et reçoit en retour "session:<n>\n". Un ancien
+// contrôleur ne dit rien : il attend une seule commande "type:input:etat" par
+// connexion. Il est alors reconnu comme tel pendant CAPS_REESSAI_S, sans
+// nouvelle attente d'annonce à chaque connexion.
+static void controleur_negocier(Controleur *k) {
+    char rep[128];
+    size_t len = 0;
+    k->capacites = 0;
+    if (horloge_ns() < k->caps_reessai_ns) return;
+    int attente = controleur_delai_ms(k) < CAPS_TIMEOUT_MS ? controleur_delai_ms(k) : CAPS_TIMEOUT_MS;
+    double limite = horloge_ns() + attente * 1e6;
+    while (len < sizeof(rep) - 1 && !memchr(rep, '\n', len)) {
+        double reste = limite - horloge_ns();
+        fd_set r;
+        FD_ZERO(&r);
+        FD_SET(k->sock, &r);
+        struct timeval tv = { 0, (long)(reste / 1000) };
+        int n = reste > 0 && select((int)k->sock + 1, &r, NULL, NULL, &tv) > 0
+                ? recv(k->sock, rep + len, (int)(sizeof(rep) - 1 - len), 0) : 0;
+        if (n <= 0) {
+            k->caps_reessai_ns = horloge_ns() + CAPS_REESSAI_S * 1e9;
+            return;
+        }
+        len += (size_t)n;
+    }
+    rep[len] = '\0';
+    if (strncmp(rep, "caps:", 5) != 0) {
+        k->caps_reessai_ns = horloge_ns() + CAPS_REESSAI_S * 1e9;
         return;
     }
+    int caps = 0;
+    for (char *p = rep + 5; *p && *p != '\n';) {
+        size_t l = strcspn(p, ",\r\n");
+        if (l == 3 && strncmp(p, "lot", 3) == 0) caps |= CAP_LOT;
+        else if (l == 4 && strncmp(p, "bin1", 4) == 0) caps |= CAP_BIN1;
+        else if (l == 3 && strncmp(p, "ack", 3) == 0) caps |= CAP_ACK;
+        p += l;
+        if (*p == ',') p++;
+    }
+    char session[24];
+    int n_session = snprintf(session, sizeof(session), "session:%08x\n", session_serveur);
+    if (send(k->sock, session, n_session, 0) != n_session) return;
+    k->caps_reessai_ns = 0;
+    k->capacites = caps;
+}
 
-    static char buffer[32768];
-    size_t n = fread(buffer, 1, sizeof(buffer)-1, f);
-    buffer[n] = '\0';
-    fclose(f);
+// Connexion avec délai adaptatif (connect non bloquant + select), puis socket
+// bloquant avec délai d'envoi. Appelée avec k->mutex.
+static int controleur_connecter(Controleur *k) {
+    struct sockaddr_in adr;
+    memset(&adr, 0, sizeof(adr));
+    adr.sin_family = AF_INET;
+    adr.sin_addr.s_addr = inet_addr(k->ip);
+    adr.sin_port = htons(k->port);
 
-    char response[65536];
-    // Reste de la fonction send_file_response (non modifiée pour la concision)
-    if (extra_message && strlen(extra_message) > 0) {
-        char *bodyPos = strstr(buffer, "<body");
-        if (bodyPos) {
-            char *endTag = strchr(bodyPos, '>');
-            if (endTag) {
-                endTag++;
-                snprintf(response, sizeof(response),
-                    "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n"
-                    "%.*s<p style='color:crimson;font-weight:700;'>%s</p>%s",
-                    (int)(endTag - buffer), buffer, extra_message, endTag);
-                send(sock, response, (int)strlen(response), 0);
-                return;
+    int delai_ms = controleur_delai_ms(k);
+    double debut = horloge_ns();
+    SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+    int ok = s != INVALID_SOCKET && sock_non_bloquant(s) == 0;
+#ifndef _WIN32
+    if (ok && s >= FD_SETSIZE) ok = 0;
+#endif
+    if (ok && connect(s, (struct sockaddr *)&adr, sizeof(adr)) != 0) {
+#ifdef _WIN32
+        ok = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        ok = errno == EINPROGRESS;
+#endif
+        if (ok) {
+            fd_set w;
+            FD_ZERO(&w);
+            FD_SET(s, &w);
+            struct timeval tv = { delai_ms / 1000, (delai_ms % 1000) * 1000 };
+            int err = 0;
+            socklen_t len = sizeof(err);
+            ok = select((int)s + 1, NULL, &w, NULL, &tv) == 1
+                 && getsockopt(s, SOL_SOCKET, SO_ERROR, (char *)&err, &len) == 0 && err == 0;
+        }
+    }
+    if (ok) ok = sock_bloquant(s) == 0;
+    if (!ok) {
+        if (s != INVALID_SOCKET) closesocket(s);
+        k->echecs++;
+        controleur_echec(k);
+        return -1;
+    }
+    controleur_rtt(k, (horloge_ns() - debut) / 1e6); // durée du handshake ≈ 1 RTT
+
+    int un = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&un, sizeof(un)); // une commande = un segment, sans attente de Nagle
+    setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, (const char *)&un, sizeof(un));
+#ifdef _WIN32
+    DWORD delai = POOL_ENVOI_TIMEOUT_MS;
+#else
+    struct timeval delai = { POOL_ENVOI_TIMEOUT_MS / 1000, (POOL_ENVOI_TIMEOUT_MS % 1000) * 1000 };
+#endif
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char *)&delai, sizeof(delai));
+
+    k->sock = s;
+    k->connecte = 1;
+    k->acks_len = 0;
+    k->connexions++;
+    controleur_negocier(k);
+    return 0;
+}
+
+// Ouvre la connexion si le disjoncteur le permet ; une tentative faite
+// disjoncteur ouvert est la sonde du demi-ouvert. Appelée avec k->mutex.
+static int controleur_ouvrir(Controleur *k) {
+    if (!controleur_disponible(k)) {
+        k->rejets++;
+        return -1;
+    }
+    if (k->disjoncteur == DISJ_OUVERT) k->disjoncteur = DISJ_DEMI_OUVERT;
+    return controleur_connecter(k);
+}
+
+// Contrôle de santé sans bloquer : une connexion lisible qui renvoie 0 (ou une
+// erreur) a été fermée par le contrôleur. Ce qu'il a envoyé est gardé pour
+// l'expéditeur (accusés de réception arrivés entre deux attentes).
+static int controleur_vivant(Controleur *k) {
+    if (k->sock == INVALID_SOCKET) return 0;
+    fd_set r;
+    FD_ZERO(&r);
+    FD_SET(k->sock, &r);
+    struct timeval tv = { 0, 0 };
+    if (select((int)k->sock + 1, &r, NULL, NULL, &tv) <= 0) return 1;
+    char poubelle[256];
+    size_t place = sizeof(k->acks) - 1 - k->acks_len;
+    int n = place > 0 ? recv(k->sock, k->acks + k->acks_len, (int)place, 0) : recv(k->sock, poubelle, sizeof(poubelle), 0);
+    if (n > 0 && place > 0) k->acks_len += (size_t)n;
+    return n > 0;
+}
+
+static int envoyer_tout(SOCKET s, const char *data, size_t len) {
+    while (len > 0) {
+        int n = send(s, data, (int)len, 0);
+        if (n < 0 && sock_interrompu()) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Envoie un message sur la connexion du pool. Si la connexion réutilisée
+// s'avère morte, une seule reconnexion immédiate est tentée. Échoue sans
+// attendre tant que le disjoncteur est ouvert.
+int controleur_envoyer(Controleur *k, const char *msg, size_t len) {
+    int r = -1;
+    mutex_lock(&k->mutex);
+    for (int essai = 0; essai < 2 && r != 0; essai++) {
+        if (k->sock != INVALID_SOCKET && !controleur_vivant(k)) controleur_fermer(k);
+        if (k->sock == INVALID_SOCKET && controleur_ouvrir(k) != 0) break;
+        if (envoyer_tout(k->sock, msg, len) == 0) {
+            controleur_succes(k);
+            r = 0;
+        } else {
+            controleur_fermer(k);
+            controleur_echec(k);
+        }
+    }
+    mutex_unlock(&k->mutex);
+    return r;
+}
+
+// Thread de surveillance : ferme les connexions mortes et rouvre celles des
+// contrôleurs déjà contactés (c'est aussi lui qui sonde un disjoncteur ouvert
+// quand aucune commande n'arrive).
+static void *pool_surveiller(void *arg) {
+    (void)arg;
+    while (1) {
+        dormir_ms(POOL_SURVEILLANCE_MS);
+        mutex_lock(&mutex_controleurs);
+        Controleur *k = controleurs; // liste en ajout seul : on peut la parcourir hors verrou
+        mutex_unlock(&mutex_controleurs);
+        for (; k; k = k->suiv) {
+            mutex_lock(&k->mutex);
+            if (k->sock != INVALID_SOCKET && !controleur_vivant(k)) {
+                printf("🔌 Connexion au contrôleur %s:%d perdue, reconnexion.\n", k->ip, k->port);
+                controleur_fermer(k);
             }
+            // Un ancien contrôleur attend une commande par connexion : pas de connexion d'avance
+            if (k->sock == INVALID_SOCKET && k->capacites && controleur_disponible(k) && controleur_ouvrir(k) == 0)
+                controleur_succes(k);
+            mutex_unlock(&k->mutex);
         }
-        snprintf(response, sizeof(response),
-                      "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n%s"
-                      "<p style='color:crimson;'>%s</p>", buffer, extra_message);
-        send(sock, response, (int)strlen(response), 0);
-    } else {
-        snprintf(response, sizeof(response),
-                      "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n%s",
-                      buffer);
-        send(sock, response, (int)strlen(response), 0);
     }
+    return NULL;
 }
 
-void send_404_response(SOCKET sock) {
-    const char *nf = "HTTP/1.1 404 Not Found\r\nContent-Type: text/html\r\n\r\n<h1>404 - Page non trouvée</h1>";
-    send(sock, nf, (int)strlen(nf), 0);
+// Résultat d'une commande, lu par /dispatch tant qu'il est dans l'anneau
+static void livraison_noter(unsigned long long id, int statut, double latence_ms, int tentatives, int acquittee) {
+    mutex_lock(&mutex_livraisons);
+    Livraison *l = &anneau_livraisons[id % TAILLE_ANNEAU_LIVRAISONS];
+    if (l->id == id) {
+        l->statut = statut;
+        l->latence_ms = latence_ms;
+        l->tentatives = tentatives;
+        l->acquittee = acquittee;
+    }
+    mutex_unlock(&mutex_livraisons);
 }
-// =========================================================
-// DATABASE
-// =========================================================
-void initDB(sqlite3 *db) {
-    char *err = NULL;
-    const char *sql =
-        "CREATE TABLE IF NOT EXISTS etat_appareils ("
-        "id INTEGER PRIMARY KEY AUTOINCREMENT, "
-        "appareil TEXT UNIQUE, "
-        "etat TEXT, "
-        "ip TEXT, " 
-        "input TEXT, " 
-        "port INTEGER DEFAULT 49644, " 
-        "compteur_on INTEGER DEFAULT 0, "
-        "compteur_off INTEGER DEFAULT 0, "
-        "dernier_changement DATETIME DEFAULT CURRENT_TIMESTAMP);";
-    if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
-        fprintf(stderr, "Erreur creation table: %s\n", err);
-        sqlite3_free(err);
+
+// 0 si l'id n'est plus (ou pas) dans l'anneau
+int livraison_lire(unsigned long long id, Livraison *out) {
+    mutex_lock(&mutex_livraisons);
+    *out = anneau_livraisons[id % TAILLE_ANNEAU_LIVRAISONS];
+    mutex_unlock(&mutex_livraisons);
+    return id != 0 && out->id == id;
+}
+
+// Vrai si une livraison de la ligne outbox est encore en cours (en file ou
+// en attente d'accusé) : la relance périodique de l'outbox ne la double pas
+int livraison_en_cours(long long outbox) {
+    int en_cours = 0;
+    mutex_lock(&mutex_livraisons);
+    for (int i = 0; i < TAILLE_ANNEAU_LIVRAISONS && !en_cours; i++)
+        en_cours = anneau_livraisons[i].outbox == outbox && anneau_livraisons[i].statut == LIVRAISON_EN_ATTENTE;
+    mutex_unlock(&mutex_livraisons);
+    return en_cours;
+}
+
+static unsigned char table_crc8[256];
+
+static void crc8_init(void) {
+    for (int v = 0; v < 256; v++) {
+        unsigned char crc = (unsigned char)v;
+        for (int i = 0; i < 8; i++) crc = (unsigned char)(crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1);
+        table_crc8[v] = crc;
     }
-    printf("[DB] Table prête.\n");
 }
 
+static unsigned char crc8(const unsigned char *p, size_t n) {
+    unsigned char crc = 0;
+    while (n--) crc = table_crc8[crc ^ *p++];
+    return crc;
+}
 
-void resetDB(sqlite3 *db) {
-    const char *del = "DELETE FROM etat_appareils;";
-    sqlite3_exec(db, del, NULL, NULL, NULL);
-    // On ne fait pas initDB ici pour ne pas avoir de conflit avec l'initialisation de main()
-    printf("[DB] Base '%s' réinitialisée.\n", DB_FILE);
+// Encode une commande en trame binaire ; 0 si elle doit partir en texte
+size_t trame_encoder(unsigned char *out, const char *type, const char *input, const char *etat, unsigned seq) {
+    int code = strcmp(type, "light") == 0 ? TYPE_LUMIERE
+             : strcmp(type, "store") == 0 ? TYPE_STORE
+             : strcmp(type, "climate") == 0 ? TYPE_CLIM : 0;
+    if (!code) return 0;
+    unsigned octet = 0;
+    int i = 0;
+    for (; input[i]; i++) {
+        if (i >= 8 || (input[i] != '0' && input[i] != '1')) return 0;
+        octet = octet << 1 | (unsigned)(input[i] - '0');
+    }
+    if (i == 0) return 0;
+    out[0] = 0x80 | TRAME_VERSION;
+    out[1] = (unsigned char)code;
+    out[2] = (unsigned char)octet;
+    out[3] = strcmp(etat, "ON") == 0 ? 1 : 0;
+    out[4] = (unsigned char)(seq >> 24);
+    out[5] = (unsigned char)(seq >> 16);
+    out[6] = (unsigned char)(seq >> 8);
+    out[7] = (unsigned char)seq;
+    out[8] = crc8(out, 8);
+    return TRAME_TAILLE;
 }
 
-// Fonction pour obtenir tous les détails de l'appareil
-void getAppareilDetails(sqlite3 *db, const char *nom, char *ip_out, size_t ip_len, char *input_out, size_t input_len, int *port_out, char *etat_out, size_t etat_len) {
-    const char *sql = "SELECT ip, input, port, etat FROM etat_appareils WHERE appareil = ?;";
-    sqlite3_stmt *stmt = NULL;
-    
-    // Valeurs par défaut/Fallback
-    strncpy(ip_out, DEFAULT_SIM_IP, ip_len);
-    strncpy(input_out, "00000000", input_len);
-    *port_out = DEFAULT_SIM_PORT;
-    strncpy(etat_out, "OFF", etat_len); 
+// Marque acquittées les commandes du lot dont la séquence est dans [de, a]
+static int acks_appliquer(Commande **lot, int nb, unsigned de, unsigned a) {
+    int n = 0;
+    double maintenant = horloge_ns();
+    for (int i = 0; i < nb; i++) {
+        if (!lot[i]->acquittee && lot[i]->seq >= de && lot[i]->seq <= a) {
+            lot[i]->acquittee = 1;
+            lot[i]->livraison = maintenant;
+            n++;
+        }
+    }
+    return n;
+}
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, nom, -1, SQLITE_STATIC);
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            const unsigned char *ip_db = sqlite3_column_text(stmt, 0);
-            const unsigned char *input_db = sqlite3_column_text(stmt, 1);
-            int port_db = sqlite3_column_int(stmt, 2);
-            const unsigned char *etat_db = sqlite3_column_text(stmt, 3);
-            
-            if (ip_db) strncpy(ip_out, (const char*)ip_db, ip_len);
-            if (input_db) strncpy(input_out, (const char*)input_db, input_len);
-            *port_out = port_db;
-            if (etat_db) strncpy(etat_out, (const char*)etat_db, etat_len);
+// Attend les accusés "ack:<seq>" / "ack:<de>-<a>" des commandes envoyées,
+// jusqu'à ce qu'il n'en manque plus ou que le délai expire. Retourne le
+// nombre de commandes encore sans accusé. Appelée avec k->mutex.
+static int controleur_attendre_acks(Controleur *k, Commande **lot, int nb, int manquants, int delai_ms) {
+    double limite = horloge_ns() + delai_ms * 1e6;
+    while (manquants > 0 && k->sock != INVALID_SOCKET) {
+        // Lignes complètes déjà reçues
+        char *fin;
+        while ((fin = memchr(k->acks, '\n', k->acks_len)) != NULL) {
+            *fin = '\0';
+            unsigned de, a;
+            int champs = sscanf(k->acks, "ack:%u-%u", &de, &a);
+            if (champs == 1) a = de;
+            if (champs >= 1) manquants -= acks_appliquer(lot, nb, de, a);
+            size_t ligne = (size_t)(fin - k->acks) + 1;
+            memmove(k->acks, k->acks + ligne, k->acks_len - ligne);
+            k->acks_len -= ligne;
         }
+        if (manquants == 0) break;
+        if (k->acks_len >= sizeof(k->acks) - 1) k->acks_len = 0; // ligne aberrante : on l'oublie
+
+        double reste = limite - horloge_ns();
+        if (reste <= 0) break;
+        fd_set r;
+        FD_ZERO(&r);
+        FD_SET(k->sock, &r);
+        struct timeval tv = { (long)(reste / 1e9), (long)((long long)(reste / 1000) % 1000000) };
+        if (select((int)k->sock + 1, &r, NULL, NULL, &tv) <= 0) break;
+        int n = recv(k->sock, k->acks + k->acks_len, (int)(sizeof(k->acks) - 1 - k->acks_len), 0);
+        if (n <= 0) { // connexion perdue : les commandes restantes seront réémises
+            controleur_fermer(k);
+            controleur_echec(k);
+            break;
+        }
+        k->acks_len += (size_t)n;
     }
-    if (stmt) sqlite3_finalize(stmt);
+    return manquants;
 }
 
+// Ancien contrôleur : contrat d'origine, un message "type:input:etat" (sans
+// '\n') par connexion, fermée aussitôt après l'envoi. Retourne le nombre de
+// commandes envoyées. Appelée avec k->mutex.
+static int controleur_envoyer_un_par_un(Controleur *k, Commande **lot, int nb) {
+    char message[64];
+    int envoyees = 0;
+    for (int i = 0; i < nb; i++) {
+        Commande *c = lot[i];
+        if (c->acquittee) continue;
+        if (k->sock == INVALID_SOCKET && controleur_ouvrir(k) != 0) break;
+        int n = snprintf(message, sizeof(message), "%s:%s:%s", c->type, c->input, c->etat);
+        c->tentatives++;
+        int ok = envoyer_tout(k->sock, message, (size_t)n) == 0;
+        controleur_fermer(k);
+        if (!ok) {
+            controleur_echec(k);
+            break;
+        }
+        controleur_succes(k);
+        c->acquittee = 1; // envoyée : sans accusé, c'est tout ce qu'on saura
+        c->livraison = horloge_ns();
+        k->octets += (unsigned long)n;
+        envoyees++;
+    }
+    return envoyees;
+}
 
-void getEtat(sqlite3 *db, const char *nom, char *etat_out, size_t outlen) {
-    char ip[16], input[9], etat[32];
-    int port;
-    getAppareilDetails(db, nom, ip, sizeof(ip), input, sizeof(input), &port, etat, sizeof(etat));
-    strncpy(etat_out, etat, outlen);
+// Construit le message des commandes du lot pas encore acquittées. Les
+// séquences sont attribuées au premier envoi et réutilisées ensuite.
+static size_t lot_encoder(Controleur *k, Commande **lot, int nb, int caps, char *message, size_t cap, int *nb_texte) {
+    int restants = 0;
+    for (int i = 0; i < nb; i++) restants += !lot[i]->acquittee;
+    size_t n = 0;
+    *nb_texte = 0;
+    // Trames binaires si le contrôleur les accepte ; sinon message au format
+    // type:input:etat (terminé par '\n' sur la connexion persistante),
+    // précédé de "lot:<n>" si le contrôleur sait traiter un lot d'un bloc
+    if (restants > 1 && (caps & CAP_LOT) && !(caps & CAP_BIN1)) n += (size_t)snprintf(message, cap, "lot:%d\n", restants);
+    for (int i = 0; i < nb; i++) {
+        Commande *c = lot[i];
+        if (c->acquittee) continue;
+        if (!c->seq) {
+            if (++k->seq == 0) k->seq = 1; // 0 est réservé à "pas encore envoyée"
+            c->seq = k->seq;
+        }
+        size_t t = (caps & CAP_BIN1) ? trame_encoder((unsigned char *)message + n, c->type, c->input, c->etat, c->seq) : 0;
+        if (!t) {
+            if (caps & CAP_ACK) t = (size_t)snprintf(message + n, cap - n, "%s:%s:%s@%u\n", c->type, c->input, c->etat, c->seq);
+            else t = (size_t)snprintf(message + n, cap - n, "%s:%s:%s\n", c->type, c->input, c->etat);
+            (*nb_texte)++;
+        }
+        n += t;
+    }
+    return n;
 }
 
+// Thread expéditeur d'un contrôleur : vide sa file dans l'ordre de dépôt,
+// par lots de LOT_MAX commandes au plus, en réémettant ce qui n'est pas acquitté.
+static void *controleur_expedier(void *arg) {
+    Controleur *k = arg;
+    Commande *lot[LOT_MAX];
+    char message[16 + LOT_MAX * 80]; // "lot:<n>" + n lignes type:input:etat@seq
+    while (1) {
+        mutex_lock(&k->mutex_file);
+        while (!k->file_tete) cond_attendre(&k->cond_file, &k->mutex_file);
+        // Fenêtre de regroupement : les commandes suivantes d'une scène arrivent
+        // en quelques centaines de microsecondes
+        double limite = k->file_tete->depot + LOT_FENETRE_MS * 1e6;
+        while (k->file_len < LOT_MAX) {
+            double reste = limite - horloge_ns();
+            if (reste <= 0) break;
+            cond_attendre_ms(&k->cond_file, &k->mutex_file, (int)(reste / 1e6) + 1);
+        }
+        int nb = 0;
+        while (k->file_tete && nb < LOT_MAX) {
+            lot[nb++] = k->file_tete;
+            k->file_tete = k->file_tete->suiv;
+            k->file_len--;
+        }
+        if (!k->file_tete) k->file_queue = NULL;
+        mutex_unlock(&k->mutex_file);
+
+        int manquants = nb, nb_texte = 0, caps = 0;
+        size_t n = 0;
+        for (int tentative = 0; tentative < MAX_TENTATIVES && manquants > 0; tentative++) {
+            if (tentative > 0) {
+                if (!controleur_disponible(k)) break; // disjoncteur ouvert : inutile d'insister
+                k->reemissions += (unsigned long)manquants;
+                dormir_ms(REEMISSION_BASE_MS << (tentative - 1));
+            }
+            // Connexion (et négociation) avant l'encodage : le format dépend des capacités
+            mutex_lock(&k->mutex);
+            int pret = k->sock != INVALID_SOCKET || controleur_ouvrir(k) == 0;
+            mutex_unlock(&k->mutex);
+            if (!pret) continue;
+            caps = k->capacites;
+            if (!caps) {
+                mutex_lock(&k->mutex);
+                manquants -= controleur_envoyer_un_par_un(k, lot, nb);
+                mutex_unlock(&k->mutex);
+                nb_texte = nb;
+                continue;
+            }
+            n = lot_encoder(k, lot, nb, caps, message, sizeof(message), &nb_texte);
+            for (int i = 0; i < nb; i++) if (!lot[i]->acquittee) lot[i]->tentatives++;
+            if (controleur_envoyer(k, message, n) != 0) continue;
+            k->octets += (unsigned long)n;
+            if (n > 0 && manquants > 1) k->lots++;
 
-void majEtat(sqlite3 *db, const char *nom, const char *etat) {
-    char actuel[32];
-    getEtat(db, nom, actuel, sizeof(actuel));
+            caps = k->capacites; // la connexion a pu être (re)négociée par l'envoi
+            if (!(caps & CAP_ACK)) {
+                manquants -= acks_appliquer(lot, nb, 0, ~0u); // sans ack : envoyé, non confirmé
+            } else {
+                mutex_lock(&k->mutex);
+                manquants = controleur_attendre_acks(k, lot, nb, manquants, controleur_delai_ms(k));
+                mutex_unlock(&k->mutex);
+            }
+        }
 
-    // Ajout si l'appareil n'existe pas (pour les appareils "simples" comme 'lumiere')
-    if (strcmp(actuel, "OFF") == 0 && strcmp(etat, "OFF") != 0) {
-        // Tente une insertion si l'appareil est inconnu et qu'on l'allume.
-        // On suppose que les appareils principaux sont déjà insérés.
-        char sql_insert[256];
-        snprintf(sql_insert, sizeof(sql_insert),
-            "INSERT OR IGNORE INTO etat_appareils (appareil, etat, ip, input) VALUES ('%s', '%s', '%s', '%s');",
-            nom, etat, DEFAULT_SIM_IP, "00000000"); 
-        sqlite3_exec(db, sql_insert, 0, 0, 0);
+        double maintenant = horloge_ns();
+        for (int i = 0; i < nb; i++) {
+            Commande *c = lot[i];
+            double latence = ((c->acquittee ? c->livraison : maintenant) - c->depot) / 1e6;
+            int statut = !c->acquittee ? LIVRAISON_ECHEC : (caps & CAP_ACK) ? LIVRAISON_OK : LIVRAISON_ENVOYEE;
+            livraison_noter(c->id, statut, latence, c->tentatives, statut == LIVRAISON_OK);
+            if (!c->acquittee) { k->perdues++; continue; }
+            if (c->outbox) outbox_noter_livree(c->outbox, statut == LIVRAISON_OK);
+            unsigned long us = (unsigned long)(latence * 1000);
+            k->envoyes++;
+            if (caps & CAP_ACK) k->acquittees++;
+            k->latence_us_total += us;
+            if (us > k->latence_us_max) k->latence_us_max = us;
+        }
+        if (manquants == nb) {
+            printf("❌ Simulateur non connecté. Impossible de joindre l'appareil (%s:%d).\n", k->ip, k->port);
+        } else if (manquants > 0) {
+            printf("❌ %d commande(s) sur %d non acquittée(s) par %s:%d après %d tentatives.\n", manquants, nb, k->ip, k->port, MAX_TENTATIVES);
+        } else if (!verbeux) {
+            // Livraison réussie : rien à signaler (suivi par /dispatch)
+        } else if (!caps) {
+            printf("✅ Simulateur connecté. %d commande(s) envoyée(s) à %s:%d, une par connexion (sans accusé)\n", nb, k->ip, k->port);
+        } else if (nb == 1) {
+            if (nb_texte) message[n - 1] = '\0';
+            printf("✅ Simulateur connecté. Commande envoyée à %s:%d : %s\n", k->ip, k->port,
+                   nb_texte ? message : "trame binaire");
+        } else {
+            printf("✅ Simulateur connecté. Lot de %d commandes envoyé à %s:%d (%s)\n", nb, k->ip, k->port,
+                   nb_texte < nb ? "trames binaires" : (caps & CAP_LOT) ? "trame lot" : "texte");
+        }
+        for (int i = 0; i < nb; i++) free(lot[i]);
     }
-    
-    // Logique de mise à jour et incrémentation des compteurs ON/OFF
-    const char *sql = "UPDATE etat_appareils SET etat=?, dernier_changement=CURRENT_TIMESTAMP WHERE appareil=?;";
+    return NULL;
+}
 
-    if (strcmp(etat, "ON") == 0 && strcmp(actuel, "ON") != 0)
-        sql = "UPDATE etat_appareils SET etat=?, dernier_changement=CURRENT_TIMESTAMP, compteur_on = compteur_on + 1 WHERE appareil=?;";
-    else if (strcmp(etat, "OFF") == 0 && strcmp(actuel, "OFF") != 0)
-        sql = "UPDATE etat_appareils SET etat=?, dernier_changement=CURRENT_TIMESTAMP, compteur_off = compteur_off + 1 WHERE appareil=?;";
+void pool_init(void) {
+    thread_t t;
+    mutex_init(&mutex_controleurs);
+    mutex_init(&mutex_livraisons);
+    crc8_init();
+    // Heure, horloge monotone et adresse de pile (ASLR) : deux démarrages
+    // successifs n'annoncent pas la même session
+    session_serveur = (unsigned)time(NULL) * 2654435761u ^ (unsigned)(long long)horloge_ns()
+                      ^ (unsigned)(size_t)&t;
+    if (!session_serveur) session_serveur = 1;
+    if (thread_lancer(&t, pool_surveiller, NULL) != 0)
+        fprintf(stderr, "thread de surveillance du pool non lancé\n");
+}
 
+// Redirection de tous les contrôleurs vers le simulateur local (simulateur.c) :
+// avec --simulateur hote:base, a.b.c.N part vers hote:(base + N), ce qui
+// correspond à la disposition par défaut du simulateur.
+static char simulateur_hote[16]; // adresse IPv4 (inet_addr)
+static int simulateur_base = 0;
 
-    sqlite3_stmt *stmt = NULL;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, etat, -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, nom, -1, SQLITE_STATIC);
-        sqlite3_step(stmt);
+int simulateur_rediriger(const char *cible) {
+    const char *deux_points = strrchr(cible, ':');
+    if (!deux_points || deux_points == cible || (size_t)(deux_points - cible) >= sizeof(simulateur_hote)
+        || atoi(deux_points + 1) <= 0) {
+        fprintf(stderr, "Cible de simulateur invalide : %s (attendu hote:port_base)\n", cible);
+        return -1;
     }
-    if (stmt) sqlite3_finalize(stmt);
+    memcpy(simulateur_hote, cible, (size_t)(deux_points - cible));
+    simulateur_hote[deux_points - cible] = '\0';
+    simulateur_base = atoi(deux_points + 1);
+    printf("🧪 Contrôleurs redirigés vers le simulateur %s (port %d + dernier octet de l'IP)\n", simulateur_hote, simulateur_base);
+    return 0;
 }
 
-// Fonction d'insertion des données initiales (vos 96 appareils)
-void insert_initial_devices(sqlite3 *db) {
-    // Format: "Nom de l'appareil", "IP", "Input", "État initial", "Port"
-    const char *devices[] = {
-        // LAMPS (192.168.0.100)
-        "Cuisine - Luminaire entrée", "192.168.0.100", "00000001", "OFF", "49644",
-        "Cuisine - Luminaire îlot central", "192.168.0.100", "00000010", "OFF", "49644",
-        "Salon - Luminaire salon nord", "192.168.0.100", "00010111", "ON", "49644",
-        "Salon - Applique cheminée sud", "192.168.0.100", "00011011", "ON", "49644",
-        "Garages nord - Projecteur extérieur entrée véhicule nord", "192.168.0.100", "00111110", "OFF", "49644",
-        "Garages nord - Projecteur extérieur entrée véhicule sud", "192.168.0.100", "00111111", "OFF", "49644",
-        "Garages ouest - Hublot entrée ouest", "192.168.0.100", "01000011", "OFF", "49644",
-        "Terrasse - Hublot porte chambre invités", "192.168.0.100", "01000100", "OFF", "49644",
-        "Terrasse - Ensemble de spots immergés piscine", "192.168.0.100", "01000111", "OFF", "49644",
-        "Hall sud - Hublot ouest", "192.168.0.100", "01001000", "OFF", "49644",
-        "Hall sud - Projecteur extérieur ouest", "192.168.0.100", "01001010", "OFF", "49644",
-        "Garages nord - Hublot entrée est", "192.168.0.100", "01000000", "OFF", "49644",
-        "Garages ouest - Projecteur extérieur entrée véhicule est", "192.168.0.100", "01000001", "OFF", "49644",
-        "Garages ouest - Projecteur extérieur entrée véhicule ouest", "192.168.0.100", "01000010", "OFF", "49644",
-        "Terrasse - Hublot porte cuisine", "192.168.0.100", "01000101", "OFF", "49644",
-        "Terrasse - Hublot cuisine d'été", "192.168.0.100", "01000110", "OFF", "49644",
-        "Hall sud - Hublot est", "192.168.0.100", "01001001", "OFF", "49644",
-        "Hall sud - Projecteur extérieur est", "192.168.0.100", "01001011", "OFF", "49644",
-        "Cuisine - Plan de travail est (gauche)", "192.168.0.100", "00000011", "OFF", "49644",
-        "Cuisine - Plan de travail est (droit)", "192.168.0.100", "00000100", "OFF", "49644",
-        "Cuisine - Plan de travail ouest (droite)", "192.168.0.100", "00000101", "OFF", "49644",
-        "Cuisine - Plan de travail ouest (gauche)", "192.168.0.100", "00000110", "OFF", "49644",
-        "Cuisine - Plan de travail sud", "192.168.0.100", "00000111", "OFF", "49644",
-        "Suite parentale - Luminaire central", "192.168.0.100", "00001000", "OFF", "49644",
-        "Suite parentale - Applique nord-ouest", "192.168.0.100", "00001001", "OFF", "49644",
-        "Suite parentale - Applique nord-est", "192.168.0.100", "00001010", "OFF", "49644",
-        "Suite parentale - Applique sud-ouest", "192.168.0.100", "00001011", "OFF", "49644",
-        "Suite parentale - Applique sud", "192.168.0.100", "00001100", "OFF", "49644",
-        "Suite parentale - Salle de bain et dressing - Luminaire entrée salle de bain", "192.168.0.100", "00001101", "OFF", "49644",
-        "Suite parentale - Salle de bain et dressing - Luminaire salle de bain central", "192.168.0.100", "00001110", "OFF", "49644",
-        "Suite parentale - Salle de bain et dressing - Baignoire", "192.168.0.100", "00001111", "OFF", "49644",
-        "Suite parentale - Salle de bain et dressing - Lavabo nord", "192.168.0.100", "00010000", "OFF", "49644",
-        "Suite parentale - Salle de bain et dressing - Lavabo est", "192.168.0.100", "00010001", "OFF", "49644",
-        "Suite parentale - Salle de bain et dressing - Luminaire douche", "192.168.0.100", "00010010", "OFF", "49644",
-        "Suite parentale - Salle de bain et dressing - Luminaire WC", "192.168.0.100", "00010011", "OFF", "49644",
-        "Suite parentale - Salle de bain et dressing - Luminaire nord dressing", "192.168.0.100", "00010100", "OFF", "49644",
-        "Suite parentale - Salle de bain et dressing - Luminaire sud dressing", "192.168.0.100", "00010101", "OFF", "49644",
-        "Suite parentale - Vestibule - Luminaire vestibule", "192.168.0.100", "00010110", "OFF", "49644",
-        "Salon - Luminaire salon sud", "192.168.0.100", "00011000", "ON", "49644",
-        "Salon - Applique nord", "192.168.0.100", "00011001", "OFF", "49644",
-        "Salon - Applique cheminée nord", "192.168.0.100", "00011010", "ON", "49644",
-        "Salon - Applique sud", "192.168.0.100", "00011100", "OFF", "49644",
-        "Salon - Applique grand mur nord", "192.168.0.100", "00011101", "ON", "49644",
-        "Salon - Applique grand mur sud", "192.168.0.100", "00011110", "ON", "49644",
-        "Salle à manger - Luminaire central", "192.168.0.100", "00011111", "OFF", "49644",
-        "Salle à manger - Applique nord ouest", "192.168.0.100", "00100000", "OFF", "49644",
-        "Salle à manger - Applique nord est", "192.168.0.100", "00100001", "OFF", "49644",
-        "Salle à manger - Applique nord mur ouest", "192.168.0.100", "00100010", "OFF", "49644",
-        "Salle à manger - Applique sud mur ouest", "192.168.0.100", "00100011", "OFF", "49644",
-        "Salle à manger - Applique sud-est", "192.168.0.100", "00100100", "OFF", "49644",
-        "Placard - Applique", "192.168.0.100", "00100101", "OFF", "49644",
-        "WC - Luminaire central", "192.168.0.100", "00100110", "OFF", "49644",
-        "Escalier central - Luminaire central", "192.168.0.100", "00100111", "ON", "49644",
-        "Escalier central - Luminaire sud", "192.168.0.100", "00101000", "ON", "49644",
-        "Bibliothèque - Luminaire central ouest", "192.168.0.100", "00101001", "ON", "49644",
-        "Bibliothèque - Luminaire central est", "192.168.0.100", "00101010", "OFF", "49644",
-        "Chambre invités - Luminaire central", "192.168.0.100", "00101011", "OFF", "49644",
-        "Chambre invités - Applique ouest", "192.168.0.100", "00101100", "OFF", "49644",
-        "Chambre invités - Applique sud-ouest", "192.168.0.100", "00101101", "OFF", "49644",
-        "Chambre invités - Applique sud", "192.168.0.100", "00101110", "OFF", "49644",
-        "Chambre invités - Salle de bain et dressing - Luminaire central salle de bain", "192.168.0.100", "00101111", "OFF", "49644",
-        "Chambre invités - Salle de bain et dressing - Luminaire central dressing", "192.168.0.100", "00110000", "OFF", "49644",
-        "Chambre invités - Salle de bain et dressing - Applique sud salle de bain", "192.168.0.100", "00110001", "OFF", "49644",
-        "Chambre invités - Salle de bain et dressing - Luminaire central douche", "192.168.0.100", "00110010", "OFF", "49644",
-        "Hall nord - Luminaire central", "192.168.0.100", "00110011", "OFF", "49644",
-        "Hall nord - Applique ouest", "192.168.0.100", "00110100", "OFF", "49644",
-        "Hall nord - Applique est", "192.168.0.100", "00110101", "OFF", "49644",
-        "Garages nord - Luminaire central nord-ouest", "192.168.0.100", "00110110", "ON", "49644",
-        "Garages nord - Luminaire central nord-est", "192.168.0.100", "00110111", "OFF", "49644",
-        "Garages nord - Luminaire central sud-ouest", "192.168.0.100", "00111000", "OFF", "49644",
-        "Garages nord - Luminaire central sud-est", "192.168.0.100", "00111001", "OFF", "49644",
-        "Garages ouest - Luminaire central nord-ouest", "192.168.0.100", "00111010", "OFF", "49644",
-        "Garages ouest - Luminaire central nord-est", "192.168.0.100", "00111011", "OFF", "49644",
-        "Garages ouest - Luminaire central sud-ouest", "192.168.0.100", "00111100", "OFF", "49644",
-        "Garages ouest - Luminaire central sud-est", "192.168.0.100", "00111101", "OFF", "49644",
+// Contrôleur qui reçoit les commandes de l'appareil ip:port
+static const char *controleur_cible(const char *ip, int port, int *final_port) {
+    const char *final_ip = (ip && strlen(ip) > 0) ? ip : DEFAULT_SIM_IP;
+    *final_port = (port > 0) ? port : DEFAULT_SIM_PORT;
+    if (simulateur_base > 0) {
+        const char *octet = strrchr(final_ip, '.');
+        *final_port = simulateur_base + (octet ? atoi(octet + 1) : 0);
+        final_ip = simulateur_hote;
+    }
+    return final_ip;
+}
 
-        // LAMPS (192.168.0.110)
-        "Bureau - Luminaire central", "192.168.0.110", "00000001", "OFF", "49644",
-        "Chambre nord est - Luminaire central", "192.168.0.110", "00000010", "OFF", "49644",
-        "Chambre nord est - Salle de bain - Luminaire central", "192.168.0.110", "00000011", "ON", "49644",
-        "Chambre nord est - Applique nord", "192.168.0.110", "00010001", "ON", "49644",
-        "Chambre nord est - Applique sud", "192.168.0.110", "00010010", "ON", "49644",
-        "Chambre nord est - Salle de bain - Lavabo ouest", "192.168.0.110", "00010011", "OFF", "49644",
+// Attribue l'identifiant de livraison d'une commande, au statut "en attente",
+// avant qu'elle ne parte : /update le rend tout de suite, la commande n'étant
+// confiée au contrôleur qu'une fois sa ligne outbox écrite.
+unsigned long long livraison_reserver(const char *ip, int port, const char *input, long long outbox) {
+    int final_port;
+    const char *final_ip = controleur_cible(ip, port, &final_port);
+    mutex_lock(&mutex_livraisons);
+    unsigned long long id = ++derniere_commande;
+    Livraison *l = &anneau_livraisons[id % TAILLE_ANNEAU_LIVRAISONS];
+    l->id = id;
+    l->statut = LIVRAISON_EN_ATTENTE;
+    snprintf(l->ip, sizeof(l->ip), "%s", final_ip);
+    l->port = final_port;
+    snprintf(l->entree_ip, sizeof(l->entree_ip), "%s", ip);
+    snprintf(l->entree_input, sizeof(l->entree_input), "%s", input);
+    l->outbox = outbox;
+    l->latence_ms = 0;
+    l->tentatives = 0;
+    l->acquittee = 0;
+    mutex_unlock(&mutex_livraisons);
+    return id;
+}
+
+// --- Fonction pour envoyer au simulateur ---
+// Dépose la commande dans la file du contrôleur et rend la main aussitôt.
+// Retourne l'identifiant de livraison, y compris pour une commande refusée
+// (disjoncteur ouvert, file pleine) : son statut "echec" le dit. 0 seulement
+// si aucun identifiant n'a pu être attribué.
+// outbox : ligne de la table outbox à marquer livrée (0 si aucune).
+// id : livraison déjà réservée par livraison_reserver (0 : en attribuer une).
+unsigned long long envoyer_au_simulateur(const char *ip, int port, const char *type, const char *input, const char *etat,
+                                         long long outbox, unsigned long long id) {
+    int final_port;
+    const char *final_ip = controleur_cible(ip, port, &final_port);
+    Controleur *k = controleur_obtenir(final_ip, final_port);
+    Commande *cmd = k ? malloc(sizeof(*cmd)) : NULL;
+    if (!cmd) {
+        if (id) livraison_noter(id, LIVRAISON_ECHEC, 0, 0, 0);
+        return id;
+    }
+    int disjonctee = !controleur_disponible(k);
+    snprintf(cmd->type, sizeof(cmd->type), "%s", type);
+    snprintf(cmd->input, sizeof(cmd->input), "%s", input);
+    snprintf(cmd->etat, sizeof(cmd->etat), "%s", etat);
+    cmd->depot = horloge_ns();
+    cmd->seq = 0;
+    cmd->outbox = outbox;
+    cmd->tentatives = 0;
+    cmd->acquittee = 0;
+    cmd->suiv = NULL;
+    cmd->id = id ? id : livraison_reserver(ip, port, input, outbox);
+    id = cmd->id; // cmd appartient à l'expéditeur dès la mise en file
+    if (disjonctee) {
+        // Disjoncteur ouvert : échec immédiat, sans file ni réseau
+        printf("⚡ Contrôleur %s:%d hors service (disjoncteur ouvert), commande refusée.\n", final_ip, final_port);
+        k->rejets++;
+        k->perdues++;
+        livraison_noter(id, LIVRAISON_ECHEC, 0, 0, 0);
+        free(cmd);
+        return id;
+    }
+    mutex_lock(&k->mutex_file);
+    // Une commande encore en file pour la même entrée prend le nouvel état (et
+    // le nouvel id) sans changer de place : un seul envoi, le dernier état
+    Commande *prec = k->file_tete;
+    while (prec && strcmp(prec->input, cmd->input) != 0) prec = prec->suiv;
+    unsigned long long remplacee = 0;
+    double depot_remplacee = 0;
+    int pleine = !prec && k->file_len >= MAX_FILE_CONTROLEUR;
+    if (prec) {
+        remplacee = prec->id;
+        depot_remplacee = prec->depot;
+        prec->id = id;
+        prec->outbox = cmd->outbox; // sa livraison rendra aussi caduque la ligne remplacée
+        memcpy(prec->type, cmd->type, sizeof(prec->type));
+        memcpy(prec->etat, cmd->etat, sizeof(prec->etat));
+    } else if (!pleine) {
+        if (k->file_queue) k->file_queue->suiv = cmd;
+        else k->file_tete = cmd;
+        k->file_queue = cmd;
+        k->file_len++;
+        cond_signaler(&k->cond_file);
+    }
+    mutex_unlock(&k->mutex_file);
+
+    if (prec) {
+        k->fusionnees++;
+        livraison_noter(remplacee, LIVRAISON_REMPLACEE, (cmd->depot - depot_remplacee) / 1e6, 0, 0);
+        free(cmd);
+        return id;
+    }
+    if (pleine) {
+        printf("❌ File du contrôleur %s:%d pleine, commande abandonnée.\n", final_ip, final_port);
+        k->perdues++;
+        livraison_noter(id, LIVRAISON_ECHEC, 0, 0, 0);
+        free(cmd);
+        return id;
+    }
+    return id;
+}
+
+
+// =========================================================
+// PARSEUR HTTP INCRÉMENTAL
+// =========================================================
+// Machine à états reprenable : on lui redonne le même tampon, plus long, à
+// chaque recv() et elle repart de là où elle s'était arrêtée. Le résultat
+// est une suite de tranches (pointeur + longueur) dans le tampon de
+// réception : aucune copie, aucun '\0' inséré. Le tampon ne doit donc pas
+// être déplacé tant que la requête n'est pas terminée.
+#define MAX_ENTETES 32
+#define MAX_METHODE 16
+
+typedef struct {
+    const char *p;
+    size_t len;
+} Tranche;
+
+typedef struct {
+    Tranche nom, valeur;
+} EnteteHTTP;
+
+typedef enum {
+    P_METHODE, P_CHEMIN, P_QUERY, P_VERSION, P_LIGNE_LF,
+    P_ENTETE_DEBUT, P_ENTETE_NOM, P_ENTETE_OWS, P_ENTETE_VALEUR, P_ENTETE_LF,
+    P_FIN_LF, P_CORPS, P_TERMINE
+} EtatParseur;
+
+typedef struct {
+    EtatParseur etat;
+    size_t pos;     // prochain octet à examiner
+    size_t debut;   // début du jeton en cours
+    Tranche methode, chemin, query, version, corps;
+    EnteteHTTP entetes[MAX_ENTETES];
+    int nb_entetes;
+    size_t longueur_corps;
+    size_t longueur_totale; // en-têtes + corps, une fois la requête terminée
+    int keepalive;
+} RequeteHTTP;
+
+#define HTTP_INCOMPLET 0
+#define HTTP_COMPLET 1
+#define HTTP_ERREUR (-1)
+#define HTTP_NON_SUPPORTE (-2)  // Transfer-Encoding (corps chunked) : 501, connexion fermée
+
+void http_reinit(RequeteHTTP *r) {
+    memset(r, 0, sizeof(*r));
+}
+
+int tranche_egale(Tranche t, const char *s) {
+    size_t n = strlen(s);
+    return t.len == n && memcmp(t.p, s, n) == 0;
+}
+
+int tranche_egale_nocase(Tranche t, const char *s) {
+    size_t n = strlen(s);
+    return t.len == n && strncasecmp(t.p, s, n) == 0;
+}
+
+// Valeur de l'en-tête "nom" (insensible à la casse), tranche vide si absent
+Tranche http_entete(const RequeteHTTP *r, const char *nom) {
+    for (int i = 0; i < r->nb_entetes; i++) {
+        if (tranche_egale_nocase(r->entetes[i].nom, nom)) return r->entetes[i].valeur;
+    }
+    Tranche vide = { NULL, 0 };
+    return vide;
+}
+
+// Vrai si Accept-Encoding autorise gzip (jeton "gzip" ou "*" sans q=0)
+int accepte_gzip(Tranche ae) {
+    size_t i = 0;
+    while (i < ae.len) {
+        size_t fin = i;
+        while (fin < ae.len && ae.p[fin] != ',') fin++;
+        size_t d = i;
+        while (d < fin && (ae.p[d] == ' ' || ae.p[d] == '\t')) d++;
+        size_t nom = d;
+        while (nom < fin && ae.p[nom] != ';' && ae.p[nom] != ' ') nom++;
+        Tranche jeton = { ae.p + d, nom - d };
+        if (tranche_egale_nocase(jeton, "gzip") || tranche_egale(jeton, "*")) {
+            // q=0, q=0.0, q=0.00... = refusé explicitement
+            const char *q = NULL;
+            for (size_t k = nom; k + 1 < fin; k++) if (ae.p[k] == 'q' && ae.p[k + 1] == '=') { q = ae.p + k + 2; break; }
+            if (!q) return 1;
+            int zero = (*q == '0');
+            for (const char *z = q + 1; zero && z < ae.p + fin && *z != ' ' && *z != ';'; z++)
+                if (*z != '.' && *z != '0') zero = 0;
+            return !zero;
+        }
+        i = fin + 1;
+    }
+    return 0;
+}
+
+static Tranche tranche(const char *buf, size_t debut, size_t fin) {
+    Tranche t = { buf + debut, fin - debut };
+    return t;
+}
+
+// Fin des en-têtes : longueur du corps et persistance de la connexion. Seul
+// Content-Length délimite un corps : une requête avec Transfer-Encoding est
+// refusée plutôt que de lire son corps comme la requête suivante (request
+// smuggling) ; avec aussi Content-Length, ou plusieurs Content-Length, elle
+// est invalide (RFC 9112, 6.1 et 6.3).
+static int http_fin_entetes(RequeteHTTP *r) {
+    int nb_cl = 0, te = 0;
+    for (int i = 0; i < r->nb_entetes; i++) {
+        nb_cl += tranche_egale_nocase(r->entetes[i].nom, "Content-Length");
+        te |= tranche_egale_nocase(r->entetes[i].nom, "Transfer-Encoding");
+    }
+    if (nb_cl > 1 || (te && nb_cl)) return HTTP_ERREUR;
+    if (te) return HTTP_NON_SUPPORTE;
+
+    Tranche cl = http_entete(r, "Content-Length");
+    r->longueur_corps = 0;
+    for (size_t i = 0; i < cl.len; i++) {
+        if (cl.p[i] < '0' || cl.p[i] > '9') return HTTP_ERREUR;
+        r->longueur_corps = r->longueur_corps * 10 + (size_t)(cl.p[i] - '0');
+        if (r->longueur_corps > RECV_BUF) return HTTP_ERREUR;
+    }
+
+    // HTTP/1.1 : persistant par défaut ; HTTP/1.0 : seulement sur demande
+    r->keepalive = !tranche_egale(r->version, "HTTP/1.0");
+    Tranche conn = http_entete(r, "Connection");
+    if (tranche_egale_nocase(conn, "close")) r->keepalive = 0;
+    else if (tranche_egale_nocase(conn, "keep-alive")) r->keepalive = 1;
+    return HTTP_COMPLET;
+}
+
+// Avance dans buf[0..len). Retourne HTTP_COMPLET, HTTP_INCOMPLET, HTTP_ERREUR
+// ou HTTP_NON_SUPPORTE.
+int http_parser(RequeteHTTP *r, const char *buf, size_t len) {
+    size_t i = r->pos;
+    while (i < len) {
+        char ch = buf[i];
+        switch (r->etat) {
+        case P_METHODE:
+            if (ch == ' ') {
+                if (i == r->debut) return HTTP_ERREUR;
+                r->methode = tranche(buf, r->debut, i);
+                r->etat = P_CHEMIN;
+                r->debut = i + 1;
+            } else if (ch == '\r' || ch == '\n' || i - r->debut >= MAX_METHODE) {
+                return HTTP_ERREUR;
+            }
+            i++;
+            break;
+
+        case P_CHEMIN:
+            if (ch == '?' || ch == ' ') {
+                r->chemin = tranche(buf, r->debut, i);
+                r->query = tranche(buf, i + 1, i + 1);
+                r->etat = ch == '?' ? P_QUERY : P_VERSION;
+                r->debut = i + 1;
+            } else if (ch == '\r' || ch == '\n') {
+                return HTTP_ERREUR;
+            }
+            i++;
+            break;
+
+        case P_QUERY:
+            if (ch == ' ') {
+                r->query = tranche(buf, r->debut, i);
+                r->etat = P_VERSION;
+                r->debut = i + 1;
+            } else if (ch == '\r' || ch == '\n') {
+                return HTTP_ERREUR;
+            }
+            i++;
+            break;
+
+        case P_VERSION:
+            if (ch == '\r' || ch == '\n') {
+                r->version = tranche(buf, r->debut, i);
+                r->etat = ch == '\r' ? P_LIGNE_LF : P_ENTETE_DEBUT;
+            }
+            i++;
+            break;
+
+        case P_LIGNE_LF:
+        case P_ENTETE_LF:
+            if (ch != '\n') return HTTP_ERREUR;
+            r->etat = P_ENTETE_DEBUT;
+            i++;
+            break;
+
+        case P_ENTETE_DEBUT:
+            if (ch == '\r') {
+                r->etat = P_FIN_LF;
+                i++;
+                break;
+            }
+            if (ch == '\n') {
+                r->etat = P_FIN_LF; // tolère une fin d'en-têtes en LF seul
+                break;
+            }
+            r->debut = i;
+            r->etat = P_ENTETE_NOM;
+            break;
+
+        case P_ENTETE_NOM:
+            if (ch == ':') {
+                // Un en-tête non conservé pourrait être un Transfer-Encoding
+                // ou un second Content-Length : la requête est refusée
+                if (r->nb_entetes >= MAX_ENTETES) return HTTP_ERREUR;
+                r->entetes[r->nb_entetes].nom = tranche(buf, r->debut, i);
+                r->etat = P_ENTETE_OWS;
+            } else if (ch == '\r' || ch == '\n') {
+                return HTTP_ERREUR;
+            }
+            i++;
+            break;
+
+        case P_ENTETE_OWS:
+            if (ch == ' ' || ch == '\t') { i++; break; }
+            r->debut = i;
+            r->etat = P_ENTETE_VALEUR;
+            break;
+
+        case P_ENTETE_VALEUR: {
+            const char *cr = memchr(buf + i, '\r', len - i);
+            const char *lf = memchr(buf + i, '\n', (cr ? (size_t)(cr - buf) : len) - i);
+            const char *fin = lf ? lf : cr;
+            if (!fin) { i = len; break; }
+            size_t f = (size_t)(fin - buf);
+            size_t v = f;
+            while (v > r->debut && (buf[v - 1] == ' ' || buf[v - 1] == '\t')) v--;
+            r->entetes[r->nb_entetes++].valeur = tranche(buf, r->debut, v);
+            r->etat = *fin == '\r' ? P_ENTETE_LF : P_ENTETE_DEBUT;
+            i = f + 1;
+            break;
+        }
+
+        case P_FIN_LF: {
+            if (ch != '\n') return HTTP_ERREUR;
+            i++;
+            int fin = http_fin_entetes(r);
+            if (fin != HTTP_COMPLET) return fin;
+            r->debut = i;
+            r->etat = P_CORPS;
+            break;
+        }
+
+        case P_CORPS:
+            break;
+
+        case P_TERMINE:
+            return HTTP_COMPLET;
+        }
+
+        if (r->etat == P_CORPS) {
+            if (len - r->debut < r->longueur_corps) { i = len; break; }
+            r->corps = tranche(buf, r->debut, r->debut + r->longueur_corps);
+            r->longueur_totale = r->debut + r->longueur_corps;
+            r->etat = P_TERMINE;
+            r->pos = r->longueur_totale;
+            return HTTP_COMPLET;
+        }
+    }
+    r->pos = i;
+    return r->etat == P_TERMINE ? HTTP_COMPLET : HTTP_INCOMPLET;
+}
+
+// =========================================================
+// CACHE DES PAGES STATIQUES
+// =========================================================
+// Les pages HTML sont chargées une fois en mémoire avec leur bloc d'en-têtes
+// HTTP précalculé (pas de mmap : une page modifiée sur place pendant un envoi
+// provoquerait un SIGBUS). Une requête ne fait ni lecture de fichier ni
+// copie : la connexion garde une référence sur la version de la page et la
+// boucle l'envoie directement avec writev(). Le fichier est revalidé par sa
+// date de modification au plus une fois par seconde ; une nouvelle version
+// remplace l'ancienne, libérée quand plus aucune connexion ne l'envoie.
+// Chaque version a aussi une variante gzip compressée une seule fois au
+// chargement, choisie selon l'en-tête Accept-Encoding du client.
+// Les variantes portent un ETag fort (hash du contenu) et un Last-Modified :
+// If-None-Match / If-Modified-Since donnent un 304 sans corps.
+#define MAX_ASSETS 16
+#define VARIANTE_BRUTE 0
+#define VARIANTE_GZIP 1
+
+typedef struct {
+    char *data;             // NULL : variante absente
+    size_t taille;
+    char etag[40];          // avec les guillemets
+    char entete_ka[320];    // en-têtes pour une connexion persistante
+    size_t len_ka;
+    char entete_close[320]; // en-têtes avec "Connection: close"
+    size_t len_close;
+} VarianteAsset;
+
+typedef struct VersionAsset {
+    atomic_int refs;
+    char *contenu;          // = variantes[VARIANTE_BRUTE].data
+    size_t taille;
+    time_t mtime;
+    char last_modified[40]; // date HTTP (IMF-fixdate) de mtime
+    VarianteAsset variantes[2];
+} VersionAsset;
+
+typedef struct {
+    const char *fichier;
+    const char *type;
+    VersionAsset *courante; // NULL si le fichier n'existe pas (404)
+    time_t derniere_verif;
+} Asset;
+
+static Asset assets[MAX_ASSETS];
+static int nb_assets = 0;
+static mutex_t mutex_assets;
+
+void version_liberer(VersionAsset *v) {
+    if (!v || atomic_fetch_sub(&v->refs, 1) != 1) return;
+    free(v->contenu);
+    free(v->variantes[VARIANTE_GZIP].data);
+    free(v);
+}
+
+static void variante_entetes(VarianteAsset *va, const VersionAsset *v, const char *type, const char *encodage) {
+    const char *fmt = "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lu\r\n%s"
+                      "ETag: %s\r\nLast-Modified: %s\r\nVary: Accept-Encoding\r\n%s\r\n";
+    va->len_ka = (size_t)snprintf(va->entete_ka, sizeof(va->entete_ka), fmt, type, (unsigned long)va->taille,
+                                  encodage, va->etag, v->last_modified,
+                                  "Connection: keep-alive\r\nKeep-Alive: timeout=5\r\n");
+    va->len_close = (size_t)snprintf(va->entete_close, sizeof(va->entete_close), fmt, type, (unsigned long)va->taille,
+                                     encodage, va->etag, v->last_modified, "Connection: close\r\n");
+}
+
+// FNV-1a 64 bits : suffisant pour distinguer les versions d'une page
+static unsigned long long hash_contenu(const char *p, size_t len) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)p[i]) * 1099511628211ULL;
+    return h;
+}
+
+static const char *JOURS_HTTP[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *MOIS_HTTP[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+void date_http(time_t t, char *out, size_t outlen) {
+    struct tm tm;
+#ifdef _WIN32
+    gmtime_s(&tm, &t);
+#else
+    gmtime_r(&t, &tm);
+#endif
+    snprintf(out, outlen, "%s, %02d %s %04d %02d:%02d:%02d GMT", JOURS_HTTP[tm.tm_wday], tm.tm_mday,
+             MOIS_HTTP[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+// Jours depuis 1970-01-01 pour une date du calendrier grégorien (sans dépendre de timegm)
+static long jours_depuis_epoch(int a, int m, int j) {
+    a -= m <= 2;
+    long ere = (a >= 0 ? a : a - 399) / 400;
+    long yoe = a - ere * 400;
+    long doy = (153L * (m + (m > 2 ? -3 : 9)) + 2) / 5 + j - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return ere * 146097 + doe - 719468;
+}
+
+// Lit une date IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"), -1 si invalide
+time_t lire_date_http(Tranche t) {
+    char buf[40];
+    if (t.len == 0 || t.len >= sizeof(buf)) return (time_t)-1;
+    memcpy(buf, t.p, t.len);
+    buf[t.len] = '\0';
+    char jour[4], mois[4];
+    int j, a, h, mi, se;
+    if (sscanf(buf, "%3s, %d %3s %d %d:%d:%d", jour, &j, mois, &a, &h, &mi, &se) != 7) return (time_t)-1;
+    for (int m = 0; m < 12; m++) {
+        if (strcmp(mois, MOIS_HTTP[m]) == 0)
+            return (time_t)(jours_depuis_epoch(a, m + 1, j) * 86400L + h * 3600L + mi * 60L + se);
+    }
+    return (time_t)-1;
+}
+
+// Compression gzip (niveau maximal : faite une fois par version, pas par requête)
+static int compresser_gzip(const char *src, size_t len, char **out, size_t *out_len) {
+#ifndef DOMO_SANS_ZLIB
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+    size_t cap = deflateBound(&z, (uLong)len);
+    char *buf = malloc(cap);
+    if (!buf) { deflateEnd(&z); return -1; }
+    z.next_in = (Bytef *)src;
+    z.avail_in = (uInt)len;
+    z.next_out = (Bytef *)buf;
+    z.avail_out = (uInt)cap;
+    int r = deflate(&z, Z_FINISH);
+    deflateEnd(&z);
+    if (r != Z_STREAM_END) { free(buf); return -1; }
+    *out = buf;
+    *out_len = z.total_out;
+    return 0;
+#else
+    (void)src; (void)len; (void)out; (void)out_len;
+    return -1;
+#endif
+}
+
+#if defined(__linux__) && !defined(DOMO_SANS_IO_URING)
+static int assets_io_uring = 0; // --boucle io_uring : pages lues par demandes READ
+int uring_lire_fichier(const char *chemin, char *buf, size_t taille);
+#endif
+
+static VersionAsset *version_charger(const Asset *a, const struct stat *st) {
+    VersionAsset *v = calloc(1, sizeof(*v));
+    if (!v) return NULL;
+    v->taille = (size_t)st->st_size;
+    v->mtime = st->st_mtime;
+
+    v->contenu = malloc(v->taille ? v->taille : 1);
+    int lu = 0;
+#if defined(__linux__) && !defined(DOMO_SANS_IO_URING)
+    lu = assets_io_uring && v->contenu && uring_lire_fichier(a->fichier, v->contenu, v->taille) == 0;
+#endif
+    FILE *f = lu || !v->contenu ? NULL : fopen(a->fichier, "rb");
+    if (!lu && (!f || fread(v->contenu, 1, v->taille, f) != v->taille)) {
+        if (f) fclose(f);
+        free(v->contenu);
+        free(v);
+        return NULL;
+    }
+    if (f) fclose(f);
+
+    date_http(v->mtime, v->last_modified, sizeof(v->last_modified));
+    unsigned long long h = hash_contenu(v->contenu, v->taille);
+
+    VarianteAsset *brute = &v->variantes[VARIANTE_BRUTE];
+    brute->data = v->contenu;
+    brute->taille = v->taille;
+    snprintf(brute->etag, sizeof(brute->etag), "\"%016llx\"", h);
+    variante_entetes(brute, v, a->type, "");
+
+    // La variante gzip n'est gardée que si elle est réellement plus petite
+    VarianteAsset *gz = &v->variantes[VARIANTE_GZIP];
+    if (compresser_gzip(v->contenu, v->taille, &gz->data, &gz->taille) == 0) {
+        if (gz->taille < v->taille) {
+            snprintf(gz->etag, sizeof(gz->etag), "\"%016llx-gz\"", h);
+            variante_entetes(gz, v, a->type, "Content-Encoding: gzip\r\n");
+        } else {
+            free(gz->data);
+            gz->data = NULL;
+        }
+    }
+    atomic_init(&v->refs, 1); // référence détenue par le cache
+    return v;
+}
+
+// Recharge le fichier si sa date ou sa taille a changé (appelé sous mutex_assets)
+static void asset_revalider(Asset *a, time_t maintenant) {
+    a->derniere_verif = maintenant;
+    struct stat st;
+    if (stat(a->fichier, &st) != 0) {
+        version_liberer(a->courante);
+        a->courante = NULL;
+        return;
+    }
+    if (a->courante && a->courante->mtime == st.st_mtime && a->courante->taille == (size_t)st.st_size) return;
+
+    VersionAsset *v = version_charger(a, &st);
+    if (!v) return; // on garde l'ancienne version
+    version_liberer(a->courante);
+    a->courante = v;
+    printf("[CACHE] %s chargé (%lu octets, gzip %lu)\n", a->fichier, (unsigned long)v->taille,
+           (unsigned long)v->variantes[VARIANTE_GZIP].taille);
+}
+
+Asset *asset_enregistrer(const char *fichier, const char *type) {
+    for (int i = 0; i < nb_assets; i++) {
+        if (strcmp(assets[i].fichier, fichier) == 0) return &assets[i];
+    }
+    if (nb_assets >= MAX_ASSETS) return NULL;
+    Asset *a = &assets[nb_assets++];
+    a->fichier = fichier;
+    a->type = type;
+    return a;
+}
+
+void assets_charger(void) {
+    mutex_init(&mutex_assets);
+    time_t maintenant = time(NULL);
+    for (int i = 0; i < nb_assets; i++) asset_revalider(&assets[i], maintenant);
+}
+
+// Version courante de la page, avec une référence à rendre par version_liberer()
+VersionAsset *asset_acquerir(Asset *a) {
+    time_t maintenant = time(NULL);
+    mutex_lock(&mutex_assets);
+    if (maintenant != a->derniere_verif) asset_revalider(a, maintenant);
+    VersionAsset *v = a->courante;
+    if (v) atomic_fetch_add(&v->refs, 1);
+    mutex_unlock(&mutex_assets);
+    return v;
+}
+
+// =========================================================
+// CONNEXIONS CLIENTS
+// =========================================================
+// Chaque client garde son propre tampon de réception et une file de sortie :
+// les routes écrivent dans la connexion, la boucle d'événements vide la file
+// quand le socket (non bloquant) est prêt en écriture. La file mélange des
+// segments possédés (réponses dynamiques) et des références vers les pages
+// du cache, envoyées sans copie.
+#define MAX_IOV 16
+
+#define MODE_HTTP 0
+#define MODE_SSE 1
+#define MODE_WS 2
+
+typedef struct Segment {
+    struct Segment *suiv;
+    const char *data;
+    size_t len, envoye;
+    VersionAsset *asset; // référence rendue une fois le segment envoyé
+    size_t cap;          // > 0 : segment possédé, les données suivent dans "tampon"
+    char tampon[];
+} Segment;
+
+// Les connexions sont persistantes (HTTP/1.1 keep-alive) : plusieurs requêtes
+// pipelinées peuvent se trouver dans "in", elles sont traitées dans l'ordre.
+typedef struct Connexion {
+    SOCKET fd;
+    char in[RECV_BUF];
+    size_t in_len;
+    RequeteHTTP req;      // état du parseur pour la requête en cours de réception
+    Segment *sortie_tete, *sortie_queue;
+    size_t out_len;       // octets en attente d'envoi
+    int mode;             // MODE_HTTP, ou flux d'événements après /events
+    unsigned long long dernier_evt; // dernier événement d'état envoyé à cet abonné
+    unsigned long long attente_durable;  // /update?durable=1 : seq d'écriture attendu avant de répondre
+    unsigned long long commande_durable; // identifiant de livraison à renvoyer alors
+    int fermer_apres;     // "Connection: close" ou erreur : fermer une fois la sortie vidée
+    int fin_lecture;      // le client a fermé son côté écriture
+    int attente_ecriture; // intérêt "écriture" armé dans la boucle
+    time_t derniere_activite;
+    struct Connexion *prec, *suiv; // liste des connexions du worker (timeouts)
+} Connexion;
+
+// Un worker = un thread avec son socket d'écoute et sa boucle d'événements.
+// Les workers ne touchent pas à SQLite : ils lisent et modifient le magasin en
+// mémoire, et seul le thread d'écriture a une connexion à la base.
+typedef struct Boucle Boucle;
+#ifndef _WIN32
+long boucle_writev(Boucle *b, SOCKET fd, const struct iovec *iov, int n);
+#endif
+typedef struct Worker {
+    int id;
+    thread_t thread;
+    SOCKET ecoute;
+    Boucle *boucle;
+    Connexion *connexions;
+    SOCKET reveil;              // socket UDP local : un datagramme = "nouveaux événements"
+    struct sockaddr_in adresse_reveil;
+    atomic_int reveil_en_attente;
+    atomic_int nb_abonnes;      // connexions en mode flux sur ce worker
+    atomic_int nb_attentes_durables; // connexions qui attendent une écriture en base
+} Worker;
+
+static void conn_ajouter_segment(Connexion *c, Segment *sg) {
+    sg->suiv = NULL;
+    if (c->sortie_queue) c->sortie_queue->suiv = sg;
+    else c->sortie_tete = sg;
+    c->sortie_queue = sg;
+    c->out_len += sg->len;
+}
+
+int conn_ecrire(Connexion *c, const char *data, size_t len) {
+    Segment *q = c->sortie_queue;
+    if (q && q->cap && q->envoye == 0 && q->cap - q->len >= len) {
+        memcpy(q->tampon + q->len, data, len);
+        q->len += len;
+        c->out_len += len;
+        return 0;
+    }
+    size_t cap = len > 4096 ? len : 4096;
+    Segment *sg = malloc(sizeof(Segment) + cap);
+    if (!sg) return -1;
+    memcpy(sg->tampon, data, len);
+    sg->data = sg->tampon;
+    sg->len = len;
+    sg->envoye = 0;
+    sg->asset = NULL;
+    sg->cap = cap;
+    conn_ajouter_segment(c, sg);
+    return 0;
+}
+
+// Met en file des octets appartenant à une version du cache (sans copie).
+// La référence "v" est transférée au segment.
+int conn_ecrire_asset(Connexion *c, VersionAsset *v, const char *data, size_t len) {
+    Segment *sg = malloc(sizeof(Segment));
+    if (!sg) { version_liberer(v); return -1; }
+    sg->data = data;
+    sg->len = len;
+    sg->envoye = 0;
+    sg->asset = v;
+    sg->cap = 0;
+    conn_ajouter_segment(c, sg);
+    return 0;
+}
+
+static void segment_liberer(Segment *sg) {
+    if (sg->asset) version_liberer(sg->asset);
+    free(sg);
+}
+
+void conn_vider_file(Connexion *c) {
+    while (c->sortie_tete) {
+        Segment *sg = c->sortie_tete;
+        c->sortie_tete = sg->suiv;
+        segment_liberer(sg);
+    }
+    c->sortie_queue = NULL;
+    c->out_len = 0;
+}
+
+// Envoie ce qui peut l'être sans bloquer, plusieurs segments par appel système.
+// Retourne 0 si tout est parti, 1 s'il reste des données, -1 en cas d'erreur.
+int conn_vider(Worker *w, Connexion *c) {
+    while (c->sortie_tete) {
+        int n = 0;
+#ifdef _WIN32
+        WSABUF iov[MAX_IOV];
+        for (Segment *sg = c->sortie_tete; sg && n < MAX_IOV; sg = sg->suiv, n++) {
+            iov[n].buf = (char *)sg->data + sg->envoye;
+            iov[n].len = (ULONG)(sg->len - sg->envoye);
+        }
+        DWORD envoye32 = 0;
+        (void)w;
+        long envoye = WSASend(c->fd, iov, (DWORD)n, &envoye32, 0, NULL, NULL) == 0 ? (long)envoye32 : -1;
+#else
+        struct iovec iov[MAX_IOV];
+        for (Segment *sg = c->sortie_tete; sg && n < MAX_IOV; sg = sg->suiv, n++) {
+            iov[n].iov_base = (void *)(sg->data + sg->envoye);
+            iov[n].iov_len = sg->len - sg->envoye;
+        }
+        long envoye = boucle_writev(w->boucle, c->fd, iov, n);
+#endif
+        if (envoye < 0 && sock_interrompu()) continue;
+        if (envoye < 0 && sock_bloquerait()) return 1;
+        if (envoye <= 0) return -1;
+
+        size_t reste = (size_t)envoye;
+        c->out_len -= reste;
+        while (reste > 0) {
+            Segment *sg = c->sortie_tete;
+            size_t dispo = sg->len - sg->envoye;
+            if (reste < dispo) { sg->envoye += reste; break; }
+            reste -= dispo;
+            c->sortie_tete = sg->suiv;
+            segment_liberer(sg);
+        }
+        if (!c->sortie_tete) c->sortie_queue = NULL;
+    }
+    return 0;
+}
+
+// Écrit une réponse complète : Content-Length toujours présent pour que le
+// client puisse réutiliser la connexion. supplement : en-têtes en plus
+// (lignes terminées par \r\n), "" si aucun.
+static void entete_ecrire(Connexion *c, const char *statut, const char *type, size_t len, const char *supplement) {
+    char entete[256];
+    int n = snprintf(entete, sizeof(entete),
+        "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\n%s%s\r\n",
+        statut, type, (unsigned long)len, supplement,
+        c->fermer_apres ? "Connection: close\r\n"
+                        : "Connection: keep-alive\r\nKeep-Alive: timeout=5\r\n");
+    conn_ecrire(c, entete, (size_t)n);
+}
+
+void repondre_entete(Connexion *c, const char *statut, const char *type, size_t len) {
+    entete_ecrire(c, statut, type, len, "");
+}
+
+void repondre(Connexion *c, const char *statut, const char *type, const char *corps, size_t len) {
+    repondre_entete(c, statut, type, len);
+    conn_ecrire(c, corps, len);
+}
+
+void repondre_texte(Connexion *c, const char *statut, const char *texte) {
+    repondre(c, statut, "text/plain; charset=UTF-8", texte, strlen(texte));
+}
+
+// 503 : rien n'a été fait, la même requête peut être refaite après apres_s secondes
+void repondre_indisponible(Connexion *c, int apres_s, const char *texte) {
+    char retry[32];
+    snprintf(retry, sizeof(retry), "Retry-After: %d\r\n", apres_s);
+    entete_ecrire(c, "503 Service Unavailable", "text/plain; charset=UTF-8", strlen(texte), retry);
+    conn_ecrire(c, texte, strlen(texte));
+}
+
+void send_404_response(Connexion *c) {
+    const char *nf = "<h1>404 - Page non trouvée</h1>";
+    repondre(c, "404 Not Found", "text/html; charset=UTF-8", nf, strlen(nf));
+}
+
+// Vrai si un ETag de la liste If-None-Match correspond (comparaison faible, RFC 9110)
+int etag_correspond(Tranche inm, const char *etag) {
+    size_t le = strlen(etag);
+    size_t i = 0;
+    while (i < inm.len) {
+        while (i < inm.len && (inm.p[i] == ' ' || inm.p[i] == '\t' || inm.p[i] == ',')) i++;
+        if (i < inm.len && inm.p[i] == '*') return 1;
+        if (i + 2 <= inm.len && inm.p[i] == 'W' && inm.p[i + 1] == '/') i += 2;
+        size_t d = i;
+        while (i < inm.len && inm.p[i] != ',') i++;
+        size_t f = i;
+        while (f > d && (inm.p[f - 1] == ' ' || inm.p[f - 1] == '\t')) f--;
+        if (f - d == le && memcmp(inm.p + d, etag, le) == 0) return 1;
+    }
+    return 0;
+}
+
+// Le client a-t-il déjà cette variante ? If-None-Match prime sur If-Modified-Since.
+int non_modifie(const RequeteHTTP *req, const VersionAsset *v, const VarianteAsset *va) {
+    Tranche inm = http_entete(req, "If-None-Match");
+    if (inm.len) return etag_correspond(inm, va->etag);
+    time_t ims = lire_date_http(http_entete(req, "If-Modified-Since"));
+    return ims != (time_t)-1 && v->mtime <= ims;
+}
+
+// Page servie depuis le cache : en-têtes précalculés + contenu, par référence.
+// La variante gzip est choisie si le client l'accepte.
+void send_file_response(Connexion *c, const RequeteHTTP *req, Asset *a, const char *extra_message) {
+    VersionAsset *v = a ? asset_acquerir(a) : NULL;
+    if (!v) {
+        send_404_response(c);
+        return;
+    }
+
+    if (extra_message && strlen(extra_message) > 0) {
+        // Cas rare : le message est inséré juste après <body ...>, on recopie la page
+        const char *p = v->contenu, *fin = v->contenu + v->taille;
+        const char *bodyPos = NULL, *endTag = NULL;
+        for (const char *q = p; q + 5 <= fin && !bodyPos; q++)
+            if (memcmp(q, "<body", 5) == 0) bodyPos = q;
+        if (bodyPos) endTag = memchr(bodyPos, '>', (size_t)(fin - bodyPos));
+
+        char msg[512];
+        int lm = snprintf(msg, sizeof(msg), endTag ? "<p style='color:crimson;font-weight:700;'>%s</p>"
+                                                   : "<p style='color:crimson;'>%s</p>", extra_message);
+        if (lm < 0) lm = 0;
+        if ((size_t)lm >= sizeof(msg)) lm = (int)sizeof(msg) - 1;
+        size_t coupe = endTag ? (size_t)(endTag + 1 - p) : v->taille;
+
+        repondre_entete(c, "200 OK", a->type, v->taille + (size_t)lm);
+        conn_ecrire(c, p, coupe);
+        conn_ecrire(c, msg, (size_t)lm);
+        conn_ecrire(c, p + coupe, v->taille - coupe);
+        version_liberer(v);
+        return;
+    }
+
+    const VarianteAsset *va = &v->variantes[VARIANTE_BRUTE];
+    if (v->variantes[VARIANTE_GZIP].data && req && accepte_gzip(http_entete(req, "Accept-Encoding")))
+        va = &v->variantes[VARIANTE_GZIP];
+
+    if (req && non_modifie(req, v, va)) {
+        char entete[384];
+        int n = snprintf(entete, sizeof(entete),
+            "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nLast-Modified: %s\r\nVary: Accept-Encoding\r\n%s\r\n",
+            va->etag, v->last_modified,
+            c->fermer_apres ? "Connection: close\r\n"
+                            : "Connection: keep-alive\r\nKeep-Alive: timeout=5\r\n");
+        conn_ecrire(c, entete, (size_t)n);
+        version_liberer(v);
+        return;
+    }
+
+    // Une référence pour l'en-tête, une pour le corps
+    atomic_fetch_add(&v->refs, 1);
+    if (c->fermer_apres) conn_ecrire_asset(c, v, va->entete_close, va->len_close);
+    else conn_ecrire_asset(c, v, va->entete_ka, va->len_ka);
+    conn_ecrire_asset(c, v, va->data, va->taille);
+}
+
+// =========================================================
+// WEBSOCKET (RFC 6455)
+// =========================================================
+// SHA-1 + base64 uniquement pour Sec-WebSocket-Accept (pas de dépendance externe)
+#define ROTG(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1(const unsigned char *data, size_t len, unsigned char out[20]) {
+    unsigned int h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    unsigned char bloc[64];
+    unsigned long long bits = (unsigned long long)len * 8;
+    size_t total = ((len + 8) / 64 + 1) * 64;
+
+    for (size_t off = 0; off < total; off += 64) {
+        for (int i = 0; i < 64; i++) {
+            size_t k = off + (size_t)i;
+            if (k < len) bloc[i] = data[k];
+            else if (k == len) bloc[i] = 0x80;
+            else if (k >= total - 8) bloc[i] = (unsigned char)(bits >> (8 * (total - 1 - k)));
+            else bloc[i] = 0;
+        }
+        unsigned int w[80];
+        for (int i = 0; i < 16; i++)
+            w[i] = (unsigned int)bloc[4 * i] << 24 | (unsigned int)bloc[4 * i + 1] << 16 | (unsigned int)bloc[4 * i + 2] << 8 | bloc[4 * i + 3];
+        for (int i = 16; i < 80; i++) w[i] = ROTG(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        unsigned int a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            unsigned int f, k;
+            if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+            unsigned int t = ROTG(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = ROTG(b, 30); b = a; a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+    for (int i = 0; i < 5; i++) {
+        out[4 * i] = (unsigned char)(h[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(h[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(h[i] >> 8);
+        out[4 * i + 3] = (unsigned char)h[i];
+    }
+}
+
+static void base64(const unsigned char *in, size_t len, char *out) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t j = 0;
+    for (size_t i = 0; i < len; i += 3) {
+        unsigned int v = (unsigned int)in[i] << 16;
+        if (i + 1 < len) v |= (unsigned int)in[i + 1] << 8;
+        if (i + 2 < len) v |= in[i + 2];
+        out[j++] = alphabet[(v >> 18) & 63];
+        out[j++] = alphabet[(v >> 12) & 63];
+        out[j++] = i + 1 < len ? alphabet[(v >> 6) & 63] : '=';
+        out[j++] = i + 2 < len ? alphabet[v & 63] : '=';
+    }
+    out[j] = '\0';
+}
+
+#define WS_CONTINUATION 0x0
+#define WS_TEXTE 0x1
+#define WS_BINAIRE 0x2
+#define WS_FERMETURE 0x8
+#define WS_PING 0x9
+#define WS_PONG 0xA
+
+// Trame serveur -> client (jamais masquée, toujours complète : FIN = 1)
+int ws_ecrire_trame(Connexion *c, int opcode, const char *data, size_t len) {
+    unsigned char entete[10];
+    size_t n = 0;
+    entete[n++] = (unsigned char)(0x80 | opcode);
+    if (len < 126) {
+        entete[n++] = (unsigned char)len;
+    } else if (len < 65536) {
+        entete[n++] = 126;
+        entete[n++] = (unsigned char)(len >> 8);
+        entete[n++] = (unsigned char)len;
+    } else {
+        entete[n++] = 127;
+        for (int i = 7; i >= 0; i--) entete[n++] = (unsigned char)((unsigned long long)len >> (8 * i));
+    }
+    if (conn_ecrire(c, (const char *)entete, n) != 0) return -1;
+    return len ? conn_ecrire(c, data, len) : 0;
+}
+
+// =========================================================
+// ÉVÉNEMENTS (diffusion des changements d'état)
+// =========================================================
+// Chaque changement d'état réussi reçoit un numéro de version global et est
+// rangé dans un anneau des derniers événements. Les workers qui ont des
+// abonnés sont réveillés par un datagramme sur leur socket UDP local (même
+// mécanisme sous Windows et Linux) puis complètent chaque abonné à partir de
+// l'anneau : un abonné inactif ne coûte rien entre deux changements.
+typedef struct {
+    unsigned long long id;
+    char nom[128];
+    char etat[8];
+} EvenementEtat;
+
+static EvenementEtat anneau_evts[TAILLE_ANNEAU_EVTS];
+static unsigned long long dernier_evt_id = 0;
+static mutex_t mutex_evts;
+static SOCKET sock_bus = INVALID_SOCKET;
+static Worker *bus_workers = NULL;
+static int bus_nb_workers = 0;
+
+void evenements_init(Worker *workers, int nb_workers) {
+    mutex_init(&mutex_evts);
+    bus_workers = workers;
+    bus_nb_workers = nb_workers;
+    sock_bus = socket(AF_INET, SOCK_DGRAM, 0);
+}
+
+void evenements_publier(const char *nom, const char *etat) {
+    mutex_lock(&mutex_evts);
+    unsigned long long id = ++dernier_evt_id;
+    EvenementEtat *e = &anneau_evts[id % TAILLE_ANNEAU_EVTS];
+    e->id = id;
+    snprintf(e->nom, sizeof(e->nom), "%s", nom);
+    snprintf(e->etat, sizeof(e->etat), "%s", etat);
+    mutex_unlock(&mutex_evts);
+
+    for (int i = 0; i < bus_nb_workers; i++) {
+        Worker *w = &bus_workers[i];
+        if (atomic_load(&w->nb_abonnes) == 0) continue;
+        if (atomic_exchange(&w->reveil_en_attente, 1)) continue; // déjà réveillé
+        sendto(sock_bus, "!", 1, 0, (struct sockaddr *)&w->adresse_reveil, sizeof(w->adresse_reveil));
+    }
+}
+
+unsigned long long evenements_version(void) {
+    mutex_lock(&mutex_evts);
+    unsigned long long v = dernier_evt_id;
+    mutex_unlock(&mutex_evts);
+    return v;
+}
+
+static void json_echapper(char *dst, size_t dstlen, const char *src) {
+    size_t j = 0;
+    for (; *src && j + 2 < dstlen; src++) {
+        if (*src == '"' || *src == '\\') dst[j++] = '\\';
+        else if ((unsigned char)*src < 0x20) continue;
+        dst[j++] = *src;
+    }
+    dst[j] = '\0';
+}
+
+// Écrit dans le flux de c les événements qu'il n'a pas encore reçus. Si
+// l'abonné est trop en retard pour l'anneau, il reçoit "resync" et doit
+// relire /state.
+// Format SSE : événements "etat" en JSON. Format WebSocket (texte, compact) :
+// "<version>:<1|0><nom>", ou "<version>:*" pour une resynchronisation.
+void evenements_rattraper(Connexion *c) {
+    char ligne[512], nom_json[260];
+    int n;
+    mutex_lock(&mutex_evts);
+    unsigned long long plus_ancien = dernier_evt_id >= TAILLE_ANNEAU_EVTS ? dernier_evt_id - TAILLE_ANNEAU_EVTS + 1 : 1;
+    if (c->dernier_evt > dernier_evt_id || c->dernier_evt + 1 < plus_ancien) {
+        if (c->mode == MODE_WS) {
+            n = snprintf(ligne, sizeof(ligne), "%llu:*", dernier_evt_id);
+            ws_ecrire_trame(c, WS_TEXTE, ligne, (size_t)n);
+        } else {
+            n = snprintf(ligne, sizeof(ligne), "id: %llu\nevent: resync\ndata: {\"v\":%llu}\n\n", dernier_evt_id, dernier_evt_id);
+            conn_ecrire(c, ligne, (size_t)n);
+        }
+        c->dernier_evt = dernier_evt_id;
+    }
+    for (unsigned long long id = c->dernier_evt + 1; id <= dernier_evt_id; id++) {
+        const EvenementEtat *e = &anneau_evts[id % TAILLE_ANNEAU_EVTS];
+        if (c->mode == MODE_WS) {
+            n = snprintf(ligne, sizeof(ligne), "%llu:%c%s", e->id, strcmp(e->etat, "ON") == 0 ? '1' : '0', e->nom);
+            ws_ecrire_trame(c, WS_TEXTE, ligne, (size_t)n);
+            continue;
+        }
+        json_echapper(nom_json, sizeof(nom_json), e->nom);
+        n = snprintf(ligne, sizeof(ligne), "id: %llu\nevent: etat\ndata: {\"nom\":\"%s\",\"etat\":\"%s\",\"v\":%llu}\n\n",
+                     e->id, nom_json, e->etat, e->id);
+        conn_ecrire(c, ligne, (size_t)n);
+    }
+    c->dernier_evt = dernier_evt_id;
+    mutex_unlock(&mutex_evts);
+}
+
+// =========================================================
+// DATABASE
+// =========================================================
+// Requêtes préparées : celles du thread d'écriture (voir ÉCRITURE GROUPÉE)
+// sont préparées une fois par connexion à son ouverture (requetes_preparer)
+// puis réutilisées avec sqlite3_reset / sqlite3_clear_bindings, au lieu d'un
+// prepare + finalize à chaque appel. Les connexions sont enregistrées au
+// démarrage, dans une table en ajout seul : la recherche se fait sans verrou.
+// Une connexion non enregistrée (initialisation) retombe sur prepare/finalize.
+// Les lectures, elles, ne passent plus par SQLite (voir MAGASIN D'APPAREILS).
+typedef enum {
+    REQ_APPAREIL_ECRIRE,
+    REQ_OUTBOX_REMPLACER, REQ_OUTBOX_INSERER, REQ_OUTBOX_MARQUER, REQ_OUTBOX_EN_ATTENTE,
+    REQ_VIDER_APPAREILS, REQ_VIDER_OUTBOX,
+    REQ_BEGIN_IMMEDIATE, REQ_COMMIT, REQ_ROLLBACK,
+    NB_REQUETES
+} Requete;
+
+static const char *sql_requetes[NB_REQUETES] = {
+    // Une seule requête par appareil : création implicite ou transition, avec
+    // les incréments du lot (voir FILE D'ÉCRITURE). Dans le SET, "etat" est
+    // encore l'ancienne valeur : RETURNING rend l'état précédent et le nouveau.
+    [REQ_APPAREIL_ECRIRE] = "INSERT INTO etat_appareils (appareil, etat, ip, input, port, compteur_on, compteur_off, dernier_changement) "
+                            "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8) "
+                            "ON CONFLICT (appareil) DO UPDATE SET etat_precedent = etat, etat = excluded.etat, "
+                            "compteur_on = compteur_on + excluded.compteur_on, compteur_off = compteur_off + excluded.compteur_off, "
+                            "dernier_changement = excluded.dernier_changement "
+                            "RETURNING etat_precedent, etat;",
+    [REQ_OUTBOX_REMPLACER] = "UPDATE outbox SET livree = 2 WHERE livree = 0 AND ip = ? AND input = ?;",
+    [REQ_OUTBOX_INSERER] = "INSERT INTO outbox (id, ip, port, type, input, etat) VALUES (?, ?, ?, ?, ?, ?);",
+    [REQ_OUTBOX_MARQUER] = "UPDATE outbox SET livree = ?2, livree_le = CURRENT_TIMESTAMP WHERE id = ?1 AND livree = 0;",
+    // Lignes en attente depuis au moins ?1 secondes. Avec MAX(id), SQLite rend
+    // les autres colonnes de la ligne retenue (une seule ligne par entrée de
+    // toute façon, sauf base écrite par un autre outil)
+    [REQ_OUTBOX_EN_ATTENTE] = "SELECT ip, port, type, input, etat, MAX(id) FROM outbox "
+                              "WHERE livree = 0 AND cree <= datetime('now', '-' || ?1 || ' seconds') GROUP BY ip, input;",
+    [REQ_VIDER_APPAREILS] = "DELETE FROM etat_appareils;",
+    [REQ_VIDER_OUTBOX] = "DELETE FROM outbox;",
+    [REQ_BEGIN_IMMEDIATE] = "BEGIN IMMEDIATE;",
+    [REQ_COMMIT] = "COMMIT;",
+    [REQ_ROLLBACK] = "ROLLBACK;",
+};
+
+typedef struct {
+    sqlite3 *db;
+    sqlite3_stmt *stmt[NB_REQUETES];
+    atomic_ulong reutilisations;
+} CacheRequetes;
+
+#define MAX_CACHES_REQUETES 2   // écriture + benchmark
+static CacheRequetes caches_requetes[MAX_CACHES_REQUETES];
+static atomic_int nb_caches_requetes = 0;
+static atomic_ulong requetes_hors_cache = 0;  // prepare + finalize faute de cache
+static int requetes_cache_actif = 1;          // 0 : --bench-update mesure le chemin sans cache
+
+// Prépare les requêtes du chemin chaud pour cette connexion (schéma déjà créé).
+// À appeler depuis le thread principal, avant que la connexion ne serve. Une
+// place libérée par requetes_liberer (benchmarks) est réutilisée.
+int requetes_preparer(sqlite3 *db) {
+    int n = nb_caches_requetes, i = 0;
+    while (i < n && caches_requetes[i].db) i++;
+    if (i >= MAX_CACHES_REQUETES) return -1;
+    CacheRequetes *c = &caches_requetes[i];
+    c->reutilisations = 0;
+    for (int r = 0; r < NB_REQUETES; r++) {
+        if (sqlite3_prepare_v3(db, sql_requetes[r], -1, SQLITE_PREPARE_PERSISTENT, &c->stmt[r], NULL) != SQLITE_OK) {
+            fprintf(stderr, "[DB] Préparation impossible (%s) : %s\n", sql_requetes[r], sqlite3_errmsg(db));
+            while (r-- > 0) {
+                sqlite3_finalize(c->stmt[r]);
+                c->stmt[r] = NULL;
+            }
+            return -1;
+        }
+    }
+    c->db = db; // publiée une fois remplie
+    if (i == n) nb_caches_requetes = n + 1;
+    return 0;
+}
+
+static CacheRequetes *requetes_cache(sqlite3 *db) {
+    int n = nb_caches_requetes;
+    for (int i = 0; i < n; i++)
+        if (caches_requetes[i].db == db) return &caches_requetes[i];
+    return NULL;
+}
+
+// À appeler avant sqlite3_close (qui échoue tant que des requêtes sont préparées)
+void requetes_liberer(sqlite3 *db) {
+    CacheRequetes *c = requetes_cache(db);
+    if (!c) return;
+    for (int r = 0; r < NB_REQUETES; r++) {
+        sqlite3_finalize(c->stmt[r]);
+        c->stmt[r] = NULL;
+    }
+    c->db = NULL; // l'adresse peut resservir à une autre connexion
+}
+
+// Requête prête à lier ; à rendre avec requete_rendre après usage
+sqlite3_stmt *requete_prendre(sqlite3 *db, Requete r) {
+    CacheRequetes *c = requetes_cache_actif ? requetes_cache(db) : NULL;
+    if (c && c->stmt[r]) {
+        c->reutilisations++;
+        return c->stmt[r];
+    }
+    sqlite3_stmt *stmt = NULL;
+    requetes_hors_cache++;
+    if (sqlite3_prepare_v2(db, sql_requetes[r], -1, &stmt, NULL) != SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return NULL;
+    }
+    return stmt;
+}
+
+void requete_rendre(sqlite3 *db, Requete r, sqlite3_stmt *stmt) {
+    CacheRequetes *c = requetes_cache(db);
+    if (c && c->stmt[r] == stmt) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    } else {
+        sqlite3_finalize(stmt);
+    }
+}
+
+// Exécute une requête sans paramètre ni résultat (BEGIN, COMMIT...)
+static int requete_executer(sqlite3 *db, Requete r) {
+    sqlite3_stmt *stmt = requete_prendre(db, r);
+    if (!stmt) return SQLITE_ERROR;
+    int rc = sqlite3_step(stmt);
+    requete_rendre(db, r, stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+void initDB(sqlite3 *db) {
+    char *err = NULL;
+    const char *sql =
+        "CREATE TABLE IF NOT EXISTS etat_appareils ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "appareil TEXT UNIQUE, "
+        "etat TEXT, "
+        "ip TEXT, " 
+        "input TEXT, " 
+        "port INTEGER DEFAULT 49644, " 
+        "compteur_on INTEGER DEFAULT 0, "
+        "compteur_off INTEGER DEFAULT 0, "
+        "dernier_changement DATETIME DEFAULT CURRENT_TIMESTAMP, "
+        "etat_precedent TEXT);"   // état avant la dernière écriture (voir REQ_APPAREIL_ECRIRE)
+        // Commandes à livrer aux contrôleurs (voir OUTBOX)
+        "CREATE TABLE IF NOT EXISTS outbox ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "ip TEXT, "
+        "port INTEGER, "
+        "type TEXT, "
+        "input TEXT, "
+        "etat TEXT, "
+        "cree DATETIME DEFAULT CURRENT_TIMESTAMP, "
+        "livree INTEGER DEFAULT 0, "   // 0 en attente, 1 livrée, 2 remplacée par une commande plus récente, 3 envoyée sans accusé
+        "livree_le DATETIME);"
+        "CREATE INDEX IF NOT EXISTS outbox_en_attente ON outbox (ip, input, id) WHERE livree = 0;";
+    if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "Erreur creation table: %s\n", err);
+        sqlite3_free(err);
+    }
+    // Bases créées avant etat_precedent (échoue sans conséquence si la colonne existe)
+    sqlite3_exec(db, "ALTER TABLE etat_appareils ADD COLUMN etat_precedent TEXT;", NULL, NULL, NULL);
+    printf("[DB] Table prête.\n");
+}
+
+
+// Données initiales (vos 96 appareils), aussi rechargées par /reset-db
+// Format: "Nom de l'appareil", "IP", "Input", "État initial", "Port"
+static const char *devices[] = {
+        // LAMPS (192.168.0.100)
+        "Cuisine - Luminaire entrée", "192.168.0.100", "00000001", "OFF", "49644",
+        "Cuisine - Luminaire îlot central", "192.168.0.100", "00000010", "OFF", "49644",
+        "Salon - Luminaire salon nord", "192.168.0.100", "00010111", "ON", "49644",
+        "Salon - Applique cheminée sud", "192.168.0.100", "00011011", "ON", "49644",
+        "Garages nord - Projecteur extérieur entrée véhicule nord", "192.168.0.100", "00111110", "OFF", "49644",
+        "Garages nord - Projecteur extérieur entrée véhicule sud", "192.168.0.100", "00111111", "OFF", "49644",
+        "Garages ouest - Hublot entrée ouest", "192.168.0.100", "01000011", "OFF", "49644",
+        "Terrasse - Hublot porte chambre invités", "192.168.0.100", "01000100", "OFF", "49644",
+        "Terrasse - Ensemble de spots immergés piscine", "192.168.0.100", "01000111", "OFF", "49644",
+        "Hall sud - Hublot ouest", "192.168.0.100", "01001000", "OFF", "49644",
+        "Hall sud - Projecteur extérieur ouest", "192.168.0.100", "01001010", "OFF", "49644",
+        "Garages nord - Hublot entrée est", "192.168.0.100", "01000000", "OFF", "49644",
+        "Garages ouest - Projecteur extérieur entrée véhicule est", "192.168.0.100", "01000001", "OFF", "49644",
+        "Garages ouest - Projecteur extérieur entrée véhicule ouest", "192.168.0.100", "01000010", "OFF", "49644",
+        "Terrasse - Hublot porte cuisine", "192.168.0.100", "01000101", "OFF", "49644",
+        "Terrasse - Hublot cuisine d'été", "192.168.0.100", "01000110", "OFF", "49644",
+        "Hall sud - Hublot est", "192.168.0.100", "01001001", "OFF", "49644",
+        "Hall sud - Projecteur extérieur est", "192.168.0.100", "01001011", "OFF", "49644",
+        "Cuisine - Plan de travail est (gauche)", "192.168.0.100", "00000011", "OFF", "49644",
+        "Cuisine - Plan de travail est (droit)", "192.168.0.100", "00000100", "OFF", "49644",
+        "Cuisine - Plan de travail ouest (droite)", "192.168.0.100", "00000101", "OFF", "49644",
+        "Cuisine - Plan de travail ouest (gauche)", "192.168.0.100", "00000110", "OFF", "49644",
+        "Cuisine - Plan de travail sud", "192.168.0.100", "00000111", "OFF", "49644",
+        "Suite parentale - Luminaire central", "192.168.0.100", "00001000", "OFF", "49644",
+        "Suite parentale - Applique nord-ouest", "192.168.0.100", "00001001", "OFF", "49644",
+        "Suite parentale - Applique nord-est", "192.168.0.100", "00001010", "OFF", "49644",
+        "Suite parentale - Applique sud-ouest", "192.168.0.100", "00001011", "OFF", "49644",
+        "Suite parentale - Applique sud", "192.168.0.100", "00001100", "OFF", "49644",
+        "Suite parentale - Salle de bain et dressing - Luminaire entrée salle de bain", "192.168.0.100", "00001101", "OFF", "49644",
+        "Suite parentale - Salle de bain et dressing - Luminaire salle de bain central", "192.168.0.100", "00001110", "OFF", "49644",
+        "Suite parentale - Salle de bain et dressing - Baignoire", "192.168.0.100", "00001111", "OFF", "49644",
+        "Suite parentale - Salle de bain et dressing - Lavabo nord", "192.168.0.100", "00010000", "OFF", "49644",
+        "Suite parentale - Salle de bain et dressing - Lavabo est", "192.168.0.100", "00010001", "OFF", "49644",
+        "Suite parentale - Salle de bain et dressing - Luminaire douche", "192.168.0.100", "00010010", "OFF", "49644",
+        "Suite parentale - Salle de bain et dressing - Luminaire WC", "192.168.0.100", "00010011", "OFF", "49644",
+        "Suite parentale - Salle de bain et dressing - Luminaire nord dressing", "192.168.0.100", "00010100", "OFF", "49644",
+        "Suite parentale - Salle de bain et dressing - Luminaire sud dressing", "192.168.0.100", "00010101", "OFF", "49644",
+        "Suite parentale - Vestibule - Luminaire vestibule", "192.168.0.100", "00010110", "OFF", "49644",
+        "Salon - Luminaire salon sud", "192.168.0.100", "00011000", "ON", "49644",
+        "Salon - Applique nord", "192.168.0.100", "00011001", "OFF", "49644",
+        "Salon - Applique cheminée nord", "192.168.0.100", "00011010", "ON", "49644",
+        "Salon - Applique sud", "192.168.0.100", "00011100", "OFF", "49644",
+        "Salon - Applique grand mur nord", "192.168.0.100", "00011101", "ON", "49644",
+        "Salon - Applique grand mur sud", "192.168.0.100", "00011110", "ON", "49644",
+        "Salle à manger - Luminaire central", "192.168.0.100", "00011111", "OFF", "49644",
+        "Salle à manger - Applique nord ouest", "192.168.0.100", "00100000", "OFF", "49644",
+        "Salle à manger - Applique nord est", "192.168.0.100", "00100001", "OFF", "49644",
+        "Salle à manger - Applique nord mur ouest", "192.168.0.100", "00100010", "OFF", "49644",
+        "Salle à manger - Applique sud mur ouest", "192.168.0.100", "00100011", "OFF", "49644",
+        "Salle à manger - Applique sud-est", "192.168.0.100", "00100100", "OFF", "49644",
+        "Placard - Applique", "192.168.0.100", "00100101", "OFF", "49644",
+        "WC - Luminaire central", "192.168.0.100", "00100110", "OFF", "49644",
+        "Escalier central - Luminaire central", "192.168.0.100", "00100111", "ON", "49644",
+        "Escalier central - Luminaire sud", "192.168.0.100", "00101000", "ON", "49644",
+        "Bibliothèque - Luminaire central ouest", "192.168.0.100", "00101001", "ON", "49644",
+        "Bibliothèque - Luminaire central est", "192.168.0.100", "00101010", "OFF", "49644",
+        "Chambre invités - Luminaire central", "192.168.0.100", "00101011", "OFF", "49644",
+        "Chambre invités - Applique ouest", "192.168.0.100", "00101100", "OFF", "49644",
+        "Chambre invités - Applique sud-ouest", "192.168.0.100", "00101101", "OFF", "49644",
+        "Chambre invités - Applique sud", "192.168.0.100", "00101110", "OFF", "49644",
+        "Chambre invités - Salle de bain et dressing - Luminaire central salle de bain", "192.168.0.100", "00101111", "OFF", "49644",
+        "Chambre invités - Salle de bain et dressing - Luminaire central dressing", "192.168.0.100", "00110000", "OFF", "49644",
+        "Chambre invités - Salle de bain et dressing - Applique sud salle de bain", "192.168.0.100", "00110001", "OFF", "49644",
+        "Chambre invités - Salle de bain et dressing - Luminaire central douche", "192.168.0.100", "00110010", "OFF", "49644",
+        "Hall nord - Luminaire central", "192.168.0.100", "00110011", "OFF", "49644",
+        "Hall nord - Applique ouest", "192.168.0.100", "00110100", "OFF", "49644",
+        "Hall nord - Applique est", "192.168.0.100", "00110101", "OFF", "49644",
+        "Garages nord - Luminaire central nord-ouest", "192.168.0.100", "00110110", "ON", "49644",
+        "Garages nord - Luminaire central nord-est", "192.168.0.100", "00110111", "OFF", "49644",
+        "Garages nord - Luminaire central sud-ouest", "192.168.0.100", "00111000", "OFF", "49644",
+        "Garages nord - Luminaire central sud-est", "192.168.0.100", "00111001", "OFF", "49644",
+        "Garages ouest - Luminaire central nord-ouest", "192.168.0.100", "00111010", "OFF", "49644",
+        "Garages ouest - Luminaire central nord-est", "192.168.0.100", "00111011", "OFF", "49644",
+        "Garages ouest - Luminaire central sud-ouest", "192.168.0.100", "00111100", "OFF", "49644",
+        "Garages ouest - Luminaire central sud-est", "192.168.0.100", "00111101", "OFF", "49644",
+
+        // LAMPS (192.168.0.110)
+        "Bureau - Luminaire central", "192.168.0.110", "00000001", "OFF", "49644",
+        "Chambre nord est - Luminaire central", "192.168.0.110", "00000010", "OFF", "49644",
+        "Chambre nord est - Salle de bain - Luminaire central", "192.168.0.110", "00000011", "ON", "49644",
+        "Chambre nord est - Applique nord", "192.168.0.110", "00010001", "ON", "49644",
+        "Chambre nord est - Applique sud", "192.168.0.110", "00010010", "ON", "49644",
+        "Chambre nord est - Salle de bain - Lavabo ouest", "192.168.0.110", "00010011", "OFF", "49644",
         "Chambre nord est - Salle de bain - Lavabo est", "192.168.0.110", "00010100", "OFF", "49644",
         "Chambre nord est - Salle de bain - Baignoire", "192.168.0.110", "00010101", "OFF", "49644",
         "Escalier est - Luminaire central", "192.168.0.110", "00000100", "OFF", "49644",
@@ -354,215 +2387,2922 @@ void insert_initial_devices(sqlite3 *db) {
         "Balcon - Applique ouest", "192.168.0.110", "00101111", "OFF", "49644",
         "Balcon - Applique est", "192.168.0.110", "00110000", "OFF", "49644",
 
-        // STORES (192.168.0.103 et 192.168.0.113)
-        "Hall nord - Volet roulant grande baie vitrée", "192.168.0.103", "00000001", "ON", "49644",
-        "Garages nord - Porte basculante nord", "192.168.0.103", "00000110", "OFF", "49644",
-        "Garages ouest - Porte basculante est", "192.168.0.103", "00001001", "OFF", "49644",
-        "Salon - Volet roulant fenêtre sud", "192.168.0.103", "00010111", "ON", "49644",
-        "Salle à manger - Volet roulant bow window sud fenêtre est", "192.168.0.103", "00011111", "OFF", "49644",
-        "Chambre invités - Volet roulant porte fenêtre terrasse", "192.168.0.103", "00100101", "ON", "49644",
-        "Cuisine - Volet roulant porte fenêtre terrasse", "192.168.0.103", "00101001", "ON", "49644",
-        "Balcon - Volet roulant fenêtre est", "192.168.0.113", "00000110", "ON", "49644", // IP 192.168.0.113
-        "Garages nord - Volet roulant fenêtre est", "192.168.0.103", "00000010", "ON", "49644",
-        "Garages nord - Volet roulant fenêtre nord-est", "192.168.0.103", "00000011", "ON", "49644",
-        "Garages nord - Volet roulant fenêtre nord", "192.168.0.103", "00000100", "ON", "49644",
-        "Garages nord - Volet roulant fenêtre nord-ouest", "192.168.0.103", "00000101", "ON", "49644",
-        "Garages nord - Porte basculante sud", "192.168.0.103", "00000111", "OFF", "49644",
-        "Garages ouest - Volet roulant fenêtre est", "192.168.0.103", "00001000", "ON", "49644",
-        "Garages ouest - Porte basculante ouest", "192.168.0.103", "00001010", "OFF", "49644",
-        "Garages ouest - Volet roulant bow window ouest fenêtre nord", "192.168.0.103", "00001011", "ON", "49644",
-        "Garages ouest - Volet roulant bow window ouest fenêtre ouest", "192.168.0.103", "00001100", "ON", "49644",
-        "Garages ouest - Volet roulant bow window ouest fenêtre sud", "192.168.0.103", "00001101", "ON", "49644",
-        "Suite parentale - Volet roulant bow window ouest fenêtre nord", "192.168.0.103", "00001110", "ON", "49644",
-        "Suite parentale - Volet roulant bow window ouest fenêtre ouest", "192.168.0.103", "00001111", "ON", "49644",
-        "Suite parentale - Volet roulant bow window ouest fenêtre sud", "192.168.0.103", "00010000", "ON", "49644",
-        
-        // Appareils "simples" de test (pour la route /state)
-        "lumiere", DEFAULT_SIM_IP, "00000000", "OFF", "49644",
-        "volets", DEFAULT_SIM_IP, "00000000", "OFF", "49644",
-        "clim", DEFAULT_SIM_IP, "00000000", "OFF", "49644",
-        
-        NULL 
-    };
-    
-    char sql[512];
-    for (int i = 0; devices[i] != NULL; i += 5) {
-        snprintf(sql, sizeof(sql),
-            "INSERT OR IGNORE INTO etat_appareils (appareil, ip, input, etat, port) VALUES ('%s', '%s', '%s', '%s', %s);",
-            devices[i], devices[i+1], devices[i+2], devices[i+3], devices[i+4]);
-        sqlite3_exec(db, sql, 0, 0, 0);
+        // STORES (192.168.0.103 et 192.168.0.113)
+        "Hall nord - Volet roulant grande baie vitrée", "192.168.0.103", "00000001", "ON", "49644",
+        "Garages nord - Porte basculante nord", "192.168.0.103", "00000110", "OFF", "49644",
+        "Garages ouest - Porte basculante est", "192.168.0.103", "00001001", "OFF", "49644",
+        "Salon - Volet roulant fenêtre sud", "192.168.0.103", "00010111", "ON", "49644",
+        "Salle à manger - Volet roulant bow window sud fenêtre est", "192.168.0.103", "00011111", "OFF", "49644",
+        "Chambre invités - Volet roulant porte fenêtre terrasse", "192.168.0.103", "00100101", "ON", "49644",
+        "Cuisine - Volet roulant porte fenêtre terrasse", "192.168.0.103", "00101001", "ON", "49644",
+        "Balcon - Volet roulant fenêtre est", "192.168.0.113", "00000110", "ON", "49644", // IP 192.168.0.113
+        "Garages nord - Volet roulant fenêtre est", "192.168.0.103", "00000010", "ON", "49644",
+        "Garages nord - Volet roulant fenêtre nord-est", "192.168.0.103", "00000011", "ON", "49644",
+        "Garages nord - Volet roulant fenêtre nord", "192.168.0.103", "00000100", "ON", "49644",
+        "Garages nord - Volet roulant fenêtre nord-ouest", "192.168.0.103", "00000101", "ON", "49644",
+        "Garages nord - Porte basculante sud", "192.168.0.103", "00000111", "OFF", "49644",
+        "Garages ouest - Volet roulant fenêtre est", "192.168.0.103", "00001000", "ON", "49644",
+        "Garages ouest - Porte basculante ouest", "192.168.0.103", "00001010", "OFF", "49644",
+        "Garages ouest - Volet roulant bow window ouest fenêtre nord", "192.168.0.103", "00001011", "ON", "49644",
+        "Garages ouest - Volet roulant bow window ouest fenêtre ouest", "192.168.0.103", "00001100", "ON", "49644",
+        "Garages ouest - Volet roulant bow window ouest fenêtre sud", "192.168.0.103", "00001101", "ON", "49644",
+        "Suite parentale - Volet roulant bow window ouest fenêtre nord", "192.168.0.103", "00001110", "ON", "49644",
+        "Suite parentale - Volet roulant bow window ouest fenêtre ouest", "192.168.0.103", "00001111", "ON", "49644",
+        "Suite parentale - Volet roulant bow window ouest fenêtre sud", "192.168.0.103", "00010000", "ON", "49644",
+        
+        // Appareils "simples" de test (pour la route /state)
+        "lumiere", DEFAULT_SIM_IP, "00000000", "OFF", "49644",
+        "volets", DEFAULT_SIM_IP, "00000000", "OFF", "49644",
+        "clim", DEFAULT_SIM_IP, "00000000", "OFF", "49644",
+        
+        NULL 
+};
+
+// Fonction d'insertion des données initiales
+void insert_initial_devices(sqlite3 *db) {
+    char sql[512];
+    for (int i = 0; devices[i] != NULL; i += 5) {
+        snprintf(sql, sizeof(sql),
+            "INSERT OR IGNORE INTO etat_appareils (appareil, ip, input, etat, port) VALUES ('%s', '%s', '%s', '%s', %s);",
+            devices[i], devices[i+1], devices[i+2], devices[i+3], devices[i+4]);
+        sqlite3_exec(db, sql, 0, 0, 0);
+    }
+    printf("[DB] Appareils initiaux (96) insérés (si non existants).\n");
+}
+
+
+// =========================================================
+// STOCKAGE (profil SQLite, checkpoints)
+// =========================================================
+// Le profil de stockage est appliqué à chaque connexion à son ouverture :
+// mode de journal, niveau de synchronisation, mmap, cache de pages, tables
+// temporaires. Choix avec --stockage nom[,cle=valeur...], par exemple
+// --stockage sd ou --stockage equilibre,synchronous=FULL,mmap_mio=0.
+//
+// En WAL, les checkpoints (recopie du journal dans la base) ne se font plus
+// dans le COMMIT du thread d'écriture : un crochet WAL sur sa connexion
+// compte les pages du journal, et un thread de checkpoint les recopie quand
+// le journal dépasse checkpoint_pages, ou dès que les écritures se calment.
+// checkpoint_pages = 0 laisse SQLite faire ses checkpoints automatiques.
+//
+// synchronous=NORMAL en WAL ne synchronise le disque qu'aux checkpoints : un
+// arrêt brutal du système (pas du serveur) peut perdre les derniers COMMIT,
+// sans corrompre la base ; /update?durable=1 ne garantit alors que l'écriture
+// dans le journal. FULL synchronise chaque COMMIT.
+typedef struct {
+    char nom[16];
+    char journal[8];       // WAL, DELETE...
+    char synchronous[8];   // OFF, NORMAL, FULL
+    int mmap_mio;
+    int cache_kio;
+    char temp_store[8];    // MEMORY, FILE, DEFAULT
+    int checkpoint_pages;  // 0 : checkpoints automatiques de SQLite
+    int checkpoint_ms;     // période de vérification du thread de checkpoint
+} ProfilStockage;
+
+static const ProfilStockage profils_stockage[] = {
+    // Réglages d'origine (journal de rollback, valeurs par défaut de SQLite)
+    { "origine",   "DELETE", "FULL",   0,   2000, "DEFAULT", 0,     0 },
+    { "sur",       "WAL",    "FULL",   64,  8192, "MEMORY",  1000,  1000 },
+    { "equilibre", "WAL",    "NORMAL", 64,  8192, "MEMORY",  1000,  1000 },
+    // Carte SD : peu de checkpoints, plus gros, pour limiter l'usure et les fsync
+    { "sd",        "WAL",    "NORMAL", 64,  8192, "MEMORY",  10000, 30000 },
+    // Mesure seulement : un arrêt brutal du système peut corrompre la base
+    { "rapide",    "WAL",    "OFF",    256, 32768, "MEMORY", 10000, 30000 },
+};
+#define NB_PROFILS_STOCKAGE (int)(sizeof(profils_stockage) / sizeof(profils_stockage[0]))
+
+static ProfilStockage stockage = { "sur", "WAL", "FULL", 64, 8192, "MEMORY", 1000, 1000 };
+static atomic_int wal_pages = 0;          // pages dans le journal WAL (crochet du thread d'écriture)
+static atomic_int checkpoints_arret = 0;
+static atomic_ulong checkpoints_faits = 0, checkpoints_pages = 0;
+static atomic_ulong checkpoint_dernier_us = 0;
+
+static int copier_mot(char *dst, size_t n, const char *src) {
+    if (strlen(src) >= n) return -1;
+    for (size_t i = 0; src[i]; i++) dst[i] = (char)toupper((unsigned char)src[i]);
+    dst[strlen(src)] = '\0';
+    return 0;
+}
+
+// --stockage nom[,cle=valeur...] ; -1 si inconnu
+int stockage_choisir(const char *texte) {
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "%s", texte);
+    char *etat = NULL;
+#ifdef _WIN32
+    char *tok = strtok_s(tmp, ",", &etat);
+#else
+    char *tok = strtok_r(tmp, ",", &etat);
+#endif
+    int trouve = 0;
+    for (int i = 0; tok && i < NB_PROFILS_STOCKAGE; i++)
+        if (strcmp(tok, profils_stockage[i].nom) == 0) {
+            stockage = profils_stockage[i];
+            trouve = 1;
+        }
+    if (!trouve) {
+        fprintf(stderr, "Profil de stockage inconnu : %s (origine, sur, equilibre, sd, rapide)\n", tok ? tok : "");
+        return -1;
+    }
+    while (1) {
+#ifdef _WIN32
+        tok = strtok_s(NULL, ",", &etat);
+#else
+        tok = strtok_r(NULL, ",", &etat);
+#endif
+        if (!tok) break;
+        char *v = strchr(tok, '=');
+        int ok = v != NULL;
+        if (ok) {
+            *v++ = '\0';
+            if (strcmp(tok, "journal") == 0) ok = copier_mot(stockage.journal, sizeof(stockage.journal), v) == 0;
+            else if (strcmp(tok, "synchronous") == 0) ok = copier_mot(stockage.synchronous, sizeof(stockage.synchronous), v) == 0;
+            else if (strcmp(tok, "temp_store") == 0) ok = copier_mot(stockage.temp_store, sizeof(stockage.temp_store), v) == 0;
+            else if (strcmp(tok, "mmap_mio") == 0) stockage.mmap_mio = atoi(v);
+            else if (strcmp(tok, "cache_kio") == 0) stockage.cache_kio = atoi(v);
+            else if (strcmp(tok, "checkpoint_pages") == 0) stockage.checkpoint_pages = atoi(v);
+            else if (strcmp(tok, "checkpoint_ms") == 0) stockage.checkpoint_ms = atoi(v);
+            else ok = 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "Réglage de stockage invalide : %s\n", tok);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int stockage_wal(void) {
+    return strcmp(stockage.journal, "WAL") == 0;
+}
+
+// Applique le profil à une connexion qui vient d'être ouverte
+int stockage_appliquer(sqlite3 *db) {
+    char sql[512];
+    snprintf(sql, sizeof(sql),
+             "PRAGMA journal_mode=%s; PRAGMA synchronous=%s; PRAGMA mmap_size=%lld; "
+             "PRAGMA cache_size=-%d; PRAGMA temp_store=%s;%s",
+             stockage.journal, stockage.synchronous, (long long)stockage.mmap_mio * 1024 * 1024,
+             stockage.cache_kio, stockage.temp_store,
+             stockage_wal() && stockage.checkpoint_pages > 0 ? " PRAGMA wal_autocheckpoint=0;" : "");
+    char *err = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "[DB] Profil de stockage '%s' non appliqué : %s\n", stockage.nom, err);
+        sqlite3_free(err);
+        return -1;
+    }
+    return 0;
+}
+
+// Crochet WAL de la connexion d'écriture (remplace l'autocheckpoint de SQLite)
+static int stockage_crochet_wal(void *arg, sqlite3 *db, const char *base, int pages) {
+    (void)arg; (void)db; (void)base;
+    atomic_store(&wal_pages, pages);
+    return SQLITE_OK;
+}
+
+static void *stockage_checkpoints(void *arg) {
+    sqlite3 *db = arg;
+    int recopiees = 0, vu = 0; // pages du journal déjà recopiées, et vues au tour précédent
+    while (!atomic_load(&checkpoints_arret)) {
+        for (int ms = 0; ms < stockage.checkpoint_ms && !atomic_load(&checkpoints_arret); ms += 50) dormir_ms(50);
+        int pages = atomic_load(&wal_pages);
+        if (pages < recopiees) recopiees = 0; // journal repris au début après un checkpoint complet
+        int calme = pages == vu;
+        vu = pages;
+        // Journal trop long, ou écritures calmées avec des pages à recopier
+        if (pages - recopiees < stockage.checkpoint_pages && !(calme && pages > recopiees)) continue;
+
+        int journal = 0, faites = 0;
+        double t0 = horloge_ns();
+        // PASSIVE n'attend ni lecteurs ni écrivain ; si des lecteurs retiennent un
+        // journal devenu très long, TRUNCATE attend (busy_timeout) et le vide
+        int mode = pages > 8 * stockage.checkpoint_pages ? SQLITE_CHECKPOINT_TRUNCATE : SQLITE_CHECKPOINT_PASSIVE;
+        if (sqlite3_wal_checkpoint_v2(db, NULL, mode, &journal, &faites) != SQLITE_OK && mode == SQLITE_CHECKPOINT_TRUNCATE)
+            sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, &journal, &faites);
+        if (faites > recopiees) checkpoints_pages += (unsigned long)(faites - recopiees);
+        recopiees = mode == SQLITE_CHECKPOINT_TRUNCATE && journal == 0 ? 0 : faites;
+        if (journal == 0) atomic_store(&wal_pages, 0);
+        checkpoints_faits++;
+        checkpoint_dernier_us = (unsigned long)((horloge_ns() - t0) / 1e3);
+    }
+    sqlite3_close(db);
+    return NULL;
+}
+
+// Pose le crochet sur la connexion d'écriture et lance le thread de
+// checkpoint (avec sa propre connexion). Sans effet hors WAL ou avec
+// checkpoint_pages = 0.
+int stockage_demarrer(sqlite3 *ecriture, const char *fichier, thread_t *t) {
+    if (!stockage_wal() || stockage.checkpoint_pages <= 0) return 0;
+    sqlite3 *db = NULL;
+    if (sqlite3_open(fichier, &db) != SQLITE_OK) {
+        fprintf(stderr, "Erreur ouverture DB (checkpoints): %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    sqlite3_busy_timeout(db, 5000);
+    stockage_appliquer(db);
+    sqlite3_wal_hook(ecriture, stockage_crochet_wal, NULL);
+    atomic_store(&checkpoints_arret, 0);
+    atomic_store(&wal_pages, 0);
+    if (thread_lancer(t, stockage_checkpoints, db) != 0) {
+        fprintf(stderr, "thread de checkpoint non lancé\n");
+        sqlite3_close(db);
+        return -1;
+    }
+    return 1;
+}
+
+
+// =========================================================
+// FILE D'ÉCRITURE (changements à persister, MPSC)
+// =========================================================
+// Les changements partent vers le thread d'écriture par une file sans verrou
+// à plusieurs producteurs (workers, expéditeurs) et un seul consommateur :
+// une pile chaînée poussée par compare-and-swap, que le thread d'écriture
+// vide d'un coup (atomic_exchange) puis remet dans l'ordre d'arrivée.
+//
+// Un changement d'état porte des incréments de compteurs, pas des valeurs :
+// plusieurs bascules du même appareil dans un lot se fusionnent en un seul
+// UPDATE. Les changements d'état et les commandes sont numérotés (seq) sous
+// mutex_magasin, donc poussés dans l'ordre : quand un lot contenant seq est
+// écrit, tous les précédents le sont aussi (ecriture_durable).
+#define CHG_ETAT 0       // changement d'état (majEtat, /reset-db)
+#define CHG_COMMANDE 1   // changement d'état + ligne outbox, dans la même transaction
+#define CHG_LIVREE 2     // ligne outbox livrée (ou envoyée sans accusé)
+#define CHG_REINIT 3     // /reset-db : tables vidées avant la suite
+
+typedef struct Changement {
+    struct Changement *suiv;
+    int type;
+    unsigned long long seq;     // 0 : hors numérotation (livraisons)
+    char nom[128];
+    char etat[32];              // CHG_LIVREE : nouvelle valeur de outbox.livree
+    char etat_avant[32];        // état en mémoire avant le changement ("" : inconnu)
+    char ip[16];
+    char input[9];
+    int port;
+    int nouveau;                // création implicite de l'appareil
+    int delta_on, delta_off;
+    time_t quand;
+    long long outbox;           // CHG_COMMANDE, CHG_LIVREE : ligne outbox
+    char type_cmd[32];
+    unsigned long long livraison; // CHG_COMMANDE : livraison réservée, envoyée après le COMMIT
+} Changement;
+
+static _Atomic(Changement *) file_ecriture = NULL;
+static atomic_int ecriture_en_attente = 0;   // changements poussés, pas encore pris
+static atomic_int ecriture_commandes = 0;    // dont commandes (CHG_COMMANDE) : écriture sans fenêtre
+static atomic_ullong ecriture_durable = 0;   // plus grand seq écrit en base
+static unsigned long long ecriture_seq = 0;  // dernier seq attribué (mutex_magasin)
+static mutex_t mutex_ecriture;               // sommeil du thread d'écriture
+static cond_t cond_ecriture;
+
+#define ECRITURE_LOT 256
+
+static void ecriture_pousser(Changement *ch) {
+    Changement *tete = atomic_load(&file_ecriture);
+    do {
+        ch->suiv = tete;
+    } while (!atomic_compare_exchange_weak(&file_ecriture, &tete, ch));
+    // Réveil au premier changement (début de la fenêtre), quand le lot est plein
+    // et à la première commande : son envoi attend le COMMIT, pas la fenêtre
+    int commande = ch->type == CHG_COMMANDE && atomic_fetch_add(&ecriture_commandes, 1) == 0;
+    int n = atomic_fetch_add(&ecriture_en_attente, 1) + 1;
+    if (n == 1 || n == ECRITURE_LOT || commande) {
+        mutex_lock(&mutex_ecriture);
+        cond_signaler(&cond_ecriture);
+        mutex_unlock(&mutex_ecriture);
+    }
+}
+
+
+// =========================================================
+// MAGASIN D'APPAREILS (table en mémoire, écriture différée)
+// =========================================================
+// La table etat_appareils tient en quelques kilo-octets : elle est chargée en
+// mémoire au démarrage et c'est cette copie qui fait foi. Les lectures
+// (/state, /update, /ws) ne touchent jamais le disque. Un changement d'état
+// modifie la copie sous mutex_magasin et pousse le changement dans la file
+// d'écriture ; le thread d'écriture le persiste plus tard (voir ÉCRITURE GROUPÉE).
+//
+// Deux index (tables de hachage à adressage ouvert, agrandies au besoin) :
+// par nom, et par entrée (ip, input) pour retrouver l'appareil d'une commande.
+typedef struct {
+    char nom[128];
+    char ip[16];
+    char input[9];
+    int port;
+    char etat[32];
+    long long compteur_on, compteur_off;
+    time_t dernier_changement;
+} Appareil;
+
+static Appareil *appareils = NULL;
+static int nb_appareils = 0, cap_appareils = 0;
+static int *index_noms = NULL, *index_entrees = NULL; // indices dans appareils, -1 : case vide
+static unsigned taille_index = 0;                     // puissance de 2, au moins 2 × nb_appareils
+static mutex_t mutex_magasin;   // appareils, index, numérotation des changements
+
+static unsigned hash_texte(unsigned h, const char *s) {
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u; // FNV-1a
+    }
+    return h;
+}
+
+static unsigned hash_entree(const char *ip, const char *input) {
+    return hash_texte(hash_texte(2166136261u, ip) * 31u, input);
+}
+
+static void index_placer(int *index, unsigned h, int i) {
+    while (index[h & (taille_index - 1)] >= 0) h++;
+    index[h & (taille_index - 1)] = i;
+}
+
+// Reconstruit les deux index à la taille voulue. Appelée avec mutex_magasin.
+static int magasin_indexer(unsigned taille) {
+    int *noms = malloc(taille * sizeof(int)), *entrees = malloc(taille * sizeof(int));
+    if (!noms || !entrees) {
+        free(noms);
+        free(entrees);
+        return -1;
+    }
+    memset(noms, 0xff, taille * sizeof(int));
+    memset(entrees, 0xff, taille * sizeof(int));
+    free(index_noms);
+    free(index_entrees);
+    index_noms = noms;
+    index_entrees = entrees;
+    taille_index = taille;
+    for (int i = 0; i < nb_appareils; i++) {
+        index_placer(index_noms, hash_texte(2166136261u, appareils[i].nom), i);
+        index_placer(index_entrees, hash_entree(appareils[i].ip, appareils[i].input), i);
+    }
+    return 0;
+}
+
+// Indice de l'appareil, -1 s'il est inconnu. Appelée avec mutex_magasin.
+static int magasin_trouver(const char *nom) {
+    if (!taille_index) return -1;
+    for (unsigned h = hash_texte(2166136261u, nom);; h++) {
+        int i = index_noms[h & (taille_index - 1)];
+        if (i < 0 || strcmp(appareils[i].nom, nom) == 0) return i;
+    }
+}
+
+// Premier appareil branché sur l'entrée (ip, input), -1 si aucun. Appelée avec mutex_magasin.
+static int magasin_trouver_entree(const char *ip, const char *input) {
+    if (!taille_index) return -1;
+    for (unsigned h = hash_entree(ip, input);; h++) {
+        int i = index_entrees[h & (taille_index - 1)];
+        if (i < 0 || (strcmp(appareils[i].ip, ip) == 0 && strcmp(appareils[i].input, input) == 0)) return i;
+    }
+}
+
+// Nom de l'appareil branché sur l'entrée ; 0 si aucun
+int magasin_nom_entree(const char *ip, const char *input, char *nom, size_t nom_len) {
+    mutex_lock(&mutex_magasin);
+    int i = magasin_trouver_entree(ip, input);
+    if (i >= 0) snprintf(nom, nom_len, "%s", appareils[i].nom);
+    mutex_unlock(&mutex_magasin);
+    return i >= 0;
+}
+
+// Ajoute un appareil (nom absent du magasin). Appelée avec mutex_magasin.
+static int magasin_ajouter(const char *nom, const char *ip, const char *input, int port, const char *etat) {
+    if (nb_appareils == cap_appareils) {
+        int cap = cap_appareils ? cap_appareils * 2 : 128;
+        Appareil *t = realloc(appareils, (size_t)cap * sizeof(Appareil));
+        if (!t) return -1;
+        appareils = t;
+        cap_appareils = cap;
+    }
+    Appareil *a = &appareils[nb_appareils];
+    memset(a, 0, sizeof(*a));
+    snprintf(a->nom, sizeof(a->nom), "%s", nom);
+    snprintf(a->ip, sizeof(a->ip), "%s", ip);
+    snprintf(a->input, sizeof(a->input), "%s", input);
+    snprintf(a->etat, sizeof(a->etat), "%s", etat);
+    a->port = port;
+    int i = nb_appareils++;
+    if ((unsigned)nb_appareils * 2 > taille_index) {
+        if (magasin_indexer(taille_index ? taille_index * 2 : 256) != 0) {
+            nb_appareils--;
+            return -1;
+        }
+    } else {
+        index_placer(index_noms, hash_texte(2166136261u, a->nom), i);
+        index_placer(index_entrees, hash_entree(a->ip, a->input), i);
+    }
+    return i;
+}
+
+// Charge la table au démarrage (seule lecture de etat_appareils sur disque)
+int magasin_charger(sqlite3 *db) {
+    const char *sql = "SELECT appareil, ip, input, port, etat, compteur_on, compteur_off, "
+                      "CAST(strftime('%s', dernier_changement) AS INTEGER) FROM etat_appareils;";
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "[DB] Chargement des appareils impossible : %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    mutex_lock(&mutex_magasin);
+    nb_appareils = 0;
+    magasin_indexer(256);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *nom = (const char *)sqlite3_column_text(stmt, 0);
+        const char *ip = (const char *)sqlite3_column_text(stmt, 1);
+        const char *input = (const char *)sqlite3_column_text(stmt, 2);
+        const char *etat = (const char *)sqlite3_column_text(stmt, 4);
+        if (!nom || magasin_trouver(nom) >= 0) continue;
+        int i = magasin_ajouter(nom, ip ? ip : DEFAULT_SIM_IP, input ? input : "00000000",
+                                sqlite3_column_int(stmt, 3), etat ? etat : "OFF");
+        if (i < 0) break;
+        appareils[i].compteur_on = sqlite3_column_int64(stmt, 5);
+        appareils[i].compteur_off = sqlite3_column_int64(stmt, 6);
+        appareils[i].dernier_changement = (time_t)sqlite3_column_int64(stmt, 7);
+    }
+    int nb = nb_appareils;
+    mutex_unlock(&mutex_magasin);
+    sqlite3_finalize(stmt);
+    printf("[DB] %d appareils chargés en mémoire.\n", nb);
+    return 0;
+}
+
+// Fonction pour obtenir tous les détails de l'appareil (depuis la mémoire)
+void getAppareilDetails(const char *nom, char *ip_out, size_t ip_len, char *input_out, size_t input_len, int *port_out, char *etat_out, size_t etat_len) {
+    // Valeurs par défaut/Fallback
+    snprintf(ip_out, ip_len, "%s", DEFAULT_SIM_IP);
+    snprintf(input_out, input_len, "%s", "00000000");
+    *port_out = DEFAULT_SIM_PORT;
+    snprintf(etat_out, etat_len, "%s", "OFF");
+
+    mutex_lock(&mutex_magasin);
+    int i = magasin_trouver(nom);
+    if (i >= 0) {
+        snprintf(ip_out, ip_len, "%s", appareils[i].ip);
+        snprintf(input_out, input_len, "%s", appareils[i].input);
+        *port_out = appareils[i].port;
+        snprintf(etat_out, etat_len, "%s", appareils[i].etat);
+    }
+    mutex_unlock(&mutex_magasin);
+}
+
+
+void getEtat(const char *nom, char *etat_out, size_t outlen) {
+    char ip[16], input[9], etat[32];
+    int port;
+    getAppareilDetails(nom, ip, sizeof(ip), input, sizeof(input), &port, etat, sizeof(etat));
+    snprintf(etat_out, outlen, "%s", etat);
+}
+
+// Transition d'état et compteurs ON/OFF, décrite dans ch pour le thread
+// d'écriture. Retourne 1 si l'état a changé, 0 sinon, -1 si l'appareil est
+// inconnu (rien à écrire). Appelée avec mutex_magasin.
+static int magasin_changer(const char *nom, const char *etat, Changement *ch) {
+    int i = magasin_trouver(nom);
+    memset(ch, 0, sizeof(*ch));
+    // Ajout si l'appareil n'existe pas (pour les appareils "simples" comme 'lumiere'),
+    // seulement si on l'allume : on suppose que les appareils principaux sont déjà là
+    if (i < 0 && strcmp(etat, "OFF") != 0) {
+        i = magasin_ajouter(nom, DEFAULT_SIM_IP, "00000000", 49644, "OFF"); // port par défaut du schéma
+        ch->nouveau = i >= 0;
+    }
+    if (i < 0) return -1;
+
+    Appareil *a = &appareils[i];
+    int change = strcmp(a->etat, etat) != 0;
+    snprintf(ch->etat_avant, sizeof(ch->etat_avant), "%s", a->etat);
+    if (strcmp(etat, "ON") == 0 && strcmp(a->etat, "ON") != 0) {
+        a->compteur_on++;
+        ch->delta_on = 1;
+    } else if (strcmp(etat, "OFF") == 0 && strcmp(a->etat, "OFF") != 0) {
+        a->compteur_off++;
+        ch->delta_off = 1;
+    }
+    snprintf(a->etat, sizeof(a->etat), "%s", etat);
+    a->dernier_changement = time(NULL);
+
+    ch->type = CHG_ETAT;
+    ch->seq = ++ecriture_seq;
+    ch->quand = a->dernier_changement;
+    ch->port = a->port;
+    snprintf(ch->nom, sizeof(ch->nom), "%s", a->nom);
+    snprintf(ch->etat, sizeof(ch->etat), "%s", a->etat);
+    snprintf(ch->ip, sizeof(ch->ip), "%s", a->ip);
+    snprintf(ch->input, sizeof(ch->input), "%s", a->input);
+    return change;
+}
+
+// Retourne le seq d'écriture du changement (0 si rien n'est écrit), à
+// passer à ecriture_est_durable pour savoir s'il est sur disque.
+unsigned long long majEtat(const char *nom, const char *etat) {
+    Changement *ch = malloc(sizeof(*ch));
+    if (!ch) return 0;
+    mutex_lock(&mutex_magasin);
+    int change = magasin_changer(nom, etat, ch);
+    unsigned long long seq = ch->seq;
+    if (change >= 0) ecriture_pousser(ch);
+    mutex_unlock(&mutex_magasin);
+    if (change < 0) free(ch);
+    // Diffusion aux panneaux abonnés (/events) si l'état a réellement changé
+    if (change > 0) evenements_publier(nom, etat);
+    return seq;
+}
+
+
+// =========================================================
+// OUTBOX (commandes persistées avant envoi)
+// =========================================================
+// Chaque commande est inscrite dans l'outbox sous le même verrou que le
+// changement d'état, et les deux sont écrits dans la même transaction par le
+// thread d'écriture : après un plantage, la base ne peut plus dire ON sans
+// qu'une commande ON reste à livrer. La commande ne part vers la file du
+// contrôleur qu'après ce COMMIT : un plantage dans la fenêtre d'écriture ne
+// laisse jamais un appareil basculé à l'insu de la base. Les livraisons sont
+// marquées par lots, dans les transactions suivantes. Une commande en échec
+// reste à livrer : le thread d'écriture relance toutes les OUTBOX_RELANCE_S
+// les lignes en attente depuis plus longtemps que cela, sauf si leur
+// livraison est encore en cours.
+//
+// Dernière écriture gagnante, comme la file : l'écriture d'une commande
+// marque "remplacée" la ligne encore en attente de la même entrée (ip,
+// input). Il n'y a donc jamais plus d'une ligne en attente par appareil, et
+// la reprise au démarrage lit au plus une centaine de lignes sur l'index
+// partiel outbox_en_attente, quelle que soit la taille de la table.
+#define OUTBOX_PURGE_S 3600            // lignes livrées effacées après un jour, vérifié toutes les heures
+#define OUTBOX_RELANCE_S 30            // relance des lignes en attente depuis 30 s, toutes les 30 s
+
+static long long outbox_dernier_id = 0;  // ids attribués en mémoire, avant l'écriture (mutex_magasin)
+static atomic_ulong outbox_marquees = 0, outbox_rejouees = 0;
+
+// Ajoute la ligne outbox au changement d'état ch (qui devient CHG_COMMANDE) ;
+// appelée avec mutex_magasin. Retourne l'id de la ligne.
+static long long outbox_inscrire(Changement *ch, const char *type) {
+    ch->type = CHG_COMMANDE;
+    ch->outbox = ++outbox_dernier_id;
+    snprintf(ch->type_cmd, sizeof(ch->type_cmd), "%s", type);
+    return ch->outbox;
+}
+
+// Appelée par les expéditeurs quand une commande est livrée (acquittee) ou
+// seulement envoyée à un contrôleur sans accusé : dans les deux cas, la
+// relance de l'outbox ne la renvoie plus
+void outbox_noter_livree(long long id, int acquittee) {
+    Changement *ch = calloc(1, sizeof(*ch));
+    // Sans mémoire, la ligne reste en attente : rejouée au prochain démarrage
+    if (!ch) return;
+    ch->type = CHG_LIVREE;
+    ch->outbox = id;
+    snprintf(ch->etat, sizeof(ch->etat), "%d", acquittee ? 1 : 3);
+    ecriture_pousser(ch);
+}
+
+// Renvoie les commandes en attente depuis au moins age_s secondes dont aucune
+// livraison n'est en cours. Retourne le nombre de commandes renvoyées. Depuis
+// le thread d'écriture (ou avant son lancement) : aucune commande plus récente
+// de la même entrée ne peut être écrite entre la lecture et l'envoi.
+static int outbox_relancer(sqlite3 *db, int age_s) {
+    sqlite3_stmt *stmt = requete_prendre(db, REQ_OUTBOX_EN_ATTENTE);
+    if (!stmt) return 0;
+    int n = 0;
+    sqlite3_bind_int(stmt, 1, age_s);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *ip = (const char *)sqlite3_column_text(stmt, 0);
+        const char *type = (const char *)sqlite3_column_text(stmt, 2);
+        const char *input = (const char *)sqlite3_column_text(stmt, 3);
+        const char *etat = (const char *)sqlite3_column_text(stmt, 4);
+        long long id = sqlite3_column_int64(stmt, 5);
+        if (!ip || !type || !input || !etat || livraison_en_cours(id)) continue;
+        envoyer_au_simulateur(ip, sqlite3_column_int(stmt, 1), type, input, etat, id, 0);
+        n++;
+    }
+    requete_rendre(db, REQ_OUTBOX_EN_ATTENTE, stmt);
+    outbox_rejouees += (unsigned long)n;
+    return n;
+}
+
+// Rejoue les commandes non livrées au démarrage.
+// À appeler après pool_init (et la redirection éventuelle vers le simulateur).
+static void outbox_rejouer(sqlite3 *db) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, "SELECT MAX(id) FROM outbox;", -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+        outbox_dernier_id = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    double t0 = horloge_ns();
+    int n = outbox_relancer(db, 0);
+    if (n)
+        printf("📮 Outbox : %d commande(s) non livrée(s) rejouée(s) en %.1f ms\n", n, (horloge_ns() - t0) / 1e6);
+}
+
+
+// =========================================================
+// ÉCRITURE GROUPÉE (un thread, une transaction par lot)
+// =========================================================
+// Le thread d'écriture vide la file d'écriture et persiste tout ce qu'elle
+// contient dans une seule transaction (group commit), au plus tard
+// ecriture_fenetre_ms après le premier changement, ou dès ECRITURE_LOT
+// changements : une scène qui bascule trente lampes coûte un seul COMMIT.
+// C'est la fenêtre de durabilité : un plantage y perd au plus ces
+// changements, état et commandes ensemble, jamais l'un sans l'autre. Une
+// commande, elle, n'attend pas la fenêtre : son envoi au contrôleur suit le
+// COMMIT, et elle écrit tout de suite le lot qui la contient ; seuls les
+// changements d'état et de compteurs sans commande sont regroupés. Une
+// transaction en échec (base verrouillée, disque plein) garde le lot pour la
+// suivante.
+//
+// Un handler peut attendre que son changement soit écrit (/update?durable=1) :
+// la connexion est mise de côté sans bloquer le worker, et le thread
+// d'écriture réveille les workers concernés après chaque COMMIT.
+#define ECRITURE_FENETRE_MS 100   // défaut de --durabilite-ms
+
+static int ecriture_fenetre_ms = ECRITURE_FENETRE_MS;
+static Changement *ecriture_reprise = NULL;   // lot d'une transaction en échec, à réécrire d'abord
+static atomic_ulong ecriture_transactions = 0, ecriture_lignes = 0, ecriture_echecs = 0, ecriture_fusions = 0;
+static atomic_ulong ecriture_divergences = 0; // lignes trouvées dans un autre état que prévu
+
+int ecriture_est_durable(unsigned long long seq) {
+    return atomic_load(&ecriture_durable) >= seq;
+}
+
+// Réveille les workers qui ont des connexions en attente d'écriture
+static void ecriture_reveiller_workers(void) {
+    for (int i = 0; i < bus_nb_workers; i++) {
+        Worker *w = &bus_workers[i];
+        if (atomic_load(&w->nb_attentes_durables) == 0) continue;
+        if (atomic_exchange(&w->reveil_en_attente, 1)) continue; // déjà réveillé
+        sendto(sock_bus, "!", 1, 0, (struct sockaddr *)&w->adresse_reveil, sizeof(w->adresse_reveil));
+    }
+}
+
+// Remet à zéro la base et le magasin aux appareils initiaux (/reset-db). La
+// base est vidée puis réécrite par le thread d'écriture, dans une seule transaction.
+void resetDB(void) {
+    mutex_lock(&mutex_magasin);
+    nb_appareils = 0;
+    magasin_indexer(taille_index ? taille_index : 256);
+    Changement *reinit = calloc(1, sizeof(*reinit));
+    if (reinit) {
+        reinit->type = CHG_REINIT;
+        reinit->seq = ++ecriture_seq;
+        ecriture_pousser(reinit);
+    }
+    for (int i = 0; devices[i] != NULL; i += 5) {
+        int j = magasin_ajouter(devices[i], devices[i+1], devices[i+2], atoi(devices[i+4]), devices[i+3]);
+        Changement *ch = j >= 0 ? calloc(1, sizeof(*ch)) : NULL;
+        if (!ch) break;
+        Appareil *a = &appareils[j];
+        a->dernier_changement = time(NULL);
+        ch->type = CHG_ETAT;
+        ch->seq = ++ecriture_seq;
+        ch->nouveau = 1;
+        ch->quand = a->dernier_changement;
+        ch->port = a->port;
+        snprintf(ch->nom, sizeof(ch->nom), "%s", a->nom);
+        snprintf(ch->etat, sizeof(ch->etat), "%s", a->etat);
+        snprintf(ch->ip, sizeof(ch->ip), "%s", a->ip);
+        snprintf(ch->input, sizeof(ch->input), "%s", a->input);
+        ecriture_pousser(ch);
+    }
+    mutex_unlock(&mutex_magasin);
+    // On ne fait pas initDB ici pour ne pas avoir de conflit avec l'initialisation de main()
+    printf("[DB] Base '%s' réinitialisée.\n", DB_FILE);
+}
+
+static int ecrire_texte(sqlite3 *db, Requete r, int nb, const char **valeurs) {
+    sqlite3_stmt *stmt = requete_prendre(db, r);
+    if (!stmt) return -1;
+    for (int i = 0; i < nb; i++) sqlite3_bind_text(stmt, i + 1, valeurs[i], -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    requete_rendre(db, r, stmt);
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+// Écrit un appareil (somme des changements du lot) en une requête. L'état
+// précédent rendu par la base doit être celui que le magasin avait avant le
+// lot : sinon la ligne a été modifiée ou effacée par un autre programme
+// (main.c partage le fichier), et le magasin, qui fait foi, l'écrase.
+static int ecrire_appareil(sqlite3 *db, const Changement *a) {
+    char quand[32];
+    struct tm tm;
+#ifdef _WIN32
+    gmtime_s(&tm, &a->quand);
+#else
+    gmtime_r(&a->quand, &tm);
+#endif
+    strftime(quand, sizeof(quand), "%Y-%m-%d %H:%M:%S", &tm);
+    sqlite3_stmt *stmt = requete_prendre(db, REQ_APPAREIL_ECRIRE);
+    if (!stmt) return -1;
+    sqlite3_bind_text(stmt, 1, a->nom, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, a->etat, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, a->ip, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, a->input, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 5, a->port);
+    sqlite3_bind_int(stmt, 6, a->delta_on);
+    sqlite3_bind_int(stmt, 7, a->delta_off);
+    sqlite3_bind_text(stmt, 8, quand, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        const char *precedent = (const char *)sqlite3_column_text(stmt, 0);
+        if (precedent ? (a->etat_avant[0] && strcmp(precedent, a->etat_avant) != 0) : !a->nouveau) {
+            ecriture_divergences++;
+            fprintf(stderr, "[DB] %s valait %s en base, %s en mémoire : réécrit à %s\n",
+                    a->nom, precedent ? precedent : "(absent)", a->etat_avant, a->etat);
+        }
+    }
+    requete_rendre(db, REQ_APPAREIL_ECRIRE, stmt);
+    return rc == SQLITE_ROW ? 0 : -1;
+}
+
+// Fusionne les changements d'état du lot : un seul Changement par appareil,
+// dernier état, incréments additionnés. Retourne le nombre d'appareils, -1
+// faute de mémoire.
+static int ecriture_fusionner(Changement *lot, int nb, Changement **appareils_lot) {
+    unsigned taille = 16;
+    while (taille < (unsigned)nb * 2) taille *= 2;
+    Changement **table = calloc(taille, sizeof(*table));
+    if (!table) return -1;
+    int n = 0;
+    for (Changement *ch = lot; ch; ch = ch->suiv) {
+        if (ch->type != CHG_ETAT && ch->type != CHG_COMMANDE) continue;
+        unsigned h = hash_texte(2166136261u, ch->nom);
+        while (table[h & (taille - 1)] && strcmp(table[h & (taille - 1)]->nom, ch->nom) != 0) h++;
+        Changement *a = table[h & (taille - 1)];
+        if (a) {
+            ecriture_fusions++;
+        } else {
+            a = malloc(sizeof(*a));
+            if (!a) {
+                while (n > 0) free(appareils_lot[--n]);
+                free(table);
+                return -1;
+            }
+            *a = *ch; // état et création d'avant le lot : ceux du premier changement
+            a->delta_on = a->delta_off = 0;
+            table[h & (taille - 1)] = a;
+            appareils_lot[n++] = a;
+        }
+        snprintf(a->etat, sizeof(a->etat), "%s", ch->etat);
+        a->quand = ch->quand;
+        a->delta_on += ch->delta_on;
+        a->delta_off += ch->delta_off;
+    }
+    free(table);
+    return n;
+}
+
+// Une transaction avec tout ce que contient la file, puis (expedier) envoi
+// des commandes écrites. Retourne le nombre de changements écrits, -1 si la
+// transaction a échoué (le lot sera réécrit, et ses commandes envoyées après).
+int magasin_persister(sqlite3 *db, int expedier) {
+    // Prise de la file, remise dans l'ordre d'arrivée, derrière une éventuelle reprise
+    Changement *pile = atomic_exchange(&file_ecriture, NULL), *lot = NULL;
+    int nb = 0, nb_commandes = 0;
+    while (pile) {
+        Changement *suiv = pile->suiv;
+        pile->suiv = lot;
+        lot = pile;
+        pile = suiv;
+        nb++;
+        nb_commandes += lot->type == CHG_COMMANDE;
+    }
+    atomic_fetch_sub(&ecriture_en_attente, nb);
+    atomic_fetch_sub(&ecriture_commandes, nb_commandes);
+    if (ecriture_reprise) {
+        Changement *q = ecriture_reprise;
+        while (q->suiv) q = q->suiv;
+        q->suiv = lot;
+        lot = ecriture_reprise;
+        ecriture_reprise = NULL;
+    }
+    if (!lot) return 0;
+
+    // Un /reset-db efface tout ce qui le précède
+    Changement *debut = lot;
+    for (Changement *ch = lot; ch; ch = ch->suiv)
+        if (ch->type == CHG_REINIT) debut = ch;
+    unsigned long long seq_max = 0;
+    nb = 0;
+    for (Changement *ch = lot; ch; ch = ch->suiv) {
+        if (ch->seq > seq_max) seq_max = ch->seq;
+        nb++;
+    }
+
+    Changement **appareils_lot = malloc((size_t)nb * sizeof(*appareils_lot));
+    int nb_appareils_lot = appareils_lot ? ecriture_fusionner(debut, nb, appareils_lot) : -1;
+
+    static double purge = 0;
+    unsigned long marquees = 0;
+    int ok = nb_appareils_lot >= 0 && requete_executer(db, REQ_BEGIN_IMMEDIATE) == SQLITE_OK;
+    if (ok && debut->type == CHG_REINIT)
+        ok = requete_executer(db, REQ_VIDER_APPAREILS) == SQLITE_OK && requete_executer(db, REQ_VIDER_OUTBOX) == SQLITE_OK;
+    for (int i = 0; ok && i < nb_appareils_lot; i++) ok = ecrire_appareil(db, appareils_lot[i]) == 0;
+    // Lignes outbox puis livraisons, dans l'ordre d'arrivée
+    for (Changement *ch = debut; ok && ch; ch = ch->suiv) {
+        char id[24], port[16];
+        snprintf(id, sizeof(id), "%lld", ch->outbox);
+        if (ch->type == CHG_COMMANDE) {
+            snprintf(port, sizeof(port), "%d", ch->port);
+            ok = ecrire_texte(db, REQ_OUTBOX_REMPLACER, 2, (const char *[]){ ch->ip, ch->input }) == 0
+              && ecrire_texte(db, REQ_OUTBOX_INSERER, 6, (const char *[]){ id, ch->ip, port, ch->type_cmd, ch->input, ch->etat }) == 0;
+        } else if (ch->type == CHG_LIVREE) {
+            ok = ecrire_texte(db, REQ_OUTBOX_MARQUER, 2, (const char *[]){ id, ch->etat }) == 0;
+            marquees += (unsigned long)sqlite3_changes(db);
+        }
+    }
+    if (ok && horloge_ns() >= purge) {
+        sqlite3_exec(db, "DELETE FROM outbox WHERE livree <> 0 AND cree < datetime('now', '-1 day');", NULL, NULL, NULL);
+        purge = horloge_ns() + OUTBOX_PURGE_S * 1e9;
+    }
+    if (ok) ok = requete_executer(db, REQ_COMMIT) == SQLITE_OK;
+
+    for (int i = 0; i < nb_appareils_lot; i++) free(appareils_lot[i]);
+    free(appareils_lot);
+    if (!ok) {
+        fprintf(stderr, "[DB] Écriture de %d changement(s) reportée : %s\n", nb, sqlite3_errmsg(db));
+        requete_executer(db, REQ_ROLLBACK);
+        ecriture_echecs++;
+        ecriture_reprise = lot;
+        return -1;
+    }
+    // Lignes outbox sur disque : les commandes peuvent partir, dans l'ordre
+    // d'écriture (celles qu'un /reset-db a effacées sont caduques)
+    int effacee = debut != lot;
+    while (lot) {
+        Changement *suiv = lot->suiv;
+        if (lot == debut) effacee = 0;
+        if (lot->type == CHG_COMMANDE && effacee) livraison_noter(lot->livraison, LIVRAISON_REMPLACEE, 0, 0, 0);
+        else if (lot->type == CHG_COMMANDE && expedier)
+            envoyer_au_simulateur(lot->ip, lot->port, lot->type_cmd, lot->input, lot->etat, lot->outbox, lot->livraison);
+        free(lot);
+        lot = suiv;
+    }
+    ecriture_transactions++;
+    ecriture_lignes += (unsigned long)nb;
+    outbox_marquees += marquees;
+    if (seq_max > atomic_load(&ecriture_durable)) atomic_store(&ecriture_durable, seq_max);
+    ecriture_reveiller_workers();
+    return nb;
+}
+
+static void *magasin_ecrivain(void *arg) {
+    sqlite3 *db = arg;
+    double relance = horloge_ns() + OUTBOX_RELANCE_S * 1e9;
+    while (1) {
+        mutex_lock(&mutex_ecriture);
+        while (atomic_load(&ecriture_en_attente) == 0 && !ecriture_reprise) {
+            double reste = relance - horloge_ns();
+            if (reste <= 0) break;
+            cond_attendre_ms(&cond_ecriture, &mutex_ecriture, (int)(reste / 1e6) + 1);
+        }
+        if (horloge_ns() >= relance) {
+            mutex_unlock(&mutex_ecriture);
+            magasin_persister(db, 1); // livraisons notées entre-temps : ces lignes ne sont plus en attente
+            int n = outbox_relancer(db, OUTBOX_RELANCE_S);
+            if (n) printf("📮 Outbox : %d commande(s) en attente renvoyée(s)\n", n);
+            relance = horloge_ns() + OUTBOX_RELANCE_S * 1e9;
+            continue;
+        }
+        // Fenêtre de durabilité : les changements suivants rejoignent la même
+        // transaction, sauf si une commande attend d'être envoyée
+        double fin = horloge_ns() + ecriture_fenetre_ms * 1e6;
+        while (atomic_load(&ecriture_en_attente) < ECRITURE_LOT && atomic_load(&ecriture_commandes) == 0) {
+            double reste = fin - horloge_ns();
+            if (reste <= 0) break;
+            cond_attendre_ms(&cond_ecriture, &mutex_ecriture, (int)(reste / 1e6) + 1);
+        }
+        mutex_unlock(&mutex_ecriture);
+        if (magasin_persister(db, 1) < 0) dormir_ms(ecriture_fenetre_ms > 0 ? ecriture_fenetre_ms : 10);
+    }
+    return NULL;
+}
+
+// Charge les appareils, rejoue l'outbox et lance le thread d'écriture (avec
+// sa propre connexion). À appeler après pool_init et avant les workers.
+int magasin_init(void) {
+    sqlite3 *db = NULL;
+    mutex_init(&mutex_magasin);
+    mutex_init(&mutex_ecriture);
+    cond_init(&cond_ecriture);
+    if (sqlite3_open(DB_FILE, &db) != SQLITE_OK) {
+        fprintf(stderr, "Erreur ouverture DB (écriture): %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    sqlite3_busy_timeout(db, 5000);
+    stockage_appliquer(db);
+    if (requetes_preparer(db) != 0 || magasin_charger(db) != 0) return -1;
+    outbox_rejouer(db);
+
+    thread_t t;
+    if (stockage_demarrer(db, DB_FILE, &t) < 0) return -1;
+    if (thread_lancer(&t, magasin_ecrivain, db) != 0) {
+        fprintf(stderr, "thread d'écriture non lancé\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+// =========================================================
+// QUERY PARSING
+// =========================================================
+void extract_query(Tranche query, char *device_out, char *etat_out, char *type_out) {
+    device_out[0] = etat_out[0] = type_out[0] = '\0';
+    if (query.len == 0) return;
+
+    char tmp[512];
+    size_t n = query.len < sizeof(tmp) - 1 ? query.len : sizeof(tmp) - 1;
+    memcpy(tmp, query.p, n);
+    tmp[n] = '\0';
+
+    char *etat_tok = NULL;
+#ifdef _WIN32
+    char *token = strtok_s(tmp, "&", &etat_tok);
+#else
+    char *token = strtok_r(tmp, "&", &etat_tok);
+#endif
+    while (token) {
+        if (strncmp(token, "nom=", 4) == 0)
+            url_decode(device_out, token + 4);
+        else if (strncmp(token, "etat=", 5) == 0)
+            url_decode(etat_out, token + 5);
+        else if (strncmp(token, "type=", 5) == 0)
+            url_decode(type_out, token + 5);
+#ifdef _WIN32
+        token = strtok_s(NULL, "&", &etat_tok);
+#else
+        token = strtok_r(NULL, "&", &etat_tok);
+#endif
+    }
+}
+
+// 1 si la requête porte cle=1 (ou cle=true)
+int query_drapeau(Tranche query, const char *cle) {
+    size_t n = strlen(cle);
+    for (size_t i = 0; i + n + 1 < query.len; i++) {
+        if ((i == 0 || query.p[i - 1] == '&') && memcmp(query.p + i, cle, n) == 0 && query.p[i + n] == '=')
+            return query.p[i + n + 1] == '1' || query.p[i + n + 1] == 't';
+    }
+    return 0;
+}
+
+
+// =========================================================
+// BOUCLE D'ÉVÉNEMENTS
+// =========================================================
+// Interface commune aux backends : epoll (Linux, edge-triggered), io_uring
+// (Linux, optionnel, à complétion) et select (Windows / repli portable). Les
+// sockets sont non bloquants et toujours lus / écrits jusqu'à EAGAIN, ce qui
+// rend les sémantiques interchangeables : un backend à complétion fait les
+// E/S lui-même et les rend par accepter() / lire() / ecrire().
+#define EV_LECTURE  1
+#define EV_ECRITURE 2
+#define EV_ERREUR   4
+#define EV_DONNEES  8   // ajouter() : connexion lue et écrite par boucle_recv() / boucle_writev()
+
+typedef struct {
+    void *ptr;  // NULL = socket d'écoute, sinon la Connexion
+    int evts;
+} Evenement;
+
+struct Boucle {
+    const char *nom;
+    int  (*ajouter)(Boucle *b, SOCKET fd, void *ptr, int interet);
+    int  (*modifier)(Boucle *b, SOCKET fd, void *ptr, int interet);
+    void (*retirer)(Boucle *b, SOCKET fd);
+    int  (*attendre)(Boucle *b, Evenement *evs, int max, int timeout_ms);
+    void (*detruire)(Boucle *b);
+    // Backends à complétion seulement (NULL sinon) : équivalents de accept(),
+    // recv() et writev() pour le socket d'écoute et les connexions EV_DONNEES
+    SOCKET (*accepter)(Boucle *b, SOCKET ecoute);
+    long (*lire)(Boucle *b, SOCKET fd, char *buf, size_t len);
+#ifndef _WIN32
+    long (*ecrire)(Boucle *b, SOCKET fd, const struct iovec *iov, int n);
+#endif
+    void *priv;
+};
+
+SOCKET boucle_accept(Boucle *b, SOCKET ecoute) {
+    if (b->accepter) return b->accepter(b, ecoute);
+    struct sockaddr_in client_addr;
+    socklen_t addrlen = sizeof(client_addr);
+    return accept(ecoute, (struct sockaddr *)&client_addr, &addrlen);
+}
+
+long boucle_recv(Boucle *b, SOCKET fd, char *buf, size_t len) {
+    if (b->lire) return b->lire(b, fd, buf, len);
+    return recv(fd, buf, (int)len, 0);
+}
+
+#ifndef _WIN32
+long boucle_writev(Boucle *b, SOCKET fd, const struct iovec *iov, int n) {
+    if (b->ecrire) return b->ecrire(b, fd, iov, n);
+    return (long)writev(fd, iov, n);
+}
+#endif
+
+#ifdef __linux__
+// --- Backend epoll ---
+typedef struct { int epfd; } BoucleEpoll;
+
+static unsigned int epoll_interet(int interet) {
+    unsigned int e = EPOLLET | EPOLLRDHUP;
+    if (interet & EV_LECTURE) e |= EPOLLIN;
+    if (interet & EV_ECRITURE) e |= EPOLLOUT;
+    return e;
+}
+
+static int epoll_ajouter(Boucle *b, SOCKET fd, void *ptr, int interet) {
+    struct epoll_event ev;
+    ev.events = epoll_interet(interet);
+    ev.data.ptr = ptr;
+    return epoll_ctl(((BoucleEpoll *)b->priv)->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int epoll_modifier(Boucle *b, SOCKET fd, void *ptr, int interet) {
+    struct epoll_event ev;
+    ev.events = epoll_interet(interet);
+    ev.data.ptr = ptr;
+    return epoll_ctl(((BoucleEpoll *)b->priv)->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+static void epoll_retirer(Boucle *b, SOCKET fd) {
+    epoll_ctl(((BoucleEpoll *)b->priv)->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int epoll_attendre(Boucle *b, Evenement *evs, int max, int timeout_ms) {
+    struct epoll_event tmp[MAX_EVENEMENTS];
+    if (max > MAX_EVENEMENTS) max = MAX_EVENEMENTS;
+    int n = epoll_wait(((BoucleEpoll *)b->priv)->epfd, tmp, max, timeout_ms);
+    if (n < 0) return errno == EINTR ? 0 : -1;
+    for (int i = 0; i < n; i++) {
+        evs[i].ptr = tmp[i].data.ptr;
+        evs[i].evts = 0;
+        if (tmp[i].events & (EPOLLIN | EPOLLRDHUP)) evs[i].evts |= EV_LECTURE;
+        if (tmp[i].events & EPOLLOUT) evs[i].evts |= EV_ECRITURE;
+        if (tmp[i].events & (EPOLLERR | EPOLLHUP)) evs[i].evts |= EV_ERREUR;
+    }
+    return n;
+}
+
+static void epoll_detruire(Boucle *b) {
+    close(((BoucleEpoll *)b->priv)->epfd);
+    free(b->priv);
+    free(b);
+}
+
+Boucle *boucle_epoll(void) {
+    BoucleEpoll *be = malloc(sizeof(*be));
+    Boucle *b = calloc(1, sizeof(*b));
+    if (!be || !b) { free(be); free(b); return NULL; }
+    be->epfd = epoll_create1(0);
+    if (be->epfd < 0) { free(be); free(b); return NULL; }
+    b->nom = "epoll";
+    b->ajouter = epoll_ajouter;
+    b->modifier = epoll_modifier;
+    b->retirer = epoll_retirer;
+    b->attendre = epoll_attendre;
+    b->detruire = epoll_detruire;
+    b->priv = be;
+    return b;
+}
+#endif
+
+#if defined(__linux__) && !defined(DOMO_SANS_IO_URING)
+// --- Backend io_uring ---
+// Backend à complétion : le noyau fait lui-même les E/S des connexions. Le
+// socket d'écoute a une demande ACCEPT multishot, chaque connexion (ajoutée
+// avec EV_DONNEES) une demande RECV dans un tampon de la boucle, et ce que
+// la connexion envoie est copié dans une demande SEND. Pour le reste du
+// serveur, lire() et ecrire() se comportent comme recv() et writev() sur un
+// socket non bloquant : les données déjà reçues sont rendues, sinon EAGAIN
+// et la complétion produit l'événement suivant. Les autres sockets (réveil)
+// gardent une demande POLL_ADD multishot. Les demandes sont seulement écrites
+// dans la file de soumission et partent ensemble au prochain attendre() ; les
+// complétions sont lues directement dans l'anneau partagé, sans appel
+// système tant qu'il en reste.
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef POLLRDHUP
+#define POLLRDHUP 0x2000 // exposé par <poll.h> seulement avec _GNU_SOURCE
+#endif
+#define URING_ENTREES 1024
+#define URING_IGNORE  0xFFFFFFFFFFFFFFFFULL // user_data des annulations
+#define URING_TAMPON_RECV 4096
+#define URING_TAMPON_ENVOI 65536            // octets copiés par demande SEND au plus
+#define URING_BLOC_FICHIER 65536            // lecture des pages statiques, par demande READ
+#define URING_BLOCS_FICHIER 8
+
+#define OP_POLL 0
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_ENVOI 3
+
+// Une demande soumise ; user_data pointe dessus. Libérée à sa dernière
+// complétion (sans IORING_CQE_F_MORE), sauf réception gardée pour lire().
+typedef struct {
+    int type;           // OP_*
+    int fd;
+    int orpheline;      // socket retiré : la complétion est seulement libérée
+    int en_vol;
+    int res;            // OP_RECV terminée : octets reçus, 0 en fin de flux, -errno
+    size_t len, pos;    // OP_RECV : octets déjà rendus (pos) ; OP_ENVOI : octets envoyés (pos)
+    char data[];
+} OpUring;
+
+typedef struct {
+    void *ptr;
+    int interet;
+    int actif;
+    int lot, indice;    // fusion des complétions d'un même socket dans un lot
+    OpUring *poll;      // POLL_ADD ou ACCEPT en cours
+    OpUring *recv;      // réception en vol, ou terminée et pas encore lue
+    OpUring *envoi;     // envoi en vol (un seul à la fois, dans l'ordre)
+    int erreur;         // errno d'un envoi échoué, rendu au prochain lire() / ecrire()
+    int ecriture_bloquee; // ecrire() a rendu EAGAIN : EV_ECRITURE à la fin de l'envoi
+} EntreeUring;
+
+typedef struct {
+    int fd;
+    unsigned *sq_tete, *sq_queue, *sq_masque, *sq_tableau;
+    unsigned *cq_tete, *cq_queue, *cq_masque;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entrees, a_soumettre;
+    void *anneaux;
+    size_t taille_anneaux, taille_sqes;
+    int multishot, accept_multishot, lot;
+    EntreeUring *entrees;
+    int nb_entrees;
+    SOCKET *acceptes;   // connexions acceptées, pas encore prises par accepter()
+    int nb_acceptes, cap_acceptes;
+} BoucleUring;
+
+static int uring_enter(BoucleUring *bu, unsigned a_soumettre, unsigned min, unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, bu->fd, a_soumettre, min, flags, arg, argsz);
+}
+
+static struct io_uring_sqe *uring_sqe(BoucleUring *bu) {
+    unsigned queue = *bu->sq_queue;
+    if (queue - __atomic_load_n(bu->sq_tete, __ATOMIC_ACQUIRE) >= bu->sq_entrees) {
+        // File pleine : on soumet ce qui attend avant de continuer
+        if (uring_enter(bu, bu->a_soumettre, 0, 0, NULL, 0) < 0) return NULL;
+        bu->a_soumettre = 0;
+    }
+    unsigned i = queue & *bu->sq_masque;
+    struct io_uring_sqe *sqe = &bu->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    bu->sq_tableau[i] = i;
+    __atomic_store_n(bu->sq_queue, queue + 1, __ATOMIC_RELEASE);
+    bu->a_soumettre++;
+    return sqe;
+}
+
+static EntreeUring *uring_entree(BoucleUring *bu, SOCKET fd) {
+    if (fd >= bu->nb_entrees) {
+        int n = bu->nb_entrees ? bu->nb_entrees : 1024;
+        while (n <= fd) n *= 2;
+        EntreeUring *e = realloc(bu->entrees, (size_t)n * sizeof(*e));
+        if (!e) return NULL;
+        memset(e + bu->nb_entrees, 0, (size_t)(n - bu->nb_entrees) * sizeof(*e));
+        bu->entrees = e;
+        bu->nb_entrees = n;
+    }
+    return &bu->entrees[fd];
+}
+
+static OpUring *uring_op(int type, SOCKET fd, size_t taille) {
+    OpUring *op = malloc(sizeof(OpUring) + taille);
+    if (!op) return NULL;
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+    op->fd = fd;
+    op->len = taille;
+    return op;
+}
+
+// (Re)soumet la demande : le type et l'état de op disent quoi demander
+static int uring_soumettre(BoucleUring *bu, OpUring *op, int interet) {
+    struct io_uring_sqe *sqe = uring_sqe(bu);
+    if (!sqe) return -1;
+    sqe->fd = op->fd;
+    sqe->user_data = (unsigned long long)(uintptr_t)op;
+    switch (op->type) {
+    case OP_POLL:
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLRDHUP | (interet & EV_LECTURE ? POLLIN : 0) | (interet & EV_ECRITURE ? POLLOUT : 0);
+        sqe->len = bu->multishot ? IORING_POLL_ADD_MULTI : 0;
+        break;
+    case OP_ACCEPT:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->ioprio = bu->accept_multishot ? IORING_ACCEPT_MULTISHOT : 0;
+        break;
+    case OP_RECV:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->addr = (unsigned long long)(uintptr_t)op->data;
+        sqe->len = (unsigned)op->len;
+        break;
+    case OP_ENVOI:
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (unsigned long long)(uintptr_t)(op->data + op->pos);
+        sqe->len = (unsigned)(op->len - op->pos);
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL; // envoi complet, même socket retiré entre-temps
+        break;
+    }
+    op->en_vol = 1;
+    return 0;
+}
+
+// Demande en vol du socket retiré : annulée (un envoi, lui, va jusqu'au bout)
+static void uring_annuler(BoucleUring *bu, OpUring *op) {
+    if (!op) return;
+    op->orpheline = 1;
+    if (!op->en_vol) { free(op); return; }
+    if (op->type == OP_ENVOI) return;
+    struct io_uring_sqe *sqe = uring_sqe(bu);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (unsigned long long)(uintptr_t)op;
+    sqe->user_data = URING_IGNORE;
+}
+
+static int uring_ajouter(Boucle *b, SOCKET fd, void *ptr, int interet) {
+    BoucleUring *bu = b->priv;
+    EntreeUring *e = uring_entree(bu, fd);
+    if (!e) return -1;
+    memset(e, 0, sizeof(*e));
+    e->ptr = ptr;
+    e->interet = interet;
+    e->actif = 1;
+    // Socket d'écoute (ptr NULL) : ACCEPT ; connexion : RECV ; sinon POLL_ADD
+    int type = !ptr ? OP_ACCEPT : (interet & EV_DONNEES) ? OP_RECV : OP_POLL;
+    OpUring *op = uring_op(type, fd, type == OP_RECV ? URING_TAMPON_RECV : 0);
+    if (!op || uring_soumettre(bu, op, interet) != 0) {
+        free(op);
+        e->actif = 0;
+        return -1;
+    }
+    if (type == OP_RECV) e->recv = op;
+    else e->poll = op;
+    return 0;
+}
+
+static int uring_modifier(Boucle *b, SOCKET fd, void *ptr, int interet) {
+    BoucleUring *bu = b->priv;
+    EntreeUring *e = uring_entree(bu, fd);
+    if (!e || !e->actif) return -1;
+    e->ptr = ptr;
+    // Connexion : l'envoi en vol signale lui-même sa fin, rien à réarmer
+    if (e->interet == interet || (interet & EV_DONNEES)) {
+        e->interet = interet;
+        return 0;
+    }
+    e->interet = interet;
+    uring_annuler(bu, e->poll);
+    e->poll = uring_op(OP_POLL, fd, 0);
+    if (!e->poll) return -1;
+    return uring_soumettre(bu, e->poll, interet);
+}
+
+static void uring_retirer(Boucle *b, SOCKET fd) {
+    BoucleUring *bu = b->priv;
+    if (fd >= bu->nb_entrees || !bu->entrees[fd].actif) return;
+    EntreeUring *e = &bu->entrees[fd];
+    uring_annuler(bu, e->poll);
+    uring_annuler(bu, e->recv);
+    uring_annuler(bu, e->envoi);
+    e->poll = e->recv = e->envoi = NULL;
+    e->actif = 0;
+    // Le socket est fermé juste après : ses demandes doivent partir avant
+    if (bu->a_soumettre && uring_enter(bu, bu->a_soumettre, 0, 0, NULL, 0) >= 0) bu->a_soumettre = 0;
+}
+
+static SOCKET uring_accepter(Boucle *b, SOCKET ecoute) {
+    BoucleUring *bu = b->priv;
+    (void)ecoute;
+    if (bu->nb_acceptes == 0) {
+        errno = EAGAIN;
+        return INVALID_SOCKET;
+    }
+    return bu->acceptes[--bu->nb_acceptes];
+}
+
+static long uring_lire(Boucle *b, SOCKET fd, char *buf, size_t len) {
+    BoucleUring *bu = b->priv;
+    EntreeUring *e = fd < bu->nb_entrees ? &bu->entrees[fd] : NULL;
+    if (!e || !e->actif) { errno = EBADF; return -1; }
+    if (e->erreur) { errno = e->erreur; return -1; }
+    OpUring *op = e->recv;
+    if (op && !op->en_vol) {
+        if (op->res <= 0) { // fin de flux (rendue à chaque appel) ou erreur
+            if (op->res == 0) return 0;
+            errno = -op->res;
+            return -1;
+        }
+        size_t n = (size_t)op->res - op->pos < len ? (size_t)op->res - op->pos : len;
+        memcpy(buf, op->data + op->pos, n);
+        op->pos += n;
+        if (op->pos == (size_t)op->res && uring_soumettre(bu, op, 0) != 0) { // tout est rendu : réception suivante
+            free(op);
+            e->recv = NULL;
+        }
+        return (long)n;
+    }
+    if (!op) { // réception abandonnée faute de place dans la file : nouvelle demande
+        e->recv = uring_op(OP_RECV, fd, URING_TAMPON_RECV);
+        if (!e->recv || uring_soumettre(bu, e->recv, 0) != 0) {
+            free(e->recv);
+            e->recv = NULL;
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+static long uring_ecrire(Boucle *b, SOCKET fd, const struct iovec *iov, int n) {
+    BoucleUring *bu = b->priv;
+    EntreeUring *e = fd < bu->nb_entrees ? &bu->entrees[fd] : NULL;
+    if (!e || !e->actif) { errno = EBADF; return -1; }
+    if (e->erreur) { errno = e->erreur; return -1; }
+    if (e->envoi) {
+        e->ecriture_bloquee = 1;
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t total = 0;
+    for (int i = 0; i < n && total < URING_TAMPON_ENVOI; i++)
+        total += iov[i].iov_len < URING_TAMPON_ENVOI - total ? iov[i].iov_len : URING_TAMPON_ENVOI - total;
+    OpUring *op = uring_op(OP_ENVOI, fd, total);
+    if (!op) { errno = ENOMEM; return -1; }
+    size_t pos = 0;
+    for (int i = 0; i < n && pos < total; i++) {
+        size_t t = iov[i].iov_len < total - pos ? iov[i].iov_len : total - pos;
+        memcpy(op->data + pos, iov[i].iov_base, t);
+        pos += t;
+    }
+    if (uring_soumettre(bu, op, 0) != 0) {
+        free(op);
+        errno = ENOMEM;
+        return -1;
+    }
+    e->envoi = op;
+    return (long)total; // copié : la file de la connexion peut avancer
+}
+
+// Complétion d'une demande encore rattachée à son socket : événement à rendre
+// (EV_*), ou 0
+static int uring_completer(BoucleUring *bu, EntreeUring *e, OpUring *op, int res, unsigned flags) {
+    int fini = !(flags & IORING_CQE_F_MORE);
+    if (fini) op->en_vol = 0;
+    switch (op->type) {
+    case OP_ACCEPT:
+        if (res == -EINVAL && bu->accept_multishot) {
+            bu->accept_multishot = 0; // noyau < 5.19 : une demande par connexion
+            uring_soumettre(bu, op, 0);
+            return 0;
+        }
+        if (res >= 0) {
+            if (bu->nb_acceptes == bu->cap_acceptes) {
+                int cap = bu->cap_acceptes ? bu->cap_acceptes * 2 : 64;
+                SOCKET *a = realloc(bu->acceptes, (size_t)cap * sizeof(*a));
+                if (!a) { close(res); res = -ENOMEM; }
+                else { bu->acceptes = a; bu->cap_acceptes = cap; }
+            }
+            if (res >= 0) bu->acceptes[bu->nb_acceptes++] = res;
+        }
+        if (fini) uring_soumettre(bu, op, 0);
+        return res >= 0 ? EV_LECTURE : 0;
+    case OP_POLL:
+        if (res == -EINVAL && bu->multishot) {
+            // Noyau < 5.13 : pas de poll multishot, on réarme à chaque complétion
+            bu->multishot = 0;
+            uring_soumettre(bu, op, e->interet);
+            return 0;
+        }
+        if (fini) uring_soumettre(bu, op, e->interet); // demande terminée : on réarme
+        if (res < 0) return EV_ERREUR;
+        return (res & (POLLIN | POLLRDHUP) ? EV_LECTURE : 0) | (res & POLLOUT ? EV_ECRITURE : 0)
+             | (res & (POLLERR | POLLHUP) ? EV_ERREUR : 0);
+    case OP_RECV:
+        op->res = res;
+        op->pos = 0;
+        return res < 0 ? EV_LECTURE | EV_ERREUR : EV_LECTURE;
+    default: // OP_ENVOI
+        if (res > 0 && op->pos + (size_t)res < op->len) {
+            op->pos += (size_t)res; // envoi partiel : la suite part tout de suite
+            if (uring_soumettre(bu, op, 0) == 0) return 0;
+            res = -ENOMEM;
+        }
+        if (res <= 0) e->erreur = res < 0 ? -res : EPIPE;
+        free(op);
+        e->envoi = NULL;
+        if (!e->ecriture_bloquee && !e->erreur) return 0;
+        e->ecriture_bloquee = 0;
+        return e->erreur ? EV_ECRITURE | EV_ERREUR : EV_ECRITURE;
+    }
+}
+
+static int uring_attendre(Boucle *b, Evenement *evs, int max, int timeout_ms) {
+    BoucleUring *bu = b->priv;
+    unsigned tete = *bu->cq_tete;
+    if (tete == __atomic_load_n(bu->cq_queue, __ATOMIC_ACQUIRE)) {
+        // Rien de prêt : un seul appel soumet le lot en attente et dort
+        struct __kernel_timespec ts = { timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000 };
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = timeout_ms >= 0 ? (unsigned long long)(uintptr_t)&ts : 0;
+        int r = uring_enter(bu, bu->a_soumettre, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (r < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) return -1;
+        if (r >= 0 || errno == ETIME) bu->a_soumettre = 0;
+    } else if (bu->a_soumettre) {
+        if (uring_enter(bu, bu->a_soumettre, 0, 0, NULL, 0) >= 0) bu->a_soumettre = 0;
+    }
+
+    int n = 0;
+    bu->lot++;
+    unsigned queue = __atomic_load_n(bu->cq_queue, __ATOMIC_ACQUIRE);
+    while (tete != queue && n < max) {
+        struct io_uring_cqe *cqe = &bu->cqes[tete & *bu->cq_masque];
+        unsigned long long ud = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        tete++;
+        if (ud == URING_IGNORE) continue;
+
+        OpUring *op = (OpUring *)(uintptr_t)ud;
+        if (op->orpheline) { // socket retiré entre-temps
+            if (op->type == OP_ACCEPT && res >= 0) close(res);
+            if (!(flags & IORING_CQE_F_MORE)) free(op);
+            continue;
+        }
+        EntreeUring *e = &bu->entrees[op->fd];
+        int evts = uring_completer(bu, e, op, res, flags);
+        if (!evts) continue;
+
+        if (e->lot == bu->lot) { evs[e->indice].evts |= evts; continue; }
+        e->lot = bu->lot;
+        e->indice = n;
+        evs[n].ptr = e->ptr;
+        evs[n].evts = evts;
+        n++;
+    }
+    __atomic_store_n(bu->cq_tete, tete, __ATOMIC_RELEASE);
+    return n;
+}
+
+static void uring_fermer(BoucleUring *bu) {
+    munmap(bu->sqes, bu->taille_sqes);
+    munmap(bu->anneaux, bu->taille_anneaux);
+    close(bu->fd);
+}
+
+static void uring_detruire(Boucle *b) {
+    BoucleUring *bu = b->priv;
+    uring_fermer(bu);
+    for (int fd = 0; fd < bu->nb_entrees; fd++) {
+        EntreeUring *e = &bu->entrees[fd];
+        if (!e->actif) continue;
+        free(e->poll);
+        free(e->recv);
+        free(e->envoi);
+    }
+    free(bu->entrees);
+    free(bu->acceptes);
+    free(bu);
+    free(b);
+}
+
+// Crée l'anneau et projette ses files ; -1 si le noyau ne fournit pas
+// io_uring (ou pas IORING_FEAT_EXT_ARG, 5.11+)
+static int uring_ouvrir(BoucleUring *bu, unsigned entrees, unsigned entrees_cq) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entrees_cq;
+    int fd = (int)syscall(__NR_io_uring_setup, entrees, &p);
+    if (fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) { close(fd); return -1; }
+
+    bu->fd = fd;
+    bu->sq_entrees = p.sq_entries;
+    size_t taille_sq = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t taille_cq = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bu->taille_anneaux = taille_sq > taille_cq ? taille_sq : taille_cq;
+    bu->taille_sqes = p.sq_entries * sizeof(struct io_uring_sqe);
+    bu->anneaux = mmap(NULL, bu->taille_anneaux, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    bu->sqes = mmap(NULL, bu->taille_sqes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (bu->anneaux == MAP_FAILED || bu->sqes == MAP_FAILED) {
+        if (bu->anneaux != MAP_FAILED) munmap(bu->anneaux, bu->taille_anneaux);
+        if (bu->sqes != MAP_FAILED) munmap(bu->sqes, bu->taille_sqes);
+        close(fd);
+        return -1;
+    }
+    char *a = bu->anneaux;
+    bu->sq_tete = (unsigned *)(a + p.sq_off.head);
+    bu->sq_queue = (unsigned *)(a + p.sq_off.tail);
+    bu->sq_masque = (unsigned *)(a + p.sq_off.ring_mask);
+    bu->sq_tableau = (unsigned *)(a + p.sq_off.array);
+    bu->cq_tete = (unsigned *)(a + p.cq_off.head);
+    bu->cq_queue = (unsigned *)(a + p.cq_off.tail);
+    bu->cq_masque = (unsigned *)(a + p.cq_off.ring_mask);
+    bu->cqes = (struct io_uring_cqe *)(a + p.cq_off.cqes);
+    return 0;
+}
+
+// NULL si le noyau ne fournit pas io_uring
+Boucle *boucle_io_uring(void) {
+    BoucleUring *bu = calloc(1, sizeof(*bu));
+    Boucle *b = calloc(1, sizeof(*b));
+    if (!bu || !b || uring_ouvrir(bu, URING_ENTREES, URING_ENTREES * 4) != 0) { free(bu); free(b); return NULL; }
+    bu->multishot = 1;
+    bu->accept_multishot = 1;
+
+    b->nom = "io_uring";
+    b->ajouter = uring_ajouter;
+    b->modifier = uring_modifier;
+    b->retirer = uring_retirer;
+    b->attendre = uring_attendre;
+    b->detruire = uring_detruire;
+    b->accepter = uring_accepter;
+    b->lire = uring_lire;
+    b->ecrire = uring_ecrire;
+    b->priv = bu;
+    return b;
+}
+
+// Lecture d'une page statique par demandes READ : les blocs sont soumis
+// ensemble, puis leurs complétions lues dans l'anneau. L'anneau, créé au
+// premier chargement, est propre au cache (chargements sérialisés par
+// mutex_assets). 0 si le fichier a été lu en entier.
+int uring_lire_fichier(const char *chemin, char *buf, size_t taille) {
+    static BoucleUring anneau;
+    static int anneau_pret = 0; // -1 : anneau inutilisable, lecture classique
+    if (!anneau_pret) anneau_pret = uring_ouvrir(&anneau, URING_BLOCS_FICHIER, URING_BLOCS_FICHIER * 2) == 0 ? 1 : -1;
+    if (anneau_pret < 0) return -1;
+    BoucleUring *bu = &anneau;
+    int fd = open(chemin, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    size_t lu = 0;
+    int ok = 1;
+    while (ok && lu < taille) {
+        unsigned nb = 0;
+        size_t fin = lu;
+        for (; fin < taille && nb < bu->sq_entrees; nb++) {
+            size_t t = taille - fin < URING_BLOC_FICHIER ? taille - fin : URING_BLOC_FICHIER;
+            struct io_uring_sqe *sqe = uring_sqe(bu);
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (unsigned long long)(uintptr_t)(buf + fin);
+            sqe->len = (unsigned)t;
+            sqe->off = fin;
+            sqe->user_data = fin;
+            fin += t;
+        }
+        // Un bloc lu en partie (ou pas du tout) fixe la reprise
+        size_t reprise = fin;
+        for (unsigned recus = 0; recus < nb;) {
+            if (uring_enter(bu, bu->a_soumettre, nb - recus, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+                if (errno == EINTR) continue;
+                anneau_pret = -1; // des lectures peuvent rester en vol : on n'y revient plus
+                ok = 0;
+                break;
+            }
+            bu->a_soumettre = 0;
+            unsigned tete = *bu->cq_tete, queue = __atomic_load_n(bu->cq_queue, __ATOMIC_ACQUIRE);
+            for (; tete != queue; tete++, recus++) {
+                struct io_uring_cqe *cqe = &bu->cqes[tete & *bu->cq_masque];
+                size_t debut = (size_t)cqe->user_data;
+                size_t attendu = taille - debut < URING_BLOC_FICHIER ? taille - debut : URING_BLOC_FICHIER;
+                if (cqe->res <= 0) ok = 0; // erreur, ou fichier raccourci
+                else if ((size_t)cqe->res < attendu && debut + (size_t)cqe->res < reprise) reprise = debut + (size_t)cqe->res;
+            }
+            __atomic_store_n(bu->cq_tete, tete, __ATOMIC_RELEASE);
+        }
+        lu = reprise;
+    }
+    close(fd);
+    return ok ? 0 : -1;
+}
+#endif
+
+// --- Backend select ---
+typedef struct { SOCKET fd; void *ptr; int interet; } EntreeSelect;
+typedef struct { EntreeSelect e[FD_SETSIZE]; int n; } BoucleSelect;
+
+static int select_ajouter(Boucle *b, SOCKET fd, void *ptr, int interet) {
+    BoucleSelect *bs = b->priv;
+    if (bs->n >= FD_SETSIZE) return -1;
+#ifndef _WIN32
+    if (fd >= FD_SETSIZE) return -1;
+#endif
+    bs->e[bs->n].fd = fd;
+    bs->e[bs->n].ptr = ptr;
+    bs->e[bs->n].interet = interet;
+    bs->n++;
+    return 0;
+}
+
+static int select_modifier(Boucle *b, SOCKET fd, void *ptr, int interet) {
+    BoucleSelect *bs = b->priv;
+    for (int i = 0; i < bs->n; i++) {
+        if (bs->e[i].fd == fd) { bs->e[i].ptr = ptr; bs->e[i].interet = interet; return 0; }
+    }
+    return -1;
+}
+
+static void select_retirer(Boucle *b, SOCKET fd) {
+    BoucleSelect *bs = b->priv;
+    for (int i = 0; i < bs->n; i++) {
+        if (bs->e[i].fd == fd) { bs->e[i] = bs->e[--bs->n]; return; }
+    }
+}
+
+static int select_attendre(Boucle *b, Evenement *evs, int max, int timeout_ms) {
+    BoucleSelect *bs = b->priv;
+    fd_set rd, wr, ex;
+    FD_ZERO(&rd); FD_ZERO(&wr); FD_ZERO(&ex);
+    SOCKET maxfd = 0;
+    for (int i = 0; i < bs->n; i++) {
+        if (bs->e[i].interet & EV_LECTURE) FD_SET(bs->e[i].fd, &rd);
+        if (bs->e[i].interet & EV_ECRITURE) FD_SET(bs->e[i].fd, &wr);
+        FD_SET(bs->e[i].fd, &ex);
+        if (bs->e[i].fd > maxfd) maxfd = bs->e[i].fd;
+    }
+    struct timeval tv, *ptv = NULL;
+    if (timeout_ms >= 0) {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        ptv = &tv;
+    }
+    int r = select((int)maxfd + 1, &rd, &wr, &ex, ptv);
+    if (r < 0) return sock_interrompu() ? 0 : -1;
+    int n = 0;
+    for (int i = 0; i < bs->n && n < max; i++) {
+        int evts = 0;
+        if (FD_ISSET(bs->e[i].fd, &rd)) evts |= EV_LECTURE;
+        if (FD_ISSET(bs->e[i].fd, &wr)) evts |= EV_ECRITURE;
+        if (FD_ISSET(bs->e[i].fd, &ex)) evts |= EV_ERREUR;
+        if (evts) { evs[n].ptr = bs->e[i].ptr; evs[n].evts = evts; n++; }
+    }
+    return n;
+}
+
+static void select_detruire(Boucle *b) {
+    free(b->priv);
+    free(b);
+}
+
+Boucle *boucle_select(void) {
+    BoucleSelect *bs = calloc(1, sizeof(*bs));
+    Boucle *b = calloc(1, sizeof(*b));
+    if (!bs || !b) { free(bs); free(b); return NULL; }
+    b->nom = "select";
+    b->ajouter = select_ajouter;
+    b->modifier = select_modifier;
+    b->retirer = select_retirer;
+    b->attendre = select_attendre;
+    b->detruire = select_detruire;
+    b->priv = bs;
+    return b;
+}
+
+// Choix du backend au démarrage (--boucle) ; NULL / "" = défaut de la plateforme
+Boucle *boucle_creer(const char *nom) {
+#if defined(__linux__) && !defined(DOMO_SANS_IO_URING)
+    if (nom && strcmp(nom, "io_uring") == 0) {
+        Boucle *b = boucle_io_uring();
+        if (b) {
+            assets_io_uring = 1;
+            return b;
+        }
+        fprintf(stderr, "io_uring indisponible sur ce noyau, repli sur epoll\n");
+    }
+#endif
+    if (nom && strcmp(nom, "select") == 0) return boucle_select();
+#ifdef __linux__
+    return boucle_epoll();
+#else
+    return boucle_select();
+#endif
+}
+
+
+// =========================================================
+// ROUTAGE
+// =========================================================
+// Les routes sont enregistrées au démarrage puis compilées en une table de
+// hachage parfaite sur (méthode, chemin) : un seul calcul de hash et une seule
+// comparaison par requête, quel que soit le nombre de routes. Les routes
+// "préfixe" (ex. /api/...) ne sont consultées qu'en cas d'échec exact.
+// La table est en lecture seule une fois compilée, donc partagée par les workers.
+typedef void (*GestionnaireRoute)(Worker *w, Connexion *c, const RequeteHTTP *req, const void *arg);
+
+typedef struct {
+    const char *methode;
+    const char *chemin;
+    int prefixe;
+    GestionnaireRoute fn;
+    const void *arg;
+} Route;
+
+#define MAX_ROUTES 64
+#define TAILLE_TABLE_ROUTES 256 // puissance de 2, >= 2 * MAX_ROUTES
+
+static Route routes[MAX_ROUTES];
+static int nb_routes = 0;
+static const Route *table_routes[TAILLE_TABLE_ROUTES];
+static const Route *routes_prefixe[MAX_ROUTES]; // triées du plus long au plus court
+static int nb_routes_prefixe = 0;
+static unsigned int graine_routes = 0;
+
+int route_ajouter(const char *methode, const char *chemin, int prefixe, GestionnaireRoute fn, const void *arg) {
+    if (nb_routes >= MAX_ROUTES) return -1;
+    Route *r = &routes[nb_routes++];
+    r->methode = methode;
+    r->chemin = chemin;
+    r->prefixe = prefixe;
+    r->fn = fn;
+    r->arg = arg;
+    return 0;
+}
+
+// FNV-1a sur "méthode SP chemin", perturbé par la graine
+static unsigned int hash_route(unsigned int graine, const char *m, size_t lm, const char *p, size_t lp) {
+    unsigned int h = 2166136261u ^ graine;
+    for (size_t i = 0; i < lm; i++) h = (h ^ (unsigned char)m[i]) * 16777619u;
+    h = (h ^ ' ') * 16777619u;
+    for (size_t i = 0; i < lp; i++) h = (h ^ (unsigned char)p[i]) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+// Cherche une graine sans collision pour les routes exactes
+int routes_compiler(void) {
+    for (unsigned int graine = 1; graine < 100000; graine++) {
+        memset(table_routes, 0, sizeof(table_routes));
+        int collision = 0;
+        for (int i = 0; i < nb_routes && !collision; i++) {
+            const Route *r = &routes[i];
+            if (r->prefixe) continue;
+            unsigned int h = hash_route(graine, r->methode, strlen(r->methode), r->chemin, strlen(r->chemin));
+            const Route **slot = &table_routes[h & (TAILLE_TABLE_ROUTES - 1)];
+            if (*slot) collision = 1;
+            else *slot = r;
+        }
+        if (collision) continue;
+
+        graine_routes = graine;
+        nb_routes_prefixe = 0;
+        for (int i = 0; i < nb_routes; i++) {
+            if (!routes[i].prefixe) continue;
+            int j = nb_routes_prefixe++;
+            while (j > 0 && strlen(routes_prefixe[j - 1]->chemin) < strlen(routes[i].chemin)) {
+                routes_prefixe[j] = routes_prefixe[j - 1];
+                j--;
+            }
+            routes_prefixe[j] = &routes[i];
+        }
+        return 0;
+    }
+    fprintf(stderr, "Impossible de compiler la table des routes\n");
+    return -1;
+}
+
+const Route *route_trouver(Tranche methode, Tranche chemin) {
+    unsigned int h = hash_route(graine_routes, methode.p, methode.len, chemin.p, chemin.len);
+    const Route *r = table_routes[h & (TAILLE_TABLE_ROUTES - 1)];
+    if (r && tranche_egale(methode, r->methode) && tranche_egale(chemin, r->chemin)) return r;
+
+    for (int i = 0; i < nb_routes_prefixe; i++) {
+        r = routes_prefixe[i];
+        size_t n = strlen(r->chemin);
+        if (tranche_egale(methode, r->methode) && chemin.len >= n && memcmp(chemin.p, r->chemin, n) == 0)
+            return r;
+    }
+    return NULL;
+}
+
+// ROUTES DE FICHIERS (arg = page du cache)
+void route_fichier(Worker *w, Connexion *c, const RequeteHTTP *req, const void *arg) {
+    (void)w;
+    send_file_response(c, req, (Asset *)arg, NULL);
+}
+
+// ROUTE UPDATE (gestion du changement d'état)
+// Partie magasin d'une commande (aussi mesurée par --bench-update) : lecture
+// des détails, changement d'état et inscription dans l'outbox sous le même
+// verrou, poussés ensemble vers le thread d'écriture, qui confie la commande
+// au contrôleur après l'écriture. Retourne l'identifiant de livraison réservé,
+// 0 en cas d'erreur, -1 si l'appareil est déjà dans l'état demandé (rien
+// n'est écrit). seq (si non NULL) reçoit le seq d'écriture.
+long long commande_enregistrer(const char *type, const char *nom, const char *etat, unsigned long long *seq) {
+    Changement *ch = malloc(sizeof(*ch));
+    if (!ch) {
+        fprintf(stderr, "[DB] Commande de %s non inscrite (mémoire)\n", nom);
+        return 0;
+    }
+    mutex_lock(&mutex_magasin);
+    // 1. Récupérer les détails IP, Input, Port du magasin
+    int i = magasin_trouver(nom);
+    if (i >= 0 ? strcmp(appareils[i].etat, etat) == 0 : strcmp(etat, "OFF") == 0) {
+        mutex_unlock(&mutex_magasin);
+        free(ch);
+        return -1; // déjà dans cet état (un appareil inconnu est éteint)
+    }
+
+    // 2. Mettre à jour l'état, et inscrire la commande dans l'outbox
+    if (magasin_changer(nom, etat, ch) < 0) {
+        mutex_unlock(&mutex_magasin);
+        free(ch);
+        fprintf(stderr, "[DB] Commande de %s non inscrite (mémoire)\n", nom);
+        return 0; // appareil inconnu qui n'a pas pu être ajouté
+    }
+    outbox_inscrire(ch, type);
+    ch->livraison = livraison_reserver(ch->ip, ch->port, ch->input, ch->outbox);
+    unsigned long long id = ch->livraison; // ch appartient au thread d'écriture une fois poussé
+    if (seq) *seq = ch->seq;
+    ecriture_pousser(ch);
+    mutex_unlock(&mutex_magasin);
+    // Diffusion aux panneaux abonnés (/events)
+    evenements_publier(nom, etat);
+    return (long long)id;
+}
+
+// Chaîne commune à /update et /ws : magasin, puis file du simulateur une
+// fois la commande écrite. Retourne l'identifiant de livraison de la
+// commande, ou COMMANDE_INCHANGEE si l'appareil est déjà dans l'état demandé
+// (rien n'est écrit ni envoyé). 0 n'est jamais un identifiant : la commande
+// n'a pas été enregistrée (mémoire), ni l'état changé. seq (si non NULL)
+// reçoit le seq d'écriture, pour attendre la durabilité.
+unsigned long long commander_appareil(const char *type, const char *nom, const char *etat, unsigned long long *seq) {
+    long long id = commande_enregistrer(type, nom, etat, seq);
+    if (id < 0) {
+        commandes_inchangees++;
+        return COMMANDE_INCHANGEE;
+    }
+    return (unsigned long long)id;
+}
+
+void route_update(Worker *w, Connexion *c, const RequeteHTTP *req, const void *arg) {
+    (void)arg;
+    char nom[128] = {0}, type[128] = {0}, etat[128] = {0};
+
+    extract_query(req->query, nom, etat, type);
+    if (verbeux) printf("[UPDATE] nom=%s | etat=%s | type=%s\n", nom, etat, type);
+    if (nom[0] != '\0' && etat[0] != '\0' && type[0] != '\0') {
+        // Réponse dès que l'état est enregistré en mémoire, ou (durable=1) une
+        // fois écrit en base : la livraison se suit via /dispatch?id=N
+        char corps[64];
+        unsigned long long seq = 0;
+        unsigned long long id = commander_appareil(type, nom, etat, &seq);
+        if (id == 0) {
+            // Rien d'enregistré : jamais "OK id=0"
+            repondre_indisponible(c, 1, "Commande non enregistree, reessayer");
+            return;
+        }
+        if (id != COMMANDE_INCHANGEE && query_drapeau(req->query, "durable") && !ecriture_est_durable(seq)) {
+            // Mise de côté : répondue par durables_repondre au réveil du worker
+            c->attente_durable = seq;
+            c->commande_durable = id;
+            atomic_fetch_add(&w->nb_attentes_durables, 1);
+            if (!ecriture_est_durable(seq)) return;
+            c->attente_durable = 0; // écrite entre-temps
+            atomic_fetch_sub(&w->nb_attentes_durables, 1);
+        }
+        if (id == COMMANDE_INCHANGEE) snprintf(corps, sizeof(corps), "OK inchange");
+        else snprintf(corps, sizeof(corps), "OK id=%llu", id);
+        repondre_texte(c, "200 OK", corps);
+    } else {
+        repondre_texte(c, "400 Bad Request", "Missing params");
+    }
+}
+
+// ROUTE STATE (pour la synchronisation de l'état des appareils de test)
+void route_state(Worker *w, Connexion *c, const RequeteHTTP *req, const void *arg) {
+    (void)w; (void)req; (void)arg;
+    char out[1024];
+    char e1[32], e2[32], e3[32];
+    getEtat("lumiere", e1, sizeof(e1));
+    getEtat("volets", e2, sizeof(e2));
+    getEtat("clim", e3, sizeof(e3));
+    snprintf(out, sizeof(out), "lumiere=%s;volets=%s;clim=%s", e1, e2, e3);
+    repondre_texte(c, "200 OK", out);
+}
+
+// ROUTE DISPATCH (suivi des livraisons aux contrôleurs)
+// /dispatch?id=N : résultat d'une commande ; /dispatch : état de chaque contrôleur
+void route_dispatch(Worker *w, Connexion *c, const RequeteHTTP *req, const void *arg) {
+    (void)w; (void)arg;
+    char out[4096];
+    size_t len = 0;
+    const char *q = req->query.p;
+    size_t ql = req->query.len;
+    for (size_t i = 0; i + 3 <= ql; i++) {
+        if ((i == 0 || q[i - 1] == '&') && strncmp(q + i, "id=", 3) == 0) {
+            unsigned long long id = 0;
+            for (i += 3; i < ql && q[i] >= '0' && q[i] <= '9'; i++) id = id * 10 + (unsigned long long)(q[i] - '0');
+            Livraison l;
+            if (!livraison_lire(id, &l)) {
+                repondre_texte(c, "404 Not Found", "Commande inconnue");
+                return;
+            }
+            static const char *statuts[] = { "en_attente", "livree", "echec", "remplacee", "envoyee" };
+            char appareil[128] = "?";
+            magasin_nom_entree(l.entree_ip, l.entree_input, appareil, sizeof(appareil));
+            snprintf(out, sizeof(out), "id=%llu;statut=%s;controleur=%s:%d;latence_ms=%.2f;tentatives=%d;acquittee=%d;appareil=%s",
+                     l.id, statuts[l.statut], l.ip, l.port, l.latence_ms, l.tentatives, l.acquittee, appareil);
+            repondre_texte(c, "200 OK", out);
+            return;
+        }
     }
-    printf("[DB] Appareils initiaux (96) insérés (si non existants).\n");
+
+    static const char *disjoncteurs[] = { "ferme", "ouvert", "demi_ouvert" };
+    mutex_lock(&mutex_controleurs);
+    Controleur *k = controleurs;
+    mutex_unlock(&mutex_controleurs);
+    out[0] = '\0';
+    for (; k && len < sizeof(out) - 512; k = k->suiv) {
+        mutex_lock(&k->mutex_file);
+        int file = k->file_len;
+        mutex_unlock(&k->mutex_file);
+        int n = snprintf(out + len, sizeof(out) - len,
+            "%s:%d connecte=%d disjoncteur=%s lot=%d bin=%d file=%d envoyees=%lu lots=%lu octets=%lu perdues=%lu"
+            " rejets=%lu ouvertures=%lu connexions=%lu echecs_connexion=%lu rtt_ms=%.2f delai_connexion_ms=%d"
+            " ack=%d acquittees=%lu reemissions=%lu latence_moy_ms=%.2f latence_max_ms=%.2f fusionnees=%lu\n",
+            k->ip, k->port, (int)k->connecte, disjoncteurs[k->disjoncteur], (k->capacites & CAP_LOT) != 0,
+            (k->capacites & CAP_BIN1) != 0, file, (unsigned long)k->envoyes, (unsigned long)k->lots,
+            (unsigned long)k->octets, (unsigned long)k->perdues, (unsigned long)k->rejets, (unsigned long)k->ouvertures,
+            (unsigned long)k->connexions, (unsigned long)k->echecs, k->srtt_ms, controleur_delai_ms(k),
+            (k->capacites & CAP_ACK) != 0, (unsigned long)k->acquittees, (unsigned long)k->reemissions,
+            k->envoyes ? k->latence_us_total / 1000.0 / k->envoyes : 0.0, k->latence_us_max / 1000.0,
+            (unsigned long)k->fusionnees);
+        // Ligne tronquée : snprintf rend la longueur voulue, pas celle écrite
+        if (n > 0) len += (size_t)n;
+        if (len > sizeof(out) - 1) len = sizeof(out) - 1;
+    }
+    snprintf(out + len, sizeof(out) - len, "inchangees=%lu outbox_marquees=%lu outbox_rejouees=%lu\n",
+             (unsigned long)commandes_inchangees, (unsigned long)outbox_marquees, (unsigned long)outbox_rejouees);
+    repondre_texte(c, "200 OK", out);
 }
 
+// ROUTE DB (cache des requêtes préparées, une ligne par connexion)
+void route_db(Worker *w, Connexion *c, const RequeteHTTP *req, const void *arg) {
+    (void)w; (void)req; (void)arg;
+    char out[4096];
+    size_t len = 0;
+    int n = nb_caches_requetes;
+    for (int i = 0; i < n && len < sizeof(out) - 128; i++)
+        len += (size_t)snprintf(out + len, sizeof(out) - len, "connexion=%d requetes=%d reutilisations=%lu\n",
+                                i, NB_REQUETES, (unsigned long)caches_requetes[i].reutilisations);
+    len += (size_t)snprintf(out + len, sizeof(out) - len, "hors_cache=%lu\n", (unsigned long)requetes_hors_cache);
+    mutex_lock(&mutex_magasin);
+    int nb = nb_appareils;
+    unsigned long long seq = ecriture_seq;
+    mutex_unlock(&mutex_magasin);
+    snprintf(out + len, sizeof(out) - len, "appareils=%d fenetre_ms=%d lot=%d en_attente=%d seq=%llu durable=%llu "
+             "transactions=%lu changements=%lu fusionnes=%lu divergences=%lu echecs=%lu\n",
+             nb, ecriture_fenetre_ms, ECRITURE_LOT, atomic_load(&ecriture_en_attente), seq,
+             (unsigned long long)atomic_load(&ecriture_durable), (unsigned long)ecriture_transactions,
+             (unsigned long)ecriture_lignes, (unsigned long)ecriture_fusions, (unsigned long)ecriture_divergences,
+             (unsigned long)ecriture_echecs);
+    len = strlen(out);
+    snprintf(out + len, sizeof(out) - len, "stockage=%s journal=%s synchronous=%s mmap_mio=%d cache_kio=%d temp_store=%s "
+             "checkpoint_pages=%d pages_wal=%d checkpoints=%lu pages_recopiees=%lu dernier_checkpoint_us=%lu\n",
+             stockage.nom, stockage.journal, stockage.synchronous, stockage.mmap_mio, stockage.cache_kio, stockage.temp_store,
+             stockage.checkpoint_pages, atomic_load(&wal_pages), (unsigned long)checkpoints_faits,
+             (unsigned long)checkpoints_pages, (unsigned long)checkpoint_dernier_us);
+    repondre_texte(c, "200 OK", out);
+}
 
-// =========================================================
-// QUERY PARSING
-// =========================================================
-void extract_query(const char *path, char *device_out, char *etat_out, char *type_out) {
-    device_out[0] = etat_out[0] = type_out[0] = '\0';
-    const char *q = strchr(path, '?');
-    if (!q) return;
-    q++;
+// ROUTE EVENTS (Server-Sent Events : changements d'état poussés aux panneaux)
+void route_events(Worker *w, Connexion *c, const RequeteHTTP *req, const void *arg) {
+    (void)arg;
+    const char *entete = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+                         "Connection: keep-alive\r\n\r\nretry: 2000\n\n";
+    conn_ecrire(c, entete, strlen(entete));
 
-    char tmp[512];
-    strncpy(tmp, q, sizeof(tmp) - 1);
-    tmp[sizeof(tmp) - 1] = '\0';
+    // Reprise après coupure : on repart du dernier id reçu par le navigateur
+    Tranche leid = http_entete(req, "Last-Event-ID");
+    if (leid.len > 0) {
+        unsigned long long id = 0;
+        for (size_t i = 0; i < leid.len && leid.p[i] >= '0' && leid.p[i] <= '9'; i++) id = id * 10 + (unsigned long long)(leid.p[i] - '0');
+        c->dernier_evt = id;
+    } else {
+        c->dernier_evt = evenements_version();
+    }
+    c->mode = MODE_SSE;
+    atomic_fetch_add(&w->nb_abonnes, 1);
+    evenements_rattraper(c);
+}
 
-    char *token = strtok(tmp, "&");
-    while (token) {
-        if (strncmp(token, "nom=", 4) == 0)
-            url_decode(device_out, token + 4);
-        else if (strncmp(token, "etat=", 5) == 0)
-            url_decode(etat_out, token + 5);
-        else if (strncmp(token, "type=", 5) == 0)
-            url_decode(type_out, token + 5);
-        token = strtok(NULL, "&");
+// ROUTE WS (WebSocket : commandes compactes et état poussé sur la même socket)
+// Client -> serveur (trame texte) : "<1|0><type><nom>", type = l (light),
+// s (store) ou c (climate). Ex. "1lCuisine - Luminaire entrée".
+// Serveur -> client : "<version>:<1|0><nom>" pour chaque changement (y compris
+// les siens, qui valent accusé de réception), "!<message>" en cas de refus.
+void route_ws(Worker *w, Connexion *c, const RequeteHTTP *req, const void *arg) {
+    (void)arg;
+    Tranche upgrade = http_entete(req, "Upgrade");
+    Tranche cle = http_entete(req, "Sec-WebSocket-Key");
+    Tranche version = http_entete(req, "Sec-WebSocket-Version");
+    if (!tranche_egale_nocase(upgrade, "websocket") || cle.len != 24 || !tranche_egale(version, "13")) {
+        c->fermer_apres = 1;
+        repondre_texte(c, "400 Bad Request", "WebSocket attendu (version 13)");
+        return;
+    }
+
+    unsigned char concat[24 + 36], empreinte[20];
+    char accept[32], entete[256];
+    memcpy(concat, cle.p, 24);
+    memcpy(concat + 24, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", 36);
+    sha1(concat, sizeof(concat), empreinte);
+    base64(empreinte, sizeof(empreinte), accept);
+    int n = snprintf(entete, sizeof(entete),
+        "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+    conn_ecrire(c, entete, (size_t)n);
+
+    c->mode = MODE_WS;
+    c->dernier_evt = evenements_version();
+    atomic_fetch_add(&w->nb_abonnes, 1);
+}
+
+static void ws_message(Connexion *c, const char *p, size_t len) {
+    char nom[128];
+    const char *type = NULL;
+    if (len >= 3 && len - 2 < sizeof(nom) && (p[0] == '0' || p[0] == '1')) {
+        if (p[1] == 'l') type = "light";
+        else if (p[1] == 's') type = "store";
+        else if (p[1] == 'c') type = "climate";
     }
+    if (!type) {
+        ws_ecrire_trame(c, WS_TEXTE, "!commande invalide", 18);
+        return;
+    }
+    memcpy(nom, p + 2, len - 2);
+    nom[len - 2] = '\0';
+    if (verbeux) printf("[WS] nom=%s | etat=%s | type=%s\n", nom, p[0] == '1' ? "ON" : "OFF", type);
+    commander_appareil(type, nom, p[0] == '1' ? "ON" : "OFF", NULL);
+    // L'état (et l'écho vers ce client) part par la diffusion des événements
+}
+
+// Découpe les trames complètes du tampon d'entrée d'une connexion WebSocket.
+// Les messages fragmentés ne sont pas pris en charge (nos commandes tiennent
+// dans une trame) : fermeture 1003.
+void ws_traiter(Worker *w, Connexion *c) {
+    (void)w;
+    unsigned char *in = (unsigned char *)c->in;
+    size_t pos = 0;
+    while (!c->fermer_apres && c->in_len - pos >= 2) {
+        unsigned char *t = in + pos;
+        size_t dispo = c->in_len - pos, entete = 2;
+        int fin = t[0] & 0x80, opcode = t[0] & 0x0F, masque = t[1] & 0x80;
+        unsigned long long len = t[1] & 0x7F;
+        if (len == 126) {
+            if (dispo < 4) break;
+            len = (unsigned long long)t[2] << 8 | t[3];
+            entete = 4;
+        } else if (len == 127) {
+            if (dispo < 10) break;
+            len = 0;
+            for (int i = 0; i < 8; i++) len = len << 8 | t[2 + i];
+            entete = 10;
+        }
+        if (!masque || len > sizeof(c->in) - 14) { // client non conforme ou message trop gros
+            ws_ecrire_trame(c, WS_FERMETURE, masque ? "\x03\xf1" : "\x03\xea", 2); // 1009 / 1002
+            c->fermer_apres = 1;
+            break;
+        }
+        if (dispo < entete + 4 + len) break; // trame incomplète
+
+        unsigned char *cle = t + entete, *charge = t + entete + 4;
+        for (unsigned long long i = 0; i < len; i++) charge[i] ^= cle[i & 3];
+        pos += entete + 4 + (size_t)len;
+
+        if (!fin || opcode == WS_CONTINUATION) {
+            ws_ecrire_trame(c, WS_FERMETURE, "\x03\xeb", 2); // 1003
+            c->fermer_apres = 1;
+        } else if (opcode == WS_TEXTE || opcode == WS_BINAIRE) {
+            ws_message(c, (const char *)charge, (size_t)len);
+        } else if (opcode == WS_PING) {
+            ws_ecrire_trame(c, WS_PONG, (const char *)charge, (size_t)len);
+        } else if (opcode == WS_FERMETURE) {
+            ws_ecrire_trame(c, WS_FERMETURE, (const char *)charge, len >= 2 ? 2 : 0);
+            c->fermer_apres = 1;
+        }
+        // WS_PONG : la réception suffit à rafraîchir derniere_activite
+    }
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+}
+
+// ROUTE RESET DB
+void route_reset_db(Worker *w, Connexion *c, const RequeteHTTP *req, const void *arg) {
+    (void)w; (void)req; (void)arg;
+    resetDB(); // Les données initiales sont réinsérées avec le reset
+    repondre_texte(c, "200 OK", "Base réinitialisée et rechargée");
+}
+
+// Table des routes du serveur (avec gestion de /index ou /)
+int routes_init(void) {
+    const char *html = "text/html; charset=UTF-8";
+    Asset *index = asset_enregistrer("index.html", html);
+    Asset *login = asset_enregistrer("login.html", html);
+    Asset *signup = asset_enregistrer("signup.html", html);
+    Asset *accueil = asset_enregistrer("accueil.html", html);
+    Asset *logout = asset_enregistrer("logout.html", html);
+
+    route_ajouter("GET", "/", 0, route_fichier, index);
+    route_ajouter("GET", "/index.html", 0, route_fichier, index);
+    route_ajouter("GET", "/login", 0, route_fichier, login);
+    route_ajouter("GET", "/login.html", 0, route_fichier, login);
+    route_ajouter("GET", "/signup", 0, route_fichier, signup);
+    route_ajouter("GET", "/signup.html", 0, route_fichier, signup);
+    route_ajouter("GET", "/accueil", 0, route_fichier, accueil);
+    route_ajouter("GET", "/accueil.html", 0, route_fichier, accueil);
+    route_ajouter("GET", "/logout", 0, route_fichier, logout);
+    route_ajouter("GET", "/logout.html", 0, route_fichier, logout);
+    route_ajouter("GET", "/update", 0, route_update, NULL);
+    route_ajouter("GET", "/state", 0, route_state, NULL);
+    route_ajouter("GET", "/reset-db", 0, route_reset_db, NULL);
+    route_ajouter("GET", "/events", 0, route_events, NULL);
+    route_ajouter("GET", "/ws", 0, route_ws, NULL);
+    route_ajouter("GET", "/dispatch", 0, route_dispatch, NULL);
+    route_ajouter("GET", "/db", 0, route_db, NULL);
+    return routes_compiler();
+}
 
-    printf("DEBUG: nom='%s', etat='%s', type='%s'\n", device_out, etat_out, type_out);
+void traiter_requete(Worker *w, Connexion *c, const RequeteHTTP *req) {
+    if (verbeux) printf("\n--- Requête: %.*s %.*s ---\n", (int)req->methode.len, req->methode.p, (int)req->chemin.len, req->chemin.p);
+
+    const Route *r = route_trouver(req->methode, req->chemin);
+    if (r) r->fn(w, c, req, r->arg);
+    else send_404_response(c);
 }
 
 
 // =========================================================
-// MAIN
+// SERVEUR
 // =========================================================
-int main(void) {
-    WSADATA wsa;
-    SOCKET server_sock, client_sock;
-    struct sockaddr_in server_addr;
-    int addrlen = sizeof(server_addr);
+void conn_fermer(Worker *w, Connexion *c) {
+    if (c->mode != MODE_HTTP) atomic_fetch_sub(&w->nb_abonnes, 1);
+    if (c->attente_durable) atomic_fetch_sub(&w->nb_attentes_durables, 1);
+    w->boucle->retirer(w->boucle, c->fd);
+    closesocket(c->fd);
+    if (c->prec) c->prec->suiv = c->suiv;
+    else w->connexions = c->suiv;
+    if (c->suiv) c->suiv->prec = c->prec;
+    conn_vider_file(c);
+    free(c);
+}
 
-    sqlite3 *db = NULL;
-    if (sqlite3_open(DB_FILE, &db) != SQLITE_OK) {
-        fprintf(stderr, "Erreur ouverture DB: %s\n", sqlite3_errmsg(db));
-        if (db) sqlite3_close(db);
-        return 1;
+// Accepte toutes les connexions en attente (le socket d'écoute est edge-triggered)
+void accepter_clients(Worker *w) {
+    while (1) {
+        SOCKET fd = boucle_accept(w->boucle, w->ecoute);
+        if (fd == INVALID_SOCKET) {
+            if (sock_interrompu()) continue;
+            return; // plus rien en attente (ou erreur transitoire type EMFILE)
+        }
+        Connexion *c = calloc(1, sizeof(*c));
+        if (c) c->fd = fd;
+        if (!c || sock_non_bloquant(fd) != 0 || w->boucle->ajouter(w->boucle, fd, c, EV_LECTURE | EV_DONNEES) != 0) {
+            free(c);
+            closesocket(fd);
+            continue;
+        }
+        c->derniere_activite = time(NULL);
+        c->suiv = w->connexions;
+        if (w->connexions) w->connexions->prec = c;
+        w->connexions = c;
     }
-    sqlite3_busy_timeout(db, 5000);
-    initDB(db);
-    insert_initial_devices(db); 
+}
 
-    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-        fprintf(stderr, "WSAStartup failed\n");
-        sqlite3_close(db);
-        return 1;
+// Traite, dans l'ordre, toutes les requêtes complètes présentes dans le tampon
+// d'entrée (pipelining). S'arrête si trop de réponses attendent d'être envoyées.
+void traiter_tampon(Worker *w, Connexion *c) {
+    while (!c->fermer_apres && c->out_len < MAX_SORTIE_EN_ATTENTE) {
+        if (c->attente_durable) return; // réponse en attente d'écriture : les requêtes suivantes attendent leur tour
+        if (c->mode == MODE_SSE) { c->in_len = 0; return; } // flux sortant uniquement
+        if (c->mode == MODE_WS) { ws_traiter(w, c); return; }
+        int r = http_parser(&c->req, c->in, c->in_len);
+        if (r == HTTP_INCOMPLET) {
+            if (c->in_len >= sizeof(c->in)) {
+                c->fermer_apres = 1;
+                repondre_texte(c, "431 Request Header Fields Too Large", "Requete trop longue");
+            }
+            return; // requête incomplète : on attend la suite
+        }
+        if (r == HTTP_ERREUR || r == HTTP_NON_SUPPORTE) {
+            // Fin de la requête inconnue : rien de ce qui suit n'est lu
+            c->fermer_apres = 1;
+            c->in_len = 0;
+            if (r == HTTP_NON_SUPPORTE) repondre_texte(c, "501 Not Implemented", "Transfer-Encoding non supporte");
+            else repondre_texte(c, "400 Bad Request", "Requete invalide");
+            return;
+        }
+
+        if (!c->req.keepalive) c->fermer_apres = 1;
+        traiter_requete(w, c, &c->req);
+
+        size_t total = c->req.longueur_totale;
+        memmove(c->in, c->in + total, c->in_len - total);
+        c->in_len -= total;
+        http_reinit(&c->req);
+    }
+}
+
+// Suite d'un envoi (r = retour de conn_vider) : fermeture si terminé ou en
+// erreur, sinon (dés)armement de l'intérêt écriture. -1 si la connexion est fermée.
+int conn_apres_envoi(Worker *w, Connexion *c, int r) {
+    if (r < 0 || (r == 0 && (c->fermer_apres || c->fin_lecture) && !c->attente_durable)) {
+        conn_fermer(w, c);
+        return -1;
+    }
+
+    // N'arme l'écriture que s'il reste des données (select signalerait sinon en boucle)
+    int veut_ecrire = (r == 1);
+    if (veut_ecrire != c->attente_ecriture) {
+        w->boucle->modifier(w->boucle, c->fd, c, EV_LECTURE | EV_DONNEES | (veut_ecrire ? EV_ECRITURE : 0));
+        c->attente_ecriture = veut_ecrire;
+    }
+    return 0;
+}
+
+void servir_connexion(Worker *w, Connexion *c, int evts) {
+    (void)evts; // lecture et écriture sont toujours tentées jusqu'à EAGAIN
+    c->derniere_activite = time(NULL);
+
+    int r, sortie_pleine;
+    do {
+        sortie_pleine = 0;
+        while (1) {
+            traiter_tampon(w, c);
+            if (c->fermer_apres || c->fin_lecture) break;
+            if (c->out_len >= MAX_SORTIE_EN_ATTENTE) { sortie_pleine = 1; break; }
+            if (c->in_len >= sizeof(c->in)) break;
+
+            int n = (int)boucle_recv(w->boucle, c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+            if (n > 0) { c->in_len += (size_t)n; continue; }
+            if (n < 0 && sock_interrompu()) continue;
+            if (n < 0 && sock_bloquerait()) break;
+            if (n == 0) { c->fin_lecture = 1; continue; } // on répond quand même à ce qui a été reçu
+            conn_fermer(w, c);
+            return;
+        }
+        r = conn_vider(w, c);
+    } while (r == 0 && sortie_pleine);
+
+    conn_apres_envoi(w, c, r);
+}
+
+// Pousse la sortie d'une connexion en dehors d'un événement réseau (diffusion,
+// ping). Retourne -1 si la connexion a été fermée.
+int conn_envoyer(Worker *w, Connexion *c) {
+    return conn_apres_envoi(w, c, conn_vider(w, c));
+}
+
+// Répond aux /update?durable=1 dont le changement est maintenant en base,
+// puis reprend les requêtes pipelinées derrière
+void durables_repondre(Worker *w) {
+    Connexion *c = w->connexions;
+    while (c) {
+        Connexion *suiv = c->suiv;
+        if (c->attente_durable && ecriture_est_durable(c->attente_durable)) {
+            char corps[64];
+            c->attente_durable = 0;
+            atomic_fetch_sub(&w->nb_attentes_durables, 1);
+            snprintf(corps, sizeof(corps), "OK id=%llu durable", c->commande_durable);
+            repondre_texte(c, "200 OK", corps);
+            servir_connexion(w, c, 0);
+        }
+        c = suiv;
+    }
+}
+
+// Réveil du worker : complète chaque abonné avec les nouveaux événements
+void diffuser_evenements(Worker *w) {
+    char poubelle[64];
+    while (recv(w->reveil, poubelle, sizeof(poubelle), 0) > 0) {}
+    atomic_store(&w->reveil_en_attente, 0);
+    if (atomic_load(&w->nb_attentes_durables) > 0) durables_repondre(w);
+
+    Connexion *c = w->connexions;
+    while (c) {
+        Connexion *suiv = c->suiv;
+        if (c->mode != MODE_HTTP) {
+            if (c->out_len >= MAX_SORTIE_EN_ATTENTE) conn_fermer(w, c); // abonné bloqué : il reprendra avec Last-Event-ID
+            else {
+                evenements_rattraper(c);
+                conn_envoyer(w, c);
+            }
+        }
+        c = suiv;
+    }
+}
+
+// Ferme les connexions persistantes restées inactives trop longtemps ;
+// les flux d'événements reçoivent un commentaire de maintien à la place.
+void fermer_inactives(Worker *w, time_t maintenant) {
+    Connexion *c = w->connexions;
+    while (c) {
+        Connexion *suiv = c->suiv;
+        if (c->mode != MODE_HTTP) {
+            if (maintenant - c->derniere_activite >= FLUX_PING) {
+                c->derniere_activite = maintenant;
+                if (c->mode == MODE_WS) ws_ecrire_trame(c, WS_PING, NULL, 0);
+                else conn_ecrire(c, ": ping\n\n", 8);
+                conn_envoyer(w, c);
+            }
+        } else if (c->attente_durable) {
+            // En attente de l'écriture en base, pas inactive : délai propre,
+            // puis 503 (la commande reste en mémoire et sera écrite)
+            if (maintenant - c->derniere_activite >= DURABLE_TIMEOUT) {
+                char corps[96];
+                c->attente_durable = 0;
+                atomic_fetch_sub(&w->nb_attentes_durables, 1);
+                snprintf(corps, sizeof(corps), "Ecriture en base en retard, commande id=%llu en attente", c->commande_durable);
+                repondre_indisponible(c, DURABLE_TIMEOUT, corps);
+                servir_connexion(w, c, 0);
+            }
+        } else if (maintenant - c->derniere_activite >= KEEPALIVE_TIMEOUT) {
+            conn_fermer(w, c);
+        }
+        c = suiv;
     }
+}
 
-    server_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (server_sock == INVALID_SOCKET) {
+// Socket d'écoute non bloquant. Avec SO_REUSEPORT (Linux), chaque worker a le
+// sien et le noyau répartit les connexions entrantes entre eux.
+SOCKET ouvrir_ecoute(int reuseport) {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET) {
         fprintf(stderr, "socket failed\n");
-        WSACleanup();
-        sqlite3_close(db);
-        return 1;
+        return INVALID_SOCKET;
+    }
+
+    int oui = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&oui, sizeof(oui));
+#ifdef SO_REUSEPORT
+    if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (const char *)&oui, sizeof(oui)) != 0) {
+        fprintf(stderr, "SO_REUSEPORT indisponible\n");
+        closesocket(s);
+        return INVALID_SOCKET;
     }
+#else
+    (void)reuseport;
+#endif
 
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(PORT);
 
-    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+    if (bind(s, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
         fprintf(stderr, "bind failed\n");
-        closesocket(server_sock);
-        WSACleanup();
-        sqlite3_close(db);
-        return 1;
+        closesocket(s);
+        return INVALID_SOCKET;
     }
 
-    if (listen(server_sock, 10) == SOCKET_ERROR) {
+    if (listen(s, SOMAXCONN) == SOCKET_ERROR || sock_non_bloquant(s) != 0) {
         fprintf(stderr, "listen failed\n");
-        closesocket(server_sock);
-        WSACleanup();
-        sqlite3_close(db);
-        return 1;
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+void *worker_boucle(void *arg) {
+    Worker *w = arg;
+    Evenement evs[MAX_EVENEMENTS];
+    time_t dernier_balayage = time(NULL);
+    while (1) {
+        int n = w->boucle->attendre(w->boucle, evs, MAX_EVENEMENTS, 1000);
+        if (n < 0) break;
+        for (int i = 0; i < n; i++) {
+            if (evs[i].ptr == NULL) accepter_clients(w);
+            else if (evs[i].ptr == w) diffuser_evenements(w);
+            else servir_connexion(w, (Connexion *)evs[i].ptr, evs[i].evts);
+        }
+        time_t maintenant = time(NULL);
+        if (maintenant != dernier_balayage) {
+            fermer_inactives(w, maintenant);
+            dernier_balayage = maintenant;
+        }
+    }
+    return NULL;
+}
+
+
+// =========================================================
+// BENCHMARKS
+// =========================================================
+// Requête typique d'un clic dans accueil.html (fetch depuis Chrome)
+static const char REQUETE_BENCH[] =
+    "GET /update?type=lampe&nom=Salon%20-%20Luminaire%20salon%20nord&etat=ON HTTP/1.1\r\n"
+    "Host: 192.168.0.10:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (Linux; Android 13; SM-X200) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Referer: http://192.168.0.10:8080/accueil\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: fr-FR,fr;q=0.9,en;q=0.8\r\n"
+    "\r\n";
+
+// Ancienne chaîne de strcmp de main(), conservée comme référence du benchmark
+static int route_chaine_strcmp(const char *method, const char *path) {
+    if (strcmp(method, "GET") == 0 && (strcmp(path, "/") == 0 || strcmp(path, "/index.html") == 0)) return 1;
+    else if (strcmp(method, "GET") == 0 && (strcmp(path, "/login") == 0 || strcmp(path, "/login.html") == 0)) return 2;
+    else if (strcmp(method, "GET") == 0 && (strcmp(path, "/signup") == 0 || strcmp(path, "/signup.html") == 0)) return 3;
+    else if (strcmp(method, "GET") == 0 && (strcmp(path, "/accueil") == 0 || strcmp(path, "/accueil.html") == 0)) return 4;
+    else if (strcmp(method, "GET") == 0 && (strcmp(path, "/logout") == 0 || strcmp(path, "/logout.html") == 0)) return 5;
+    else if (strcmp(method, "GET") == 0 && strncmp(path, "/update", 7) == 0) return 6;
+    else if (strcmp(method, "GET") == 0 && strcmp(path, "/state") == 0) return 7;
+    else if (strcmp(method, "GET") == 0 && strcmp(path, "/reset-db") == 0) return 8;
+    return 0;
+}
+
+void bench_routes(long iterations) {
+    // Mélange représentatif : surtout /update et /state, quelques pages et des 404
+    static const char *chemins[] = {
+        "/update", "/state", "/update", "/accueil", "/state", "/update", "/favicon.ico", "/reset-db"
+    };
+    const int nb = (int)(sizeof(chemins) / sizeof(chemins[0]));
+    Tranche tc[8];
+    Tranche get = { "GET", 3 };
+    for (int i = 0; i < nb; i++) { tc[i].p = chemins[i]; tc[i].len = strlen(chemins[i]); }
+
+    volatile long trouves = 0;
+    double t0 = horloge_ns();
+    for (long i = 0; i < iterations; i++) trouves += route_chaine_strcmp("GET", chemins[i % nb]) != 0;
+    double t1 = horloge_ns();
+    printf("[BENCH] routage chaîne strcmp : %.1f ns/requête (%ld trouvées)\n", (t1 - t0) / iterations, (long)trouves);
+
+    trouves = 0;
+    t0 = horloge_ns();
+    for (long i = 0; i < iterations; i++) trouves += route_trouver(get, tc[i % nb]) != NULL;
+    t1 = horloge_ns();
+    printf("[BENCH] routage table hachée  : %.1f ns/requête (%ld trouvées, graine %u)\n", (t1 - t0) / iterations, (long)trouves, graine_routes);
+}
+
+void bench_parseur(long iterations) {
+    size_t len = sizeof(REQUETE_BENCH) - 1;
+    RequeteHTTP r;
+    long ok = 0;
+
+    // 1. Requête reçue d'un seul bloc
+    double t0 = horloge_ns();
+    for (long i = 0; i < iterations; i++) {
+        http_reinit(&r);
+        ok += http_parser(&r, REQUETE_BENCH, len) == HTTP_COMPLET;
     }
+    double t1 = horloge_ns();
+    printf("[BENCH] parseur, 1 segment   : %.0f requêtes/s (%.1f ns/requête, %ld ok)\n",
+           iterations / ((t1 - t0) / 1e9), (t1 - t0) / iterations, ok);
 
-    printf("🌐 Serveur HTTP Domo-Connect prêt sur http://localhost:%d\n", PORT);
+    // 2. Requête découpée en segments de 64 octets (reprise de l'état)
+    ok = 0;
+    t0 = horloge_ns();
+    for (long i = 0; i < iterations; i++) {
+        http_reinit(&r);
+        int res = HTTP_INCOMPLET;
+        for (size_t vu = 64; res == HTTP_INCOMPLET; vu += 64)
+            res = http_parser(&r, REQUETE_BENCH, vu < len ? vu : len);
+        ok += res == HTTP_COMPLET;
+    }
+    t1 = horloge_ns();
+    printf("[BENCH] parseur, 64 o/segment : %.0f requêtes/s (%.1f ns/requête, %ld ok)\n",
+           iterations / ((t1 - t0) / 1e9), (t1 - t0) / iterations, ok);
+}
+
+// Charge "panneaux muraux" : de nombreuses connexions keep-alive qui
+// interrogent /state en boucle, contre un serveur déjà lancé sur 127.0.0.1:PORT.
+// À exécuter une fois par backend (--boucle epoll / --boucle io_uring).
+typedef struct {
+    int premiere, nb;   // tranche de connexions gérée par ce thread
+    SOCKET *socks;
+    double fin;
+    long reponses;
+    int erreur;
+} ClientBench;
+
+static const char REQUETE_STATE[] = "GET /state HTTP/1.1\r\nHost: bench\r\n\r\n";
 
+// Lit une réponse complète (en-têtes + Content-Length) sur un socket bloquant
+static int lire_reponse_bench(SOCKET s) {
+    char buf[2048];
+    size_t len = 0;
     while (1) {
-        client_sock = accept(server_sock, (struct sockaddr*)&server_addr, &addrlen);
-        if (client_sock == INVALID_SOCKET) continue;
-
-        char recvbuf[RECV_BUF];
-        memset(recvbuf, 0, sizeof(recvbuf));
-        int r = recv(client_sock, recvbuf, sizeof(recvbuf) - 1, 0);
-        if (r <= 0) {
-            closesocket(client_sock);
-            continue;
+        int n = recv(s, buf + len, (int)(sizeof(buf) - 1 - len), 0);
+        if (n <= 0) return -1;
+        len += (size_t)n;
+        buf[len] = '\0';
+        char *fin_entetes = strstr(buf, "\r\n\r\n");
+        if (!fin_entetes) { if (len >= sizeof(buf) - 1) return -1; continue; }
+        char *cl = strstr(buf, "Content-Length: ");
+        size_t corps = cl ? (size_t)atol(cl + 16) : 0;
+        size_t total = (size_t)(fin_entetes + 4 - buf) + corps;
+        if (total > sizeof(buf) - 1) return -1;
+        if (len >= total) return 0; // une requête en vol par connexion : pas de surplus
+    }
+}
+
+static void *client_bench(void *arg) {
+    ClientBench *cb = arg;
+    while (horloge_ns() < cb->fin) {
+        for (int i = 0; i < cb->nb; i++)
+            if (send(cb->socks[cb->premiere + i], REQUETE_STATE, (int)sizeof(REQUETE_STATE) - 1, 0) <= 0) { cb->erreur = 1; return NULL; }
+        for (int i = 0; i < cb->nb; i++) {
+            if (lire_reponse_bench(cb->socks[cb->premiere + i]) != 0) { cb->erreur = 1; return NULL; }
+            cb->reponses++;
         }
+    }
+    return NULL;
+}
 
-        char method[16] = {0}, path[1024] = {0};
-        sscanf(recvbuf, "%15s %1023s", method, path);
-        printf("\n--- Requête: %s %s ---\n", method, path);
-
-        // ROUTES DE FICHIERS (avec gestion de /index ou /)
-        if (strcmp(method, "GET") == 0 && (strcmp(path, "/") == 0 || strcmp(path, "/index.html") == 0))
-            send_file_response(client_sock, "index.html", NULL);
-        else if (strcmp(method, "GET") == 0 && (strcmp(path, "/login") == 0 || strcmp(path, "/login.html") == 0))
-            send_file_response(client_sock, "login.html", NULL);
-        else if (strcmp(method, "GET") == 0 && (strcmp(path, "/signup") == 0 || strcmp(path, "/signup.html") == 0))
-            send_file_response(client_sock, "signup.html", NULL);
-        else if (strcmp(method, "GET") == 0 && (strcmp(path, "/accueil") == 0 || strcmp(path, "/accueil.html") == 0))
-            send_file_response(client_sock, "accueil.html", NULL);
-        else if (strcmp(method, "GET") == 0 && (strcmp(path, "/logout") == 0 || strcmp(path, "/logout.html") == 0))
-            send_file_response(client_sock, "logout.html", NULL);
-
-        // ROUTE UPDATE (gestion du changement d'état)
-        else if (strcmp(method, "GET") == 0 && strncmp(path, "/update", 7) == 0) {
-            char nom[128] = {0}, type[128] = {0}, etat[128] = {0};
-            char ip_app[16] = {0}, input_app[9] = {0};
-            int port_app = 0;
-            char ancien_etat[32] = {0};
-
-            extract_query(path, nom, etat, type);
-            printf("[UPDATE] nom=%s | etat=%s | type=%s\n", nom, etat, type);
-            if (nom[0] != '\0' && etat[0] != '\0' && type[0] != '\0') {
-
-                // 1. Récupérer les détails IP, Input, Port de la DB
-                getAppareilDetails(db, nom, ip_app, sizeof(ip_app), input_app, sizeof(input_app), &port_app, ancien_etat, sizeof(ancien_etat));
-
-                // 2. Mettre à jour l'état dans la base de données
-                majEtat(db, nom, etat);
-
-                // 3. Envoyer la commande au simulateur
-                envoyer_au_simulateur(ip_app, port_app, type, input_app, etat);
-
-                const char *ok = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\nOK";
-                send(client_sock, ok, (int)strlen(ok), 0);
-            } else {
-                const char *bad = "HTTP/1.1 400 Bad Request\r\nContent-Type: text/plain\r\n\r\nMissing params";
-                send(client_sock, bad, (int)strlen(bad), 0);
-            }
+int bench_state(int connexions, int secondes) {
+    if (reseau_init() != 0) return 1;
+    SOCKET *socks = calloc((size_t)connexions, sizeof(SOCKET));
+    int nb_threads = nb_coeurs() < connexions ? nb_coeurs() : connexions;
+    if (nb_threads > MAX_WORKERS) nb_threads = MAX_WORKERS;
+    ClientBench *cbs = calloc((size_t)nb_threads, sizeof(ClientBench));
+    thread_t *threads = calloc((size_t)nb_threads, sizeof(thread_t));
+    if (!socks || !cbs || !threads) return 1;
+
+    struct sockaddr_in adr;
+    memset(&adr, 0, sizeof(adr));
+    adr.sin_family = AF_INET;
+    adr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    adr.sin_port = htons(PORT);
+    for (int i = 0; i < connexions; i++) {
+        socks[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if (socks[i] == INVALID_SOCKET || connect(socks[i], (struct sockaddr *)&adr, sizeof(adr)) != 0) {
+            fprintf(stderr, "[BENCH] connexion %d impossible (serveur lancé sur le port %d ?)\n", i, PORT);
+            return 1;
+        }
+    }
+
+    double t0 = horloge_ns();
+    for (int t = 0; t < nb_threads; t++) {
+        cbs[t].premiere = connexions * t / nb_threads;
+        cbs[t].nb = connexions * (t + 1) / nb_threads - cbs[t].premiere;
+        cbs[t].socks = socks;
+        cbs[t].fin = t0 + secondes * 1e9;
+        thread_lancer(&threads[t], client_bench, &cbs[t]);
+    }
+    long total = 0;
+    int erreurs = 0;
+    for (int t = 0; t < nb_threads; t++) {
+        thread_attendre(threads[t]);
+        total += cbs[t].reponses;
+        erreurs += cbs[t].erreur;
+    }
+    double t1 = horloge_ns();
+    printf("[BENCH] /state, %d connexions keep-alive : %.0f requêtes/s (%ld réponses, %d threads en erreur)\n",
+           connexions, total / ((t1 - t0) / 1e9), total, erreurs);
+
+    for (int i = 0; i < connexions; i++) closesocket(socks[i]);
+    free(socks); free(cbs); free(threads);
+    reseau_fin();
+    return erreurs ? 1 : 0;
+}
+
+// Débit de la file de commandes contre le simulateur local : les commandes
+// sont réparties sur les quatre contrôleurs de la maison, au plus
+// BENCH_DISPATCH_EN_VOL à la fois (sous la taille des files).
+#define BENCH_DISPATCH_EN_VOL 512
+
+static int comparer_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int bench_dispatch(long commandes, const char *cible) {
+    static const char *ips[] = { "192.168.0.100", "192.168.0.103", "192.168.0.110", "192.168.0.113" };
+    if (reseau_init() != 0) return 1;
+    pool_init();
+    if (simulateur_rediriger(cible) != 0) return 1;
+    unsigned long long *ids = calloc((size_t)commandes, sizeof(*ids));
+    double *latences = calloc((size_t)commandes, sizeof(*latences));
+    if (!ids || !latences) return 1;
+
+    long envoyees = 0, terminees = 0, echecs = 0, tentatives = 0;
+    double t0 = horloge_ns();
+    while (terminees < commandes) {
+        while (envoyees < commandes && envoyees - terminees < BENCH_DISPATCH_EN_VOL) {
+            char input[9];
+            unsigned octet = (unsigned)(envoyees / 4) % 255 + 1;
+            for (int b = 0; b < 8; b++) input[b] = (octet >> (7 - b)) & 1 ? '1' : '0';
+            input[8] = '\0';
+            ids[envoyees] = envoyer_au_simulateur(ips[envoyees % 4], 0, "light", input, (envoyees / 1020) & 1 ? "OFF" : "ON", 0, 0);
+            envoyees++;
+        }
+        // Les livraisons se terminent dans l'ordre de chaque file : on attend la plus ancienne
+        Livraison l;
+        if (!livraison_lire(ids[terminees], &l) || l.statut != LIVRAISON_EN_ATTENTE) {
+            latences[terminees] = ids[terminees] ? l.latence_ms : 0;
+            if (!ids[terminees] || l.statut == LIVRAISON_ECHEC) echecs++;
+            tentatives += ids[terminees] ? l.tentatives : 0;
+            terminees++;
+        } else {
+            dormir_ms(1);
+        }
+    }
+    double t1 = horloge_ns();
+
+    qsort(latences, (size_t)commandes, sizeof(*latences), comparer_doubles);
+    printf("[BENCH] dispatch vers %s : %.0f commandes/s (%ld commandes, %ld échecs, %.2f tentatives/commande)\n",
+           cible, commandes / ((t1 - t0) / 1e9), commandes, echecs, (double)tentatives / commandes);
+    printf("[BENCH] latence de livraison : p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           latences[commandes / 2], latences[commandes * 99 / 100], latences[commandes - 1]);
+    free(ids);
+    free(latences);
+    reseau_fin();
+    return echecs ? 1 : 0;
+}
+
+// Coût de la partie stockage de /update : changement d'état et outbox dans le
+// magasin, plus une transaction d'écriture tous les ECRITURE_LOT changements
+// (ce que ferait le thread d'écriture), sans puis avec le cache de requêtes
+// préparées. Base en mémoire : on mesure le travail de SQLite, pas celui du disque.
+int bench_update(long iterations) {
+    if (reseau_init() != 0) return 1;
+    evenements_init(NULL, 0);
+    mutex_init(&mutex_magasin);
+    mutex_init(&mutex_ecriture);
+    mutex_init(&mutex_livraisons);
+    cond_init(&cond_ecriture);
+    for (int avec_cache = 0; avec_cache <= 1; avec_cache++) {
+        sqlite3 *db = NULL;
+        if (sqlite3_open(":memory:", &db) != SQLITE_OK) return 1;
+        initDB(db);
+        insert_initial_devices(db);
+        requetes_cache_actif = avec_cache;
+        if (avec_cache && requetes_preparer(db) != 0) return 1;
+        if (magasin_charger(db) != 0) return 1;
+        unsigned long hors_cache = requetes_hors_cache, transactions = ecriture_transactions, fusions = ecriture_fusions;
+
+        double t0 = horloge_ns();
+        for (long i = 0; i < iterations; i++) {
+            commande_enregistrer("light", "Salon - Luminaire salon nord", (i & 1) ? "ON" : "OFF", NULL);
+            if (i % ECRITURE_LOT == ECRITURE_LOT - 1 || i == iterations - 1) magasin_persister(db, 0);
         }
+        double t1 = horloge_ns();
+        CacheRequetes *c = requetes_cache(db);
+        printf("[BENCH] /update %s : %.2f µs/commande, %lu transaction(s), %lu changement(s) fusionné(s), "
+               "%.2f prepare/commande, %.2f réutilisations/commande\n",
+               avec_cache ? "avec cache" : "sans cache", (t1 - t0) / 1e3 / iterations,
+               (unsigned long)(ecriture_transactions - transactions), (unsigned long)(ecriture_fusions - fusions),
+               (double)(requetes_hors_cache - hors_cache) / iterations,
+               c ? (double)c->reutilisations / iterations : 0.0);
+        requetes_liberer(db);
+        sqlite3_close(db);
+    }
+    requetes_cache_actif = 1;
+    reseau_fin();
+    return 0;
+}
 
-        // ROUTE STATE (pour la synchronisation de l'état des appareils de test)
-        else if (strcmp(method, "GET") == 0 && strcmp(path, "/state") == 0) {
-            char out[1024];
-            char e1[32], e2[32], e3[32];
-            getEtat(db, "lumiere", e1, sizeof(e1));
-            getEtat(db, "volets", e2, sizeof(e2));
-            getEtat(db, "clim", e3, sizeof(e3));
-            snprintf(out, sizeof(out), "lumiere=%s;volets=%s;clim=%s", e1, e2, e3);
-            char resp[2048];
-            snprintf(resp, sizeof(resp), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; charset=UTF-8\r\n\r\n%s", out);
-            send(client_sock, resp, (int)strlen(resp), 0);
+// Bascules par seconde sous chaque profil de stockage, sur un vrai fichier
+// du répertoire courant (à lancer sur le support visé, la carte SD par
+// exemple) : une transaction par bascule (/update?durable=1 sans fenêtre),
+// puis une transaction par lot de ECRITURE_LOT (écriture groupée).
+int bench_stockage(long bascules, const char *liste) {
+    const char *fichier = "bench_stockage.db";
+    if (reseau_init() != 0) return 1;
+    evenements_init(NULL, 0);
+    mutex_init(&mutex_magasin);
+    mutex_init(&mutex_ecriture);
+    mutex_init(&mutex_livraisons);
+    cond_init(&cond_ecriture);
+    printf("[BENCH] %-10s %-7s %-12s %8s %16s %16s %12s\n", "profil", "journal", "synchronous", "mmap",
+           "1/transaction", "256/transaction", "checkpoints");
+    for (int p = 0; p < NB_PROFILS_STOCKAGE; p++) {
+        if (liste && !strstr(liste, profils_stockage[p].nom)) continue;
+        stockage = profils_stockage[p];
+        char nom_fichier[64];
+        const char *suffixes[] = { "", "-wal", "-shm", "-journal" };
+        for (int k = 0; k < 4; k++) {
+            snprintf(nom_fichier, sizeof(nom_fichier), "%s%s", fichier, suffixes[k]);
+            remove(nom_fichier);
+        }
+
+        sqlite3 *db = NULL;
+        if (sqlite3_open(fichier, &db) != SQLITE_OK) return 1;
+        sqlite3_busy_timeout(db, 5000);
+        if (stockage_appliquer(db) != 0) return 1;
+        initDB(db);
+        insert_initial_devices(db);
+        if (requetes_preparer(db) != 0 || magasin_charger(db) != 0) return 1;
+        thread_t t;
+        int checkpoints = stockage_demarrer(db, fichier, &t);
+        unsigned long faits = checkpoints_faits;
+
+        double debit[2];
+        for (int groupe = 0; groupe <= 1; groupe++) {
+            long n = groupe ? bascules * 10 : bascules;
+            char etat[32];
+            double t0 = horloge_ns();
+            for (long i = 0; i < n; i++) {
+                const char *nom = devices[(i % 40) * 5]; // 40 lampes du contrôleur .100
+                getEtat(nom, etat, sizeof(etat));
+                commande_enregistrer("light", nom, strcmp(etat, "ON") == 0 ? "OFF" : "ON", NULL);
+                if (!groupe || i % ECRITURE_LOT == ECRITURE_LOT - 1 || i == n - 1) magasin_persister(db, 0);
+            }
+            debit[groupe] = n / ((horloge_ns() - t0) / 1e9);
         }
 
-        // ROUTE RESET DB
-        else if (strcmp(method, "GET") == 0 && strcmp(path, "/reset-db") == 0) {
-            resetDB(db);
-            insert_initial_devices(db); // On réinsère les données après le reset
-            const char *ok = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\nBase réinitialisée et rechargée";
-            send(client_sock, ok, (int)strlen(ok), 0);
+        if (checkpoints > 0) {
+            atomic_store(&checkpoints_arret, 1);
+            thread_attendre(t);
+            sqlite3_wal_hook(db, NULL, NULL);
         }
+        char mmap[16];
+        snprintf(mmap, sizeof(mmap), "%d Mio", stockage.mmap_mio);
+        printf("[BENCH] %-10s %-7s %-12s %8s %14.0f/s %14.0f/s %12lu\n", stockage.nom, stockage.journal,
+               stockage.synchronous, mmap, debit[0], debit[1], (unsigned long)(checkpoints_faits - faits));
+        requetes_liberer(db);
+        sqlite3_close(db);
+        for (int k = 0; k < 4; k++) {
+            snprintf(nom_fichier, sizeof(nom_fichier), "%s%s", fichier, suffixes[k]);
+            remove(nom_fichier);
+        }
+    }
+    reseau_fin();
+    return 0;
+}
+
+// Coût d'encodage d'une commande : ligne texte (snprintf) contre trame binaire
+void bench_trames(long iterations) {
+    char texte[64];
+    unsigned char trame[TRAME_TAILLE];
+    volatile size_t total = 0;
+    crc8_init();
+    double t0 = horloge_ns();
+    for (long i = 0; i < iterations; i++)
+        total += (size_t)snprintf(texte, sizeof(texte), "%s:%s:%s\n", "light", "00010111", (i & 1) ? "ON" : "OFF");
+    double t1 = horloge_ns();
+    printf("[BENCH] texte   : %.1f ns/commande, %lu octets/commande\n", (t1 - t0) / iterations, (unsigned long)(total / (size_t)iterations));
+    total = 0;
+    t0 = horloge_ns();
+    for (long i = 0; i < iterations; i++)
+        total += trame_encoder(trame, "light", "00010111", (i & 1) ? "ON" : "OFF", (unsigned)i);
+    t1 = horloge_ns();
+    printf("[BENCH] binaire : %.1f ns/commande, %lu octets/commande\n", (t1 - t0) / iterations, (unsigned long)(total / (size_t)iterations));
+}
 
-        else send_404_response(client_sock);
 
-        closesocket(client_sock);
+// =========================================================
+// MAIN
+// =========================================================
+int main(int argc, char **argv) {
+    int nb_workers = 1;
+    const char *nom_boucle = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) nb_workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--boucle") == 0 && i + 1 < argc) nom_boucle = argv[++i];
+        else if (strcmp(argv[i], "--durabilite-ms") == 0 && i + 1 < argc) ecriture_fenetre_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--verbeux") == 0) verbeux = 1;
+        else if (strcmp(argv[i], "--simulateur") == 0 && i + 1 < argc) {
+            if (simulateur_rediriger(argv[++i]) != 0) return 1;
+        }
+        else if (strcmp(argv[i], "--bench-dispatch") == 0) {
+            long commandes = i + 1 < argc ? atol(argv[i + 1]) : 100000;
+            const char *cible = i + 2 < argc ? argv[i + 2] : "127.0.0.1:50000";
+            return bench_dispatch(commandes > 0 ? commandes : 100000, cible);
+        }
+        else if (strcmp(argv[i], "--bench-state") == 0) {
+            int connexions = i + 1 < argc ? atoi(argv[i + 1]) : 256;
+            int secondes = i + 2 < argc ? atoi(argv[i + 2]) : 5;
+            return bench_state(connexions > 0 ? connexions : 256, secondes > 0 ? secondes : 5);
+        }
+        else if (strcmp(argv[i], "--bench-parser") == 0) {
+            bench_parseur(i + 1 < argc ? atol(argv[i + 1]) : 1000000);
+            return 0;
+        }
+        else if (strcmp(argv[i], "--stockage") == 0 && i + 1 < argc) {
+            if (stockage_choisir(argv[++i]) != 0) return 1;
+        }
+        else if (strcmp(argv[i], "--bench-stockage") == 0) {
+            long bascules = i + 1 < argc ? atol(argv[i + 1]) : 500;
+            return bench_stockage(bascules > 0 ? bascules : 500, i + 2 < argc ? argv[i + 2] : NULL);
+        }
+        else if (strcmp(argv[i], "--bench-update") == 0) {
+            return bench_update(i + 1 < argc ? atol(argv[i + 1]) : 100000);
+        }
+        else if (strcmp(argv[i], "--bench-trames") == 0) {
+            bench_trames(i + 1 < argc ? atol(argv[i + 1]) : 10000000);
+            return 0;
+        }
+        else if (strcmp(argv[i], "--bench-routes") == 0) {
+            if (routes_init() != 0) return 1;
+            bench_routes(i + 1 < argc ? atol(argv[i + 1]) : 10000000);
+            return 0;
+        }
     }
+    if (routes_init() != 0) return 1;
+    assets_charger();
+    if (nb_workers <= 0) nb_workers = nb_coeurs();
+    if (nb_workers > MAX_WORKERS) nb_workers = MAX_WORKERS;
 
-    closesocket(server_sock);
+    // Création du schéma une seule fois, avant que le thread d'écriture n'ouvre sa connexion
+    sqlite3 *db = NULL;
+    if (sqlite3_open(DB_FILE, &db) != SQLITE_OK) {
+        fprintf(stderr, "Erreur ouverture DB: %s\n", sqlite3_errmsg(db));
+        if (db) sqlite3_close(db);
+        return 1;
+    }
+    sqlite3_busy_timeout(db, 5000);
+    if (stockage_appliquer(db) != 0) { sqlite3_close(db); return 1; } // mode de journal fixé avant les autres connexions
+    initDB(db);
+    insert_initial_devices(db); 
     sqlite3_close(db);
-    WSACleanup();
+    printf("💾 Stockage '%s' : journal %s, synchronous %s, mmap %d Mio, cache %d Kio, checkpoints %s\n",
+           stockage.nom, stockage.journal, stockage.synchronous, stockage.mmap_mio, stockage.cache_kio,
+           stockage_wal() && stockage.checkpoint_pages > 0 ? "en arrière-plan" : "automatiques");
+
+    if (reseau_init() != 0) {
+        fprintf(stderr, "WSAStartup failed\n");
+        return 1;
+    }
+    pool_init();
+    if (magasin_init() != 0) { reseau_fin(); return 1; }
+
+    // Sans SO_REUSEPORT (Windows), les workers se partagent un seul socket d'écoute
+#ifdef SO_REUSEPORT
+    int reuseport = nb_workers > 1;
+#else
+    int reuseport = 0;
+#endif
+    SOCKET ecoute_partagee = INVALID_SOCKET;
+    if (!reuseport) {
+        ecoute_partagee = ouvrir_ecoute(0);
+        if (ecoute_partagee == INVALID_SOCKET) { reseau_fin(); return 1; }
+    }
+
+    Worker *workers = calloc((size_t)nb_workers, sizeof(Worker));
+    if (!workers) { reseau_fin(); return 1; }
+
+    for (int i = 0; i < nb_workers; i++) {
+        Worker *w = &workers[i];
+        w->id = i;
+        w->ecoute = reuseport ? ouvrir_ecoute(1) : ecoute_partagee;
+        if (w->ecoute == INVALID_SOCKET) return 1;
+
+        w->boucle = boucle_creer(nom_boucle);
+        if (!w->boucle || w->boucle->ajouter(w->boucle, w->ecoute, NULL, EV_LECTURE) != 0) {
+            fprintf(stderr, "event loop failed\n");
+            return 1;
+        }
+
+        // Socket de réveil pour la diffusion des événements (127.0.0.1, port éphémère)
+        socklen_t alen = sizeof(w->adresse_reveil);
+        memset(&w->adresse_reveil, 0, sizeof(w->adresse_reveil));
+        w->adresse_reveil.sin_family = AF_INET;
+        w->adresse_reveil.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        w->reveil = socket(AF_INET, SOCK_DGRAM, 0);
+        if (w->reveil == INVALID_SOCKET
+            || bind(w->reveil, (struct sockaddr *)&w->adresse_reveil, sizeof(w->adresse_reveil)) != 0
+            || getsockname(w->reveil, (struct sockaddr *)&w->adresse_reveil, &alen) != 0
+            || sock_non_bloquant(w->reveil) != 0
+            || w->boucle->ajouter(w->boucle, w->reveil, w, EV_LECTURE) != 0) {
+            fprintf(stderr, "socket de réveil failed\n");
+            return 1;
+        }
+    }
+    evenements_init(workers, nb_workers);
+
+    printf("🌐 Serveur HTTP Domo-Connect prêt sur http://localhost:%d (%s, %d worker%s)\n",
+           PORT, workers[0].boucle->nom, nb_workers, nb_workers > 1 ? "s" : "");
+
+    // Le worker 0 tourne sur le thread principal
+    for (int i = 1; i < nb_workers; i++) {
+        if (thread_lancer(&workers[i].thread, worker_boucle, &workers[i]) != 0) {
+            fprintf(stderr, "Impossible de lancer le worker %d\n", i);
+            return 1;
+        }
+    }
+    worker_boucle(&workers[0]);
+
+    for (int i = 1; i < nb_workers; i++) thread_attendre(workers[i].thread);
+    for (int i = 0; i < nb_workers; i++) {
+        workers[i].boucle->detruire(workers[i].boucle);
+        if (reuseport) closesocket(workers[i].ecoute);
+        closesocket(workers[i].reveil);
+    }
+    if (!reuseport) closesocket(ecoute_partagee);
+    free(workers);
+    reseau_fin();
     return 0;
 }
\ No newline at end of file
@@ -8,75 +8,100 @@
 #define PORT 8080
 #define SEUIL_PREDICTION 5  // alerte après 5 OFF
 
-// 🔹 Lecture de l'état d'un appareil
-void getEtat(sqlite3 *db, const char *nom, char *etat) {
-    const char *sql = "SELECT etat FROM etat_appareils WHERE appareil = ?;";
-    sqlite3_stmt *stmt;
-    strcpy(etat, "OFF");
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, nom, -1, SQLITE_STATIC);
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            const unsigned char *val = sqlite3_column_text(stmt, 0);
-            strcpy(etat, (const char*)val);
+static int verbeux = 0;     // --verbeux : diagnostic à chaque requête (réutilisations, transitions)
+
+// 🔹 Requêtes préparées une seule fois au démarrage, puis réutilisées
+// (sqlite3_reset + sqlite3_clear_bindings) au lieu de prepare/finalize à chaque appel
+enum { REQ_ETAT, REQ_MAJ, REQ_PREDICTION, REQ_RESET, NB_REQUETES };
+
+static const char *sql_requetes[NB_REQUETES] = {
+    "SELECT etat FROM etat_appareils WHERE appareil = ?;",
+    // Transition et compteurs en une seule requête. Dans le SET, "etat" est
+    // encore l'ancienne valeur ; RETURNING rend l'état précédent et le nouveau.
+    // Un appareil inconnu n'est pas créé : aucune ligne rendue.
+    "UPDATE etat_appareils SET etat_precedent = etat, etat = ?2, "
+    "compteur_on = compteur_on + (?2 = 'ON' AND etat IS NOT 'ON'), "
+    "compteur_off = compteur_off + (?2 = 'OFF' AND etat IS NOT 'OFF'), "
+    "dernier_changement = CURRENT_TIMESTAMP "
+    "WHERE appareil = ?1 "
+    "RETURNING etat_precedent, etat;",
+    "SELECT compteur_off FROM etat_appareils WHERE appareil = ?;",
+    "UPDATE etat_appareils SET compteur_on = 0, compteur_off = 0 WHERE appareil = ?;",
+};
+static sqlite3_stmt *requetes[NB_REQUETES];
+static unsigned long reutilisations = 0;
+
+int preparerRequetes(sqlite3 *db) {
+    for (int r = 0; r < NB_REQUETES; r++) {
+        if (sqlite3_prepare_v2(db, sql_requetes[r], -1, &requetes[r], NULL) != SQLITE_OK) {
+            printf("❌ Erreur préparation : %s\n", sqlite3_errmsg(db));
+            return -1;
         }
-        sqlite3_finalize(stmt);
     }
+    return 0;
+}
+
+void libererRequetes(void) {
+    for (int r = 0; r < NB_REQUETES; r++) sqlite3_finalize(requetes[r]);
 }
 
-// 🔹 Met à jour l'état et incrémente compteur ON/OFF
-void majEtat(sqlite3 *db, const char *nom, const char *etat) {
-    char etatActuel[8];
-    getEtat(db, nom, etatActuel);
+static sqlite3_stmt *requete(int r) {
+    reutilisations++;
+    return requetes[r];
+}
 
-    int incrementer_on = strcmp(etatActuel, "ON") != 0 && strcmp(etat, "ON") == 0;
-    int incrementer_off = strcmp(etatActuel, "OFF") != 0 && strcmp(etat, "OFF") == 0;
+static void rendreRequete(sqlite3_stmt *stmt) {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
 
-    const char *sql;
-    if (incrementer_on) {
-        sql = "UPDATE etat_appareils SET etat = ?, dernier_changement = CURRENT_TIMESTAMP, compteur_on = compteur_on + 1 WHERE appareil = ?;";
-    } else if (incrementer_off) {
-        sql = "UPDATE etat_appareils SET etat = ?, dernier_changement = CURRENT_TIMESTAMP, compteur_off = compteur_off + 1 WHERE appareil = ?;";
-    } else {
-        sql = "UPDATE etat_appareils SET etat = ?, dernier_changement = CURRENT_TIMESTAMP WHERE appareil = ?;";
+// 🔹 Lecture de l'état d'un appareil
+void getEtat(const char *nom, char *etat) {
+    sqlite3_stmt *stmt = requete(REQ_ETAT);
+    strcpy(etat, "OFF");
+    sqlite3_bind_text(stmt, 1, nom, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        const unsigned char *val = sqlite3_column_text(stmt, 0);
+        strcpy(etat, (const char*)val);
     }
+    rendreRequete(stmt);
+}
 
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, etat, -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, nom, -1, SQLITE_STATIC);
-        if (sqlite3_step(stmt) != SQLITE_DONE) {
-            printf("❌ Erreur majEtat : %s\n", sqlite3_errmsg(db));
-        }
-        sqlite3_finalize(stmt);
+// 🔹 Met à jour l'état et incrémente compteur ON/OFF (une seule requête)
+void majEtat(const char *nom, const char *etat) {
+    sqlite3_stmt *stmt = requete(REQ_MAJ);
+    sqlite3_bind_text(stmt, 1, nom, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, etat, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW && verbeux) {
+        const unsigned char *precedent = sqlite3_column_text(stmt, 0);
+        printf("🔁 %s : %s → %s\n", nom, precedent ? (const char*)precedent : "(aucun)", (const char*)sqlite3_column_text(stmt, 1));
+    } else if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        printf("❌ Erreur majEtat : %s\n", sqlite3_errmsg(sqlite3_db_handle(stmt)));
     }
+    rendreRequete(stmt);
 }
 
 // 🔹 Message prédiction selon compteur_off
-void getMessagePrediction(sqlite3 *db, const char *nom, char *message) {
-    const char *sql = "SELECT compteur_off FROM etat_appareils WHERE appareil = ?;";
-    sqlite3_stmt *stmt;
+void getMessagePrediction(const char *nom, char *message) {
+    sqlite3_stmt *stmt = requete(REQ_PREDICTION);
     strcpy(message, "");
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, nom, -1, SQLITE_STATIC);
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            int compteur_off = sqlite3_column_int(stmt, 0);
-            if (compteur_off >= SEUIL_PREDICTION) {
-                sprintf(message, "⚠️ Attention, %s a été éteint %d fois !", nom, compteur_off);
-            }
+    sqlite3_bind_text(stmt, 1, nom, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        int compteur_off = sqlite3_column_int(stmt, 0);
+        if (compteur_off >= SEUIL_PREDICTION) {
+            sprintf(message, "⚠️ Attention, %s a été éteint %d fois !", nom, compteur_off);
         }
-        sqlite3_finalize(stmt);
     }
+    rendreRequete(stmt);
 }
 
 // 🔹 Réinitialiser compteurs
-void resetCompteur(sqlite3 *db, const char *nom) {
-    const char *sql = "UPDATE etat_appareils SET compteur_on = 0, compteur_off = 0 WHERE appareil = ?;";
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, nom, -1, SQLITE_STATIC);
-        sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-    }
+void resetCompteur(const char *nom) {
+    sqlite3_stmt *stmt = requete(REQ_RESET);
+    sqlite3_bind_text(stmt, 1, nom, -1, SQLITE_STATIC);
+    sqlite3_step(stmt);
+    rendreRequete(stmt);
 }
 
 // 🔹 Initialisation base
@@ -89,7 +114,8 @@ void initDB(sqlite3 *db) {
         "etat TEXT, "
         "compteur_on INTEGER DEFAULT 0, "
         "compteur_off INTEGER DEFAULT 0, "
-        "dernier_changement DATETIME DEFAULT CURRENT_TIMESTAMP);";
+        "dernier_changement DATETIME DEFAULT CURRENT_TIMESTAMP, "
+        "etat_precedent TEXT);";
 
     if (sqlite3_exec(db, sql, NULL, NULL, &errMsg) != SQLITE_OK) {
         printf("❌ Erreur création table : %s\n", errMsg);
@@ -97,6 +123,8 @@ void initDB(sqlite3 *db) {
     } else {
         printf("✅ Table prête.\n");
     }
+    // Bases créées avant etat_precedent (échoue sans conséquence si la colonne existe)
+    sqlite3_exec(db, "ALTER TABLE etat_appareils ADD COLUMN etat_precedent TEXT;", NULL, NULL, NULL);
 
     // Appareils initiaux
     const char *insert1 = "INSERT OR IGNORE INTO etat_appareils (appareil, etat) VALUES ('lumiere','OFF');";
@@ -108,7 +136,7 @@ void initDB(sqlite3 *db) {
     sqlite3_exec(db, insert3, NULL, NULL, &errMsg);
 }
 
-int main() {
+int main(int argc, char **argv) {
     WSADATA wsa;
     SOCKET server_fd, new_socket;
     struct sockaddr_in address;
@@ -116,6 +144,10 @@ int main() {
     char buffer[2048] = {0};
     char response[8192];
 
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--verbeux") == 0) verbeux = 1;
+    }
+
     sqlite3 *db;
     if (sqlite3_open("etat_appareils.db", &db) != SQLITE_OK) {
         printf("❌ Erreur ouverture base : %s\n", sqlite3_errmsg(db));
@@ -125,6 +157,7 @@ int main() {
     printf("💾 Base connectée avec succès.\n");
 
     initDB(db);
+    if (preparerRequetes(db) != 0) return 1;
 
     if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) return 1;
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET) return 1;
@@ -149,29 +182,30 @@ int main() {
         if (strstr(buffer, "favicon.ico")) { closesocket(new_socket); continue; }
 
         // Actions ON/OFF
-        if (strstr(buffer, "lumiere=on")) majEtat(db, "lumiere", "ON");
-        if (strstr(buffer, "lumiere=off")) majEtat(db, "lumiere", "OFF");
-        if (strstr(buffer, "volets=ouvrir")) majEtat(db, "volets", "ON");
-        if (strstr(buffer, "volets=fermer")) majEtat(db, "volets", "OFF");
-        if (strstr(buffer, "clim=on")) majEtat(db, "clim", "ON");
-        if (strstr(buffer, "clim=off")) majEtat(db, "clim", "OFF");
+        if (strstr(buffer, "lumiere=on")) majEtat("lumiere", "ON");
+        if (strstr(buffer, "lumiere=off")) majEtat("lumiere", "OFF");
+        if (strstr(buffer, "volets=ouvrir")) majEtat("volets", "ON");
+        if (strstr(buffer, "volets=fermer")) majEtat("volets", "OFF");
+        if (strstr(buffer, "clim=on")) majEtat("clim", "ON");
+        if (strstr(buffer, "clim=off")) majEtat("clim", "OFF");
 
         // Boutons RESET
-        if (strstr(buffer, "lumiere=reset")) resetCompteur(db, "lumiere");
-        if (strstr(buffer, "volets=reset")) resetCompteur(db, "volets");
-        if (strstr(buffer, "clim=reset")) resetCompteur(db, "clim");
+        if (strstr(buffer, "lumiere=reset")) resetCompteur("lumiere");
+        if (strstr(buffer, "volets=reset")) resetCompteur("volets");
+        if (strstr(buffer, "clim=reset")) resetCompteur("clim");
 
         // Lecture états
         char eLumiere[8], eVolets[8], eClim[8];
-        getEtat(db, "lumiere", eLumiere);
-        getEtat(db, "volets", eVolets);
-        getEtat(db, "clim", eClim);
+        getEtat("lumiere", eLumiere);
+        getEtat("volets", eVolets);
+        getEtat("clim", eClim);
 
         // Messages prédiction
         char msgLumiere[128], msgVolets[128], msgClim[128];
-        getMessagePrediction(db, "lumiere", msgLumiere);
-        getMessagePrediction(db, "volets", msgVolets);
-        getMessagePrediction(db, "clim", msgClim);
+        getMessagePrediction("lumiere", msgLumiere);
+        getMessagePrediction("volets", msgVolets);
+        getMessagePrediction("clim", msgClim);
+        if (verbeux) printf("📊 Requêtes préparées réutilisées : %lu\n", reutilisations);
 
         // 🔹 Lire fichier HTML
         FILE *f = fopen("login.html", "r");
@@ -218,6 +252,7 @@ int main() {
     }
 
     closesocket(server_fd);
+    libererRequetes();
     sqlite3_close(db);
     WSACleanup();
     return 0;
@@ -0,0 +1,627 @@
+// =========================================================
+// simulateur.c - Contrôleurs Domo-Connect simulés (Linux) pour tests de charge
+// Compilation : gcc simulateur.c -o simulateur -lpthread -lsqlite3
+// Usage : simulateur [--hote 127.0.0.1] [--base 50000] [--controleurs 100,103,110,113]
+//                    [--reseau 192.168.0.] [--caps lot,bin1,ack] [--db etat_appareils.db]
+//                    [--latence MS] [--gigue MS] [--perte P] [--deconnexion P]
+//                    [--journal fichier|-] [--sans-journal] [--stats secondes]
+// Le contrôleur 192.168.0.N écoute sur hote:(base + N) ("N:port" pour un port
+// explicite). Côté serveur : domoserver --simulateur 127.0.0.1:50000
+//                           domoserver --bench-dispatch [commandes] 127.0.0.1:50000
+// SIGUSR1 affiche l'état des entrées, SIGINT/SIGTERM le bilan puis quitte.
+// =========================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sqlite3.h>
+
+#define MAX_CONTROLEURS 16
+#define TAILLE_RECEPTION 8192
+#define FENETRE_SEQ 1024        // séquences mémorisées par contrôleur pour la déduplication
+
+#define CAP_LOT 1
+#define CAP_BIN1 2
+#define CAP_ACK 4
+
+#define TRAME_VERSION 1
+#define TRAME_TAILLE 9
+#define TYPE_LUMIERE 1
+#define TYPE_STORE 2
+#define TYPE_CLIM 3
+
+// Issue d'une commande reçue
+#define CMD_APPLIQUEE 0
+#define CMD_DOUBLON 1
+#define CMD_PERDUE 2
+#define CMD_CONFLIT 3   // séquence déjà appliquée avec une autre commande : ni appliquée, ni acquittée
+
+// =========================================================
+// CONFIGURATION
+// =========================================================
+// Injection de pannes :
+//  - latence (+ gigue uniforme) : attente avant de traiter chaque message
+//    reçu, donc avant ses accusés de réception ;
+//  - perte : probabilité qu'une commande soit ignorée (ni appliquée, ni
+//    acquittée), comme une trame perdue ;
+//  - déconnexion : probabilité de couper la connexion à la réception d'un
+//    message, sans le traiter.
+static const char *hote = "127.0.0.1";
+static const char *reseau = "192.168.0.";
+static int port_base = 50000;
+static int caps_annoncees = CAP_LOT | CAP_BIN1 | CAP_ACK;
+static int latence_ms = 0;
+static int gigue_ms = 0;
+static double taux_perte = 0;
+static double taux_deconnexion = 0;
+static FILE *journal = NULL;
+static pthread_mutex_t mutex_journal = PTHREAD_MUTEX_INITIALIZER;
+
+// =========================================================
+// CONTRÔLEURS SIMULÉS
+// =========================================================
+// Chaque contrôleur garde l'état de ses 256 entrées (input sur 8 bits) et,
+// si --db est donné, le nom de l'appareil branché sur chacune. La
+// déduplication est par contrôleur et non par connexion : une réémission
+// arrive souvent sur une nouvelle connexion après une coupure. Le contrôleur
+// s'annonce dès l'acceptation ("caps:<liste>", rien avec --caps aucune) et le
+// serveur répond par sa session ("session:<n>", tirée à son démarrage) : une
+// session différente signale un serveur redémarré, dont les séquences
+// repartent de 1, et la fenêtre est remise à zéro. Sans session (ancien
+// serveur), seule une séquence très en retard (hors fenêtre) la remet à zéro.
+// Une séquence déjà vue n'est un doublon que si la commande est la même ;
+// sinon c'est un conflit, ni appliqué ni acquitté.
+typedef struct {
+    int octet;                          // dernier octet de l'IP émulée
+    char ip[16];
+    int port;
+    int ecoute;
+    pthread_mutex_t mutex;
+    unsigned char etats[256];           // 1 = ON
+    char *noms[256];                    // appareil branché sur l'entrée (NULL sans --db)
+    int nb_appareils;                   // entrées connues par --db (0 : toutes acceptées sans nom)
+    unsigned session;                   // session du serveur (0 : pas encore annoncée)
+    unsigned seq_max;
+    unsigned char vues[FENETRE_SEQ / 8]; // bit (seq % FENETRE_SEQ) : séquence déjà appliquée
+    unsigned short charges[FENETRE_SEQ]; // commande appliquée sous cette séquence (input | ON << 8)
+    atomic_ulong connexions, deconnexions, recues, appliquees, doublons, conflits, perdues, invalides, lots;
+} Controleur;
+
+static Controleur controleurs[MAX_CONTROLEURS];
+static int nb_controleurs = 0;
+
+typedef struct {
+    Controleur *k;
+    int sock;
+    unsigned graine;
+} Session;
+
+static double horloge_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void dormir_ms(int ms) {
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+}
+
+// Tirage uniforme dans [0, 1)
+static double tirage(unsigned *graine) {
+    return (double)rand_r(graine) / ((double)RAND_MAX + 1);
+}
+
+static unsigned char table_crc8[256];
+
+static void crc8_init(void) {
+    for (int v = 0; v < 256; v++) {
+        unsigned char crc = (unsigned char)v;
+        for (int i = 0; i < 8; i++) crc = (unsigned char)(crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1);
+        table_crc8[v] = crc;
+    }
+}
+
+static unsigned char crc8(const unsigned char *p, size_t n) {
+    unsigned char crc = 0;
+    while (n--) crc = table_crc8[crc ^ *p++];
+    return crc;
+}
+
+static void input_texte(unsigned octet, char *out) {
+    for (int i = 0; i < 8; i++) out[i] = (octet >> (7 - i)) & 1 ? '1' : '0';
+    out[8] = '\0';
+}
+
+// Marque la séquence comme appliquée avec la commande "charge" ; 0 si elle
+// l'était déjà avec la même commande, -1 avec une autre. Appelée avec k->mutex.
+static int seq_nouvelle(Controleur *k, unsigned seq, unsigned short charge) {
+    if (seq > k->seq_max) {
+        // Les séquences sautées redeviennent inconnues
+        unsigned ecart = seq - k->seq_max;
+        if (k->seq_max == 0 || ecart >= FENETRE_SEQ) memset(k->vues, 0, sizeof(k->vues));
+        else for (unsigned s = k->seq_max + 1; s < seq; s++) k->vues[(s % FENETRE_SEQ) / 8] &= (unsigned char)~(1u << (s % 8));
+        k->seq_max = seq;
+    } else if (k->seq_max - seq >= FENETRE_SEQ) {
+        printf("🔄 %s : séquence %u après %u, serveur redémarré ?\n", k->ip, seq, k->seq_max);
+        memset(k->vues, 0, sizeof(k->vues));
+        k->seq_max = seq;
+    } else if (k->vues[(seq % FENETRE_SEQ) / 8] & (1u << (seq % 8))) {
+        return k->charges[seq % FENETRE_SEQ] == charge ? 0 : -1;
+    }
+    k->vues[(seq % FENETRE_SEQ) / 8] |= (unsigned char)(1u << (seq % 8));
+    k->charges[seq % FENETRE_SEQ] = charge;
+    return 1;
+}
+
+// Nouvelle session annoncée par le serveur : ses séquences repartent de 1
+static void session_annoncee(Controleur *k, unsigned session) {
+    pthread_mutex_lock(&k->mutex);
+    if (session != k->session) {
+        if (k->session) printf("🔄 %s : nouvelle session serveur %08x, séquences remises à zéro\n", k->ip, session);
+        k->session = session;
+        k->seq_max = 0;
+        memset(k->vues, 0, sizeof(k->vues));
+    }
+    pthread_mutex_unlock(&k->mutex);
+}
+
+// Applique une commande (seq = 0 : commande sans séquence, toujours appliquée)
+static int commande_appliquer(Session *s, const char *type, unsigned input, int on, unsigned seq) {
+    Controleur *k = s->k;
+    int issue;
+    char ancien = 0;
+    k->recues++;
+    if (taux_perte > 0 && tirage(&s->graine) < taux_perte) {
+        issue = CMD_PERDUE;
+        k->perdues++;
+    } else {
+        pthread_mutex_lock(&k->mutex);
+        int vue = seq ? seq_nouvelle(k, seq, (unsigned short)(input | (unsigned)on << 8)) : 1;
+        issue = vue > 0 ? CMD_APPLIQUEE : vue == 0 ? CMD_DOUBLON : CMD_CONFLIT;
+        if (issue == CMD_APPLIQUEE) {
+            ancien = (char)k->etats[input];
+            k->etats[input] = (unsigned char)on;
+        }
+        pthread_mutex_unlock(&k->mutex);
+        if (issue == CMD_DOUBLON) k->doublons++;
+        else if (issue == CMD_CONFLIT) k->conflits++;
+        else k->appliquees++;
+    }
+
+    if (journal) {
+        char bits[9];
+        input_texte(input, bits);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        pthread_mutex_lock(&mutex_journal);
+        fprintf(journal, "%lld.%03ld %s %s:%s:%s seq=%u %s%s%s\n", (long long)ts.tv_sec, ts.tv_nsec / 1000000,
+                k->ip, type, bits, on ? "ON" : "OFF", seq,
+                issue == CMD_PERDUE ? "perdue" : issue == CMD_DOUBLON ? "doublon"
+                : issue == CMD_CONFLIT ? "conflit (séquence déjà appliquée à une autre commande)"
+                : ancien == on ? "inchangée" : "appliquée",
+                k->noms[input] ? " " : k->nb_appareils ? " (entrée inconnue)" : "",
+                k->noms[input] ? k->noms[input] : "");
+        pthread_mutex_unlock(&mutex_journal);
+    }
+    return issue;
+}
+
+// Accusés en attente d'un message reçu, regroupés en plages "ack:<de>-<a>"
+typedef struct {
+    unsigned seqs[TAILLE_RECEPTION / TRAME_TAILLE + 1];
+    int nb;
+} Accuses;
+
+static void accuses_noter(Accuses *a, unsigned seq) {
+    if (a->nb < (int)(sizeof(a->seqs) / sizeof(a->seqs[0]))) a->seqs[a->nb++] = seq;
+}
+
+static size_t accuses_encoder(const Accuses *a, char *out, size_t cap) {
+    size_t n = 0;
+    for (int i = 0; i < a->nb && n + 32 < cap;) {
+        int j = i;
+        while (j + 1 < a->nb && a->seqs[j + 1] == a->seqs[j] + 1) j++;
+        if (j == i) n += (size_t)snprintf(out + n, cap - n, "ack:%u\n", a->seqs[i]);
+        else n += (size_t)snprintf(out + n, cap - n, "ack:%u-%u\n", a->seqs[i], a->seqs[j]);
+        i = j + 1;
+    }
+    return n;
+}
+
+static int envoyer_tout(int sock, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Une ligne texte : "session:<n>", "lot:<n>" ou "type:input:etat[@seq]"
+static void ligne_traiter(Session *s, char *ligne, Accuses *a) {
+    Controleur *k = s->k;
+    size_t l = strlen(ligne);
+    if (l > 0 && ligne[l - 1] == '\r') ligne[--l] = '\0';
+    if (l == 0) return;
+
+    if (strncmp(ligne, "session:", 8) == 0) {
+        unsigned session = 0;
+        if (sscanf(ligne + 8, "%x", &session) == 1 && session) session_annoncee(k, session);
+        return;
+    }
+    if (strncmp(ligne, "lot:", 4) == 0) {
+        k->lots++;
+        return;
+    }
+
+    char type[32], bits[16], etat[8];
+    unsigned seq = 0;
+    if (sscanf(ligne, "%31[^:]:%15[^:]:%7[^@\n]@%u", type, bits, etat, &seq) < 3) {
+        k->invalides++;
+        printf("⚠️ %s : ligne invalide \"%s\"\n", k->ip, ligne);
+        return;
+    }
+    unsigned input = 0;
+    size_t nb = strlen(bits);
+    int ok = nb > 0 && nb <= 8 && (strcmp(etat, "ON") == 0 || strcmp(etat, "OFF") == 0);
+    for (size_t i = 0; ok && i < nb; i++) {
+        if (bits[i] != '0' && bits[i] != '1') ok = 0;
+        input = input << 1 | (unsigned)(bits[i] - '0');
+    }
+    if (!ok) {
+        k->invalides++;
+        printf("⚠️ %s : commande invalide \"%s\"\n", k->ip, ligne);
+        return;
+    }
+    int issue = commande_appliquer(s, type, input, strcmp(etat, "ON") == 0, seq);
+    if ((issue == CMD_APPLIQUEE || issue == CMD_DOUBLON) && seq && (caps_annoncees & CAP_ACK))
+        accuses_noter(a, seq);
+}
+
+// Trame binaire de TRAME_TAILLE octets (voir domoserver.c, section CONTRÔLEURS)
+static void trame_traiter(Session *s, const unsigned char *t, Accuses *a) {
+    Controleur *k = s->k;
+    if ((t[0] & 0x7f) != TRAME_VERSION || crc8(t, 8) != t[8] || t[1] < TYPE_LUMIERE || t[1] > TYPE_CLIM) {
+        k->invalides++;
+        printf("⚠️ %s : trame binaire invalide (version %d, crc %02x/%02x)\n", k->ip, t[0] & 0x7f, t[8], crc8(t, 8));
+        return;
+    }
+    static const char *types[] = { "", "light", "store", "climate" };
+    unsigned seq = (unsigned)t[4] << 24 | (unsigned)t[5] << 16 | (unsigned)t[6] << 8 | t[7];
+    int issue = commande_appliquer(s, types[t[1]], t[2], t[3] & 1, seq);
+    if ((issue == CMD_APPLIQUEE || issue == CMD_DOUBLON) && seq && (caps_annoncees & CAP_ACK))
+        accuses_noter(a, seq);
+}
+
+// Traite les messages complets du tampon ; retourne le nombre d'octets consommés.
+// fin = 1 à la fermeture : un reste texte sans '\n' est le message unique des
+// anciennes versions du serveur (une connexion par commande).
+static size_t tampon_traiter(Session *s, char *buf, size_t len, int fin, Accuses *a) {
+    size_t pos = 0;
+    while (pos < len) {
+        if ((unsigned char)buf[pos] & 0x80) {
+            if (len - pos < TRAME_TAILLE) break;
+            trame_traiter(s, (unsigned char *)buf + pos, a);
+            pos += TRAME_TAILLE;
+            continue;
+        }
+        char *nl = memchr(buf + pos, '\n', len - pos);
+        if (!nl) {
+            if (!fin) break;
+            buf[len] = '\0';
+            ligne_traiter(s, buf + pos, a);
+            pos = len;
+            break;
+        }
+        *nl = '\0';
+        ligne_traiter(s, buf + pos, a);
+        pos = (size_t)(nl - buf) + 1;
+    }
+    return pos;
+}
+
+static void *session_servir(void *arg) {
+    Session *s = arg;
+    Controleur *k = s->k;
+    char buf[TAILLE_RECEPTION + 1];
+    size_t len = 0;
+    Accuses a;
+    char acks[4096];
+    int coupe = 0;
+
+    // Annonce des capacités, avant toute commande ; un contrôleur "ancien
+    // modèle" (--caps aucune) se tait et reçoit une commande par connexion
+    if (caps_annoncees) {
+        char annonce[64];
+        int n = snprintf(annonce, sizeof(annonce), "caps:%s%s%s%s%s\n",
+                         caps_annoncees & CAP_LOT ? "lot" : "",
+                         (caps_annoncees & CAP_LOT) && (caps_annoncees & (CAP_BIN1 | CAP_ACK)) ? "," : "",
+                         caps_annoncees & CAP_BIN1 ? "bin1" : "",
+                         (caps_annoncees & CAP_BIN1) && (caps_annoncees & CAP_ACK) ? "," : "",
+                         caps_annoncees & CAP_ACK ? "ack" : "");
+        envoyer_tout(s->sock, annonce, (size_t)n);
+    }
+
+    while (1) {
+        ssize_t n = recv(s->sock, buf + len, TAILLE_RECEPTION - len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        if (taux_deconnexion > 0 && tirage(&s->graine) < taux_deconnexion) {
+            k->deconnexions++;
+            coupe = 1;
+            break;
+        }
+        // La latence ne s'applique qu'aux commandes, pas à la négociation
+        if (latence_ms + gigue_ms > 0 && !(len == 0 && n >= 8 && memcmp(buf, "session:", 8) == 0))
+            dormir_ms(latence_ms + (gigue_ms > 0 ? (int)(tirage(&s->graine) * gigue_ms) : 0));
+        len += (size_t)n;
+        a.nb = 0;
+        size_t pris = tampon_traiter(s, buf, len, 0, &a);
+        memmove(buf, buf + pris, len - pris);
+        len -= pris;
+        if (len == TAILLE_RECEPTION) { // ligne démesurée : on l'oublie
+            k->invalides++;
+            len = 0;
+        }
+        size_t na = accuses_encoder(&a, acks, sizeof(acks));
+        if (na > 0 && envoyer_tout(s->sock, acks, na) != 0) break;
+    }
+    if (!coupe && len > 0) {
+        a.nb = 0;
+        tampon_traiter(s, buf, len, 1, &a);
+    }
+    if (coupe) printf("✂️ %s : connexion coupée (injection)\n", k->ip);
+    close(s->sock);
+    free(s);
+    return NULL;
+}
+
+static void *controleur_ecouter(void *arg) {
+    Controleur *k = arg;
+    unsigned graine = (unsigned)time(NULL) ^ (unsigned)k->port;
+    while (1) {
+        int c = accept(k->ecoute, NULL, NULL);
+        if (c < 0) {
+            if (errno != EINTR) dormir_ms(10);
+            continue;
+        }
+        int un = 1;
+        setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &un, sizeof(un));
+        Session *s = malloc(sizeof(*s));
+        pthread_t t;
+        if (!s) { close(c); continue; }
+        s->k = k;
+        s->sock = c;
+        s->graine = (unsigned)rand_r(&graine);
+        k->connexions++;
+        if (pthread_create(&t, NULL, session_servir, s) != 0) {
+            close(c);
+            free(s);
+            continue;
+        }
+        pthread_detach(t);
+    }
+    return NULL;
+}
+
+// =========================================================
+// CARTE DES ENTRÉES (depuis etat_appareils.db)
+// =========================================================
+// Nom et état initial de chaque entrée, pour démarrer synchronisé avec le serveur
+static int carte_charger(const char *fichier) {
+    sqlite3 *db = NULL;
+    sqlite3_stmt *stmt;
+    if (sqlite3_open_v2(fichier, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "SELECT appareil, etat, ip, input FROM etat_appareils;", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Lecture de %s impossible : %s\n", fichier, db ? sqlite3_errmsg(db) : "?");
+        sqlite3_close(db);
+        return -1;
+    }
+    int nb = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *nom = (const char *)sqlite3_column_text(stmt, 0);
+        const char *etat = (const char *)sqlite3_column_text(stmt, 1);
+        const char *ip = (const char *)sqlite3_column_text(stmt, 2);
+        const char *bits = (const char *)sqlite3_column_text(stmt, 3);
+        if (!nom || !ip || !bits) continue;
+        for (int i = 0; i < nb_controleurs; i++) {
+            Controleur *k = &controleurs[i];
+            if (strcmp(k->ip, ip) != 0) continue;
+            unsigned input = (unsigned)strtoul(bits, NULL, 2) & 0xff;
+            if (!k->noms[input]) k->nb_appareils++;
+            free(k->noms[input]);
+            k->noms[input] = strdup(nom);
+            k->etats[input] = etat && strcmp(etat, "ON") == 0;
+            nb++;
+        }
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    printf("📋 %d appareils chargés depuis %s\n", nb, fichier);
+    return 0;
+}
+
+// =========================================================
+// BILAN
+// =========================================================
+static void bilan(void) {
+    printf("%-15s %6s %6s %9s %9s %8s %7s %7s %9s %6s %7s\n", "contrôleur", "port", "cnx", "coupures",
+           "reçues", "appl.", "doubl.", "confl.", "perdues", "inval.", "lots");
+    for (int i = 0; i < nb_controleurs; i++) {
+        Controleur *k = &controleurs[i];
+        printf("%-15s %6d %6lu %9lu %9lu %8lu %7lu %7lu %9lu %6lu %7lu\n", k->ip, k->port,
+               (unsigned long)k->connexions, (unsigned long)k->deconnexions, (unsigned long)k->recues,
+               (unsigned long)k->appliquees, (unsigned long)k->doublons, (unsigned long)k->conflits,
+               (unsigned long)k->perdues,
+               (unsigned long)k->invalides, (unsigned long)k->lots);
+    }
+    fflush(stdout);
+}
+
+static void etats_afficher(void) {
+    for (int i = 0; i < nb_controleurs; i++) {
+        Controleur *k = &controleurs[i];
+        int on = 0;
+        pthread_mutex_lock(&k->mutex);
+        printf("💡 %s :", k->ip);
+        for (int e = 0; e < 256; e++) {
+            if (!k->etats[e]) continue;
+            char bits[9];
+            input_texte((unsigned)e, bits);
+            printf(" %s", bits);
+            on++;
+        }
+        pthread_mutex_unlock(&k->mutex);
+        printf("%s (%d ON)\n", on ? "" : " -", on);
+    }
+    fflush(stdout);
+}
+
+// =========================================================
+// MAIN
+// =========================================================
+static int controleurs_lire(const char *liste) {
+    nb_controleurs = 0;
+    for (const char *p = liste; *p && nb_controleurs < MAX_CONTROLEURS;) {
+        char *fin;
+        long octet = strtol(p, &fin, 10);
+        if (fin == p || octet < 1 || octet > 254) return -1;
+        Controleur *k = &controleurs[nb_controleurs++];
+        k->octet = (int)octet;
+        k->port = port_base + (int)octet;
+        if (*fin == ':') k->port = (int)strtol(fin + 1, &fin, 10);
+        p = fin;
+        if (*p == ',') p++;
+    }
+    return nb_controleurs > 0 ? 0 : -1;
+}
+
+static int caps_lire(const char *liste) {
+    int caps = 0;
+    if (strcmp(liste, "aucune") == 0) return 0;
+    if (strstr(liste, "lot")) caps |= CAP_LOT;
+    if (strstr(liste, "bin1")) caps |= CAP_BIN1;
+    if (strstr(liste, "ack")) caps |= CAP_ACK;
+    return caps;
+}
+
+int main(int argc, char **argv) {
+    const char *liste = "100,103,110,113";
+    const char *fichier_db = NULL;
+    const char *fichier_journal = "-";
+    int periode_stats = 0;
+    for (int i = 1; i < argc; i++) {
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--sans-journal") == 0) { fichier_journal = NULL; continue; }
+        if (!val) {
+            fprintf(stderr, "Option inconnue ou sans valeur : %s\n", argv[i]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--hote") == 0) hote = val;
+        else if (strcmp(argv[i], "--base") == 0) port_base = atoi(val);
+        else if (strcmp(argv[i], "--controleurs") == 0) liste = val;
+        else if (strcmp(argv[i], "--reseau") == 0) reseau = val;
+        else if (strcmp(argv[i], "--caps") == 0) caps_annoncees = caps_lire(val);
+        else if (strcmp(argv[i], "--db") == 0) fichier_db = val;
+        else if (strcmp(argv[i], "--latence") == 0) latence_ms = atoi(val);
+        else if (strcmp(argv[i], "--gigue") == 0) gigue_ms = atoi(val);
+        else if (strcmp(argv[i], "--perte") == 0) taux_perte = atof(val);
+        else if (strcmp(argv[i], "--deconnexion") == 0) taux_deconnexion = atof(val);
+        else if (strcmp(argv[i], "--journal") == 0) fichier_journal = val;
+        else if (strcmp(argv[i], "--stats") == 0) periode_stats = atoi(val);
+        else {
+            fprintf(stderr, "Option inconnue : %s\n", argv[i]);
+            return 1;
+        }
+        i++;
+    }
+    if (controleurs_lire(liste) != 0) {
+        fprintf(stderr, "Liste de contrôleurs invalide : %s\n", liste);
+        return 1;
+    }
+    if (fichier_journal) {
+        journal = strcmp(fichier_journal, "-") == 0 ? stdout : fopen(fichier_journal, "a");
+        if (!journal) {
+            fprintf(stderr, "Journal %s impossible à ouvrir\n", fichier_journal);
+            return 1;
+        }
+    }
+    crc8_init();
+    for (int i = 0; i < nb_controleurs; i++) {
+        Controleur *k = &controleurs[i];
+        snprintf(k->ip, sizeof(k->ip), "%s%d", reseau, k->octet);
+        pthread_mutex_init(&k->mutex, NULL);
+    }
+    if (fichier_db && carte_charger(fichier_db) != 0) return 1;
+
+    // Signaux traités par le thread principal seulement (sigtimedwait)
+    sigset_t signaux;
+    sigemptyset(&signaux);
+    sigaddset(&signaux, SIGINT);
+    sigaddset(&signaux, SIGTERM);
+    sigaddset(&signaux, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signaux, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < nb_controleurs; i++) {
+        Controleur *k = &controleurs[i];
+        struct sockaddr_in adr;
+        memset(&adr, 0, sizeof(adr));
+        adr.sin_family = AF_INET;
+        adr.sin_port = htons((unsigned short)k->port);
+        int un = 1;
+        k->ecoute = socket(AF_INET, SOCK_STREAM, 0);
+        if (k->ecoute < 0 || inet_pton(AF_INET, hote, &adr.sin_addr) != 1
+            || setsockopt(k->ecoute, SOL_SOCKET, SO_REUSEADDR, &un, sizeof(un)) != 0
+            || bind(k->ecoute, (struct sockaddr *)&adr, sizeof(adr)) != 0
+            || listen(k->ecoute, 128) != 0) {
+            fprintf(stderr, "Écoute impossible sur %s:%d pour %s : %s\n", hote, k->port, k->ip, strerror(errno));
+            return 1;
+        }
+        pthread_t t;
+        if (pthread_create(&t, NULL, controleur_ecouter, k) != 0) {
+            fprintf(stderr, "Thread d'écoute non lancé pour %s\n", k->ip);
+            return 1;
+        }
+        printf("🎛️ Contrôleur %s simulé sur %s:%d\n", k->ip, hote, k->port);
+    }
+    printf("🧪 Simulateur prêt (caps:%s%s%s%s, latence %d+%d ms, perte %.1f %%, déconnexion %.1f %%)\n",
+           caps_annoncees ? "" : "aucune", caps_annoncees & CAP_LOT ? " lot" : "",
+           caps_annoncees & CAP_BIN1 ? " bin1" : "", caps_annoncees & CAP_ACK ? " ack" : "",
+           latence_ms, gigue_ms, taux_perte * 100, taux_deconnexion * 100);
+    fflush(stdout);
+
+    double prochain = horloge_ms() + periode_stats * 1000.0;
+    while (1) {
+        struct timespec attente = { 1, 0 };
+        int sig = sigtimedwait(&signaux, NULL, &attente);
+        if (sig == SIGINT || sig == SIGTERM) break;
+        if (sig == SIGUSR1) etats_afficher();
+        if (journal) {
+            pthread_mutex_lock(&mutex_journal);
+            fflush(journal);
+            pthread_mutex_unlock(&mutex_journal);
+        }
+        if (periode_stats > 0 && horloge_ms() >= prochain) {
+            bilan();
+            prochain += periode_stats * 1000.0;
+        }
+    }
+    if (journal) fflush(journal);
+    bilan();
+    etats_afficher();
+    return 0;
+}